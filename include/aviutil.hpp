@@ -7,12 +7,23 @@ Utility for writing RIFF chunks for AVI files
 #ifndef _AVIUTIL_HPP
 #define _AVIUTIL_HPP
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "jpegutil.hpp"
@@ -155,6 +166,23 @@ namespace Riff {
             virtual ~RiffHeaderOnly() {}
     };
     
+    /*
+    Zero-filled padding that readers skip
+    */
+    class RiffJunk : public RiffChunk {
+        public:
+            constexpr const static char *JUNK_ID = "JUNK";
+            RiffJunk(size_t dataSize) :
+                RiffChunk(JUNK_ID, dataSize) {}
+            virtual ~RiffJunk() {}
+            virtual void writeTo(std::ostream& stream);
+            /*
+            The whole size of the JUNK chunk that makes whatever follows it at position
+            start on a multiple of alignment, 0 if none is needed
+            */
+            static size_t padding(std::uint64_t position, size_t alignment);
+    };
+    
 }
 
 namespace Avi {
@@ -182,30 +210,240 @@ namespace Avi {
         }
     }
     
+    /*
+    The on-disk layouts of the AVI header structures.
+    Every field is stored little-endian as bytes, so the structs have no padding,
+    can be built as constants, and are written with a single stream.write.
+    */
+    namespace Raw {
+        
+        template <size_t N>
+        struct LE {
+            std::uint8_t bytes[N];
+            constexpr LE() : bytes {} {}
+            constexpr LE(std::uint32_t num) : bytes {}
+            {
+                for (size_t i = 0; i < N; i++) {
+                    bytes[i] = (std::uint8_t)(num >> (8 * i));
+                }
+            }
+            constexpr operator std::uint32_t() const
+            {
+                std::uint32_t num = 0;
+                for (size_t i = 0; i < N; i++) {
+                    num |= (std::uint32_t)bytes[i] << (8 * i);
+                }
+                return num;
+            }
+        };
+        
+        typedef LE<2> LE16;
+        typedef LE<4> LE32;
+        
+        struct FourCC {
+            char chars[Riff::FOURCC_SIZE];
+            constexpr FourCC() : chars {} {}
+            constexpr FourCC(const char *cc) : chars {cc[0], cc[1], cc[2], cc[3]} {}
+        };
+        
+        struct ChunkHeader {
+            FourCC id;
+            LE32 size;
+        };
+        
+        struct AviMainHeader {
+            LE32 microSecPerFrame;
+            LE32 maxBytesPerSec;
+            LE32 paddingGranularity;
+            LE32 flags;
+            LE32 totalFrames;
+            LE32 initialFrames;
+            LE32 streams;
+            LE32 suggestedBufferSize;
+            LE32 width;
+            LE32 height;
+            LE32 reserved[4];
+        };
+        
+        struct AviStreamHeader {
+            FourCC type;
+            FourCC handler;
+            LE32 flags;
+            LE16 priority;
+            LE16 language;
+            LE32 initialFrames;
+            LE32 scale;
+            LE32 rate;
+            LE32 start;
+            LE32 length;
+            LE32 suggestedBufferSize;
+            LE32 quality;
+            LE32 sampleSize;
+            LE16 left;
+            LE16 top;
+            LE16 right;
+            LE16 bottom;
+        };
+        
+        struct BitmapInfoHeader {
+            LE32 size;
+            LE32 width;
+            LE32 height;
+            LE16 planes;
+            LE16 bitCount;
+            FourCC compression;
+            LE32 sizeImage;
+            LE32 xPelsPerMeter;
+            LE32 yPelsPerMeter;
+            LE32 clrUsed;
+            LE32 clrImportant;
+        };
+        
+        struct WaveFormatEx {
+            LE16 formatTag;
+            LE16 channels;
+            LE32 samplesPerSec;
+            LE32 avgBytesPerSec;
+            LE16 blockAlign;
+            LE16 bitsPerSample;
+            LE16 extraSize;
+        };
+        
+        struct AviIndexEntry {
+            FourCC id;
+            LE32 flags;
+            LE32 offset;
+            LE32 size;
+        };
+        
+        /*
+        A whole chunk, its header followed by its body, as it is on disk
+        */
+        template <class T>
+        struct Chunk {
+            ChunkHeader header;
+            T body;
+        };
+        
+        static_assert(sizeof(ChunkHeader) == 8, "RIFF chunk header must be 8 bytes");
+        static_assert(sizeof(AviMainHeader) == 56, "AVIMAINHEADER must be 56 bytes");
+        static_assert(sizeof(AviStreamHeader) == 56, "AVISTREAMHEADER must be 56 bytes");
+        static_assert(sizeof(BitmapInfoHeader) == 40, "BITMAPINFOHEADER must be 40 bytes");
+        static_assert(sizeof(WaveFormatEx) == 18, "WAVEFORMATEX must be 18 bytes");
+        static_assert(sizeof(AviIndexEntry) == 16, "AVIINDEXENTRY must be 16 bytes");
+        static_assert(sizeof(Chunk<AviStreamHeader>) == 64, "chunks must have no padding");
+        
+        template <class T>
+        inline void write(std::ostream& stream, const T& raw)
+        {
+            stream.write(reinterpret_cast<const char*>(&raw), sizeof(T));
+        }
+    }
+    
+    /*
+    A frame rate as the exact fraction rate / scale, as strh stores it
+    */
+    struct FrameRate {
+        std::uint32_t rate;
+        std::uint32_t scale;
+        constexpr FrameRate(std::uint32_t rate, std::uint32_t scale) :
+            rate {rate},
+            scale {scale} {}
+        /*
+        Recognizes the NTSC rates (29.97 is 30000/1001 and so on),
+        anything else is kept to a thousandth of a frame
+        */
+        FrameRate(float fps);
+        inline double toDouble() const
+        {
+            return (double)rate / scale;
+        }
+    };
+    
+    /*
+    (a * b + c / 2) / c without overflowing
+    */
+    std::uint64_t mulDiv(std::uint64_t a, std::uint64_t b, std::uint64_t c);
+    
+    /*
+    An exact timestamp, in ticks of scale / rate seconds
+    */
+    struct MediaTime {
+        std::uint64_t ticks;
+        std::uint32_t scale;
+        std::uint32_t rate;
+        constexpr MediaTime() :
+            ticks {0},
+            scale {1},
+            rate {1} {}
+        constexpr MediaTime(std::uint64_t ticks, std::uint32_t scale, std::uint32_t rate) :
+            ticks {ticks},
+            scale {scale},
+            rate {rate} {}
+        /*
+        Rounds to the microsecond
+        */
+        MediaTime(double seconds) :
+            ticks {(std::uint64_t)(seconds * 1000000 + 0.5)},
+            scale {1},
+            rate {1000000} {}
+        inline double seconds() const
+        {
+            return (double)ticks * scale / rate;
+        }
+        /*
+        Compares exactly, ticks * scale / rate against the other's
+        */
+        bool operator<(const MediaTime& other) const;
+    };
+    
+    /*
+    The CRC32C (Castagnoli) of size bytes, continuing from crc, the CRC of whatever came before.
+    Uses the SSE4.2 instruction where the CPU has it, on three streams at once
+    combined with PCLMULQDQ where it has that too.
+    */
+    std::uint32_t crc32c(const void *data, size_t size, std::uint32_t crc = 0);
+    
     class IndexEntry {
         private:
             constexpr const static char *OLDINDEX_ID = "idx1";
-            float seconds;
-            size_t offset;
-            size_t size;
-            std::uint32_t flags;
-            char fourCC[Riff::FOURCC_SIZE];
+            MediaTime time;
+            Raw::AviIndexEntry raw;
+            std::uint32_t checksum;
         
         public:
             IndexEntry(
-                float seconds,
+                const MediaTime& time,
                 size_t offset, size_t size,
                 std::uint32_t flags = 0) :
-                    seconds {seconds},
-                    offset {offset},
-                    size {size},
-                    flags {flags} {}
+                    time {time},
+                    raw {Raw::FourCC(), flags, (std::uint32_t)offset, (std::uint32_t)size},
+                    checksum {0} {}
+            
+            inline void setChecksum(std::uint32_t checksum)
+            {
+                this->checksum = checksum;
+            }
+            
+            inline std::uint32_t getChecksum() const
+            {
+                return checksum;
+            }
             
             void match(const Riff::RiffData& rd);
+            inline void match(const char *fourCC)
+            {
+                raw.id = Raw::FourCC(fourCC);
+            }
             
             inline bool operator<(const IndexEntry& other) const
             {
-                return seconds < other.seconds;
+                return time < other.time;
+            }
+            
+            inline const Raw::AviIndexEntry& toRaw() const
+            {
+                return raw;
             }
             
             friend std::vector<std::uint8_t>& operator<<(
@@ -219,12 +457,12 @@ namespace Avi {
         private:
             constexpr const static char *AVIMAIN_ID = "avih";
         public:
-            float fps;
+            FrameRate fps;
             size_t numFrames;
             unsigned int numStreams;
             unsigned int width;
             unsigned int height;
-            AviMainHeader(float fps, unsigned int width, unsigned int height) :
+            AviMainHeader(FrameRate fps, unsigned int width, unsigned int height) :
                 RiffChunk(AVIMAIN_ID),
                 fps {fps},
                 width {width},
@@ -256,36 +494,77 @@ namespace Avi {
             constexpr const static char *RAW_VIDEO_ID = "db";
             constexpr const static char *VIDEO_ID = "dc";
             const char *idCode;
-            unsigned int rate, scale;
+            std::uint32_t rate, scale;
             unsigned int width, height;
             size_t length;
             char handler[Riff::FOURCC_SIZE];
-            float time;
+            std::uint64_t ticks;
+            std::uint32_t start;
+            /*
+            Filled in place and written with one store on every header rewrite
+            */
+            Raw::Chunk<Raw::AviStreamHeader> strh;
+            /*
+            Writes the strf chunk, which doesn't change once the stream exists
+            */
+            virtual void writeStrf(std::ostream& stream) = 0;
         public:
             const StreamType type;
             size_t biggestChunk;
             AviStream(
-                StreamType type, float fps,
-                const char *handler = DEFAULT_HANDLER, unsigned int scale = 1,
+                StreamType type, FrameRate fps,
+                const char *handler = DEFAULT_HANDLER,
                 unsigned int width = 0, unsigned int height = 0);
             virtual ~AviStream() {}
-            Riff::RiffData getStrhChunk() const;
-            virtual Riff::RiffData getStrfChunk() = 0;
             Riff::RiffData dataToChunk(
                 const std::uint8_t *data, size_t size, size_t streamNo) const;
+            /*
+            The ##xx FourCC of this stream's data chunks
+            */
+            Raw::FourCC chunkId(size_t streamNo) const;
             virtual void writeTo(std::ostream& stream);
             inline void updateChunkSize(size_t size)
             {
                 biggestChunk = std::max(biggestChunk, size);
                 length++;
             }
-            inline float getTime() const
+            inline MediaTime getTime() const
+            {
+                return MediaTime(ticks, scale, rate);
+            }
+            inline std::uint64_t getTicks() const
+            {
+                return ticks;
+            }
+            inline FrameRate getRate() const
+            {
+                return FrameRate(rate, scale);
+            }
+            /*
+            Only before the stream's first chunk, since ticks are counted in it
+            */
+            inline void setRate(FrameRate fps)
             {
-                return time;
+                rate = fps.rate;
+                scale = fps.scale;
             }
             inline void increment()
             {
-                time += (float)scale / rate;
+                ticks++;
+            }
+            /*
+            Ticks the stream is delayed by relative to the others, written on the next header rewrite
+            */
+            inline void setStart(std::uint32_t ticks)
+            {
+                start = ticks;
+            }
+            /*
+            The chunk slot that starts nearest to micros microseconds
+            */
+            inline std::uint64_t slotAt(std::uint64_t micros) const
+            {
+                return mulDiv(micros, rate, (std::uint64_t)scale * 1000000);
             }
     };
     
@@ -293,12 +572,35 @@ namespace Avi {
         private:
             constexpr const static char *MJPEG_HANDLER = "MJPG";
             Jpeg::JpegSettings settings;
+            Raw::Chunk<Raw::BitmapInfoHeader> strf;
+        protected:
+            virtual void writeStrf(std::ostream& stream);
         public:
-            AviMjpegStream(const Jpeg::JpegSettings& settings, float fps) :
-                AviStream(VIDEO, fps, MJPEG_HANDLER, 1, settings.size.first, settings.size.second),
-                settings {settings} {idCode = VIDEO_ID;}
+            AviMjpegStream(const Jpeg::JpegSettings& settings, FrameRate fps);
             virtual ~AviMjpegStream() {}
-            virtual Riff::RiffData getStrfChunk();
+            inline const Jpeg::JpegSettings& getSettings() const
+            {
+                return settings;
+            }
+    };
+    
+    /*
+    Uncompressed DIB frames, stored in db chunks
+    */
+    class AviRawVideoStream : public AviStream {
+        private:
+            unsigned int bitsPerPixel;
+            Raw::Chunk<Raw::BitmapInfoHeader> strf;
+        protected:
+            virtual void writeStrf(std::ostream& stream);
+        public:
+            AviRawVideoStream(
+                unsigned int width, unsigned int height, FrameRate fps, unsigned int bitsPerPixel = 24);
+            virtual ~AviRawVideoStream() {}
+            inline size_t frameSize() const
+            {
+                return ((width * bitsPerPixel + 31) / 32) * 4 * height;
+            }
     };
     
     class AviFlacStream : public AviStream {
@@ -306,21 +608,30 @@ namespace Avi {
             Flac::FlacEncodeOptions settings;
             Flac::Flac flac;
             std::streampos strhOffset;
+            /*
+            The whole strf chunk, WAVEFORMATEX and the encoder's STREAMINFO,
+            which never change, so it is built once
+            */
+            std::vector<std::uint8_t> strf;
+        protected:
+            virtual void writeStrf(std::ostream& stream);
         public:
             AviFlacStream(const Flac::FlacEncodeOptions& settings) :
-                AviStream(AUDIO, (float)settings.sampleRate / settings.blockSize,
-                    DEFAULT_HANDLER, settings.blockSize),
+                AviStream(AUDIO, FrameRate(settings.sampleRate, settings.blockSize), DEFAULT_HANDLER),
                 flac(settings),
                 settings {settings},
                 strhOffset {0} {
                     idCode = AUDIO_ID;
                 }
             virtual ~AviFlacStream() {}
-            virtual Riff::RiffData getStrfChunk();
             inline Flac::Flac& getFlac()
             {
                 return flac;
             }
+            inline const Flac::FlacEncodeOptions& getSettings() const
+            {
+                return settings;
+            }
             inline void markOffset(std::streampos offset)
             {
                 strhOffset = offset;
@@ -381,6 +692,262 @@ namespace Avi {
             }
     };
     
+    /*
+    Latency histograms and heap allocation counts for the calls that write a file,
+    shared by every recording in the process. The library only records into it
+    when built with AVIUTIL_PROFILE (make PROFILE=1), and then also replaces the
+    global operator new to count allocations, unless AVIUTIL_PROFILE_NO_NEW is
+    defined for programs with allocators of their own, which call countAllocation.
+    Inline code in this header always creates its Scopes, which only measure
+    in a library built with AVIUTIL_PROFILE, so programs may be built either way.
+    */
+    class Profiler {
+        public:
+            enum Section {
+                WRITE_VIDEO_FRAME = 0,
+                WRITE_SAMPLES = 1,
+                WRITE_FRAME = 2,
+                HEADER_REWRITE = 3,
+                FINALIZE = 4,
+                SECTIONS = 5
+            };
+            /*
+            Records the time and the allocations made on its thread from construction to destruction.
+            A scope inside another of the same section on the same thread isn't recorded on its own,
+            and neither is one that isn't enabled.
+            */
+            class Scope {
+                private:
+                    Section section;
+                    bool enabled;
+                    bool outer;
+                    std::chrono::steady_clock::time_point start;
+                    std::uint64_t allocations;
+                    std::uint64_t bytes;
+                public:
+                    Scope(Section section, bool enabled = true);
+                    ~Scope();
+                    Scope(const Scope&) = delete;
+                    Scope& operator=(const Scope&) = delete;
+            };
+        private:
+            /*
+            16 buckets for each power of two of nanoseconds, about 6% wide
+            */
+            constexpr static const size_t SUB_BUCKETS = 16;
+            constexpr static const size_t BUCKETS = 64 * SUB_BUCKETS;
+            struct Histogram {
+                std::atomic<std::uint64_t> buckets[BUCKETS];
+                std::atomic<std::uint64_t> calls;
+                std::atomic<std::uint64_t> maxNanos;
+                std::atomic<std::uint64_t> allocations;
+                std::atomic<std::uint64_t> bytes;
+                std::atomic<std::uint64_t> maxAllocations;
+            };
+            Histogram histograms[SECTIONS];
+            std::atomic<std::ostream*> reportStream;
+            static size_t bucketOf(std::uint64_t nanos);
+            /*
+            The largest time in the bucket
+            */
+            static std::uint64_t bucketLimit(size_t bucket);
+        public:
+            Profiler();
+            Profiler(const Profiler&) = delete;
+            Profiler& operator=(const Profiler&) = delete;
+            static Profiler& global();
+            /*
+            Counts an allocation made on the calling thread
+            */
+            static void countAllocation(size_t bytes);
+            void record(Section section, std::uint64_t nanos, std::uint64_t allocations, std::uint64_t bytes);
+            /*
+            The time in nanoseconds that fraction of the section's calls took at most
+            */
+            std::uint64_t percentile(Section section, double fraction) const;
+            inline std::uint64_t getCalls(Section section) const
+            {
+                return histograms[section].calls.load(std::memory_order_relaxed);
+            }
+            inline std::uint64_t getAllocations(Section section) const
+            {
+                return histograms[section].allocations.load(std::memory_order_relaxed);
+            }
+            /*
+            A line per section: calls, p50, p99, p99.9 and max in microseconds,
+            and allocations and bytes per call
+            */
+            void report(std::ostream& stream) const;
+            void reset();
+            /*
+            Where fileFinished reports to, nullptr (the default) for nowhere.
+            The stream has to outlive the recordings.
+            */
+            inline void setReportStream(std::ostream *stream)
+            {
+                reportStream = stream;
+            }
+            /*
+            Called by the library as each file is finalized: reports to the report
+            stream, if there is one, and then starts counting again
+            */
+            void fileFinished();
+    };
+    
+#ifdef AVIUTIL_PROFILE
+#define AVIUTIL_PROFILE_SCOPE(section) ::Avi::Profiler::Scope profileScope(::Avi::Profiler::section)
+#define AVIUTIL_PROFILE_SCOPE_IF(section, condition) \
+    ::Avi::Profiler::Scope profileScope(::Avi::Profiler::section, condition)
+#else
+#define AVIUTIL_PROFILE_SCOPE(section)
+#define AVIUTIL_PROFILE_SCOPE_IF(section, condition)
+#endif
+    
+    /*
+    A chunk as a ChunkTap consumer sees it. data points into the tap's buffer
+    and is only good while ChunkTap::Consumer::valid says so.
+    */
+    struct TapChunk {
+        std::uint64_t sequence;
+        size_t streamNo;
+        MediaTime time;
+        std::uint32_t flags;
+        const std::uint8_t *data;
+        size_t size;
+        /* Where the payload starts in the tap's buffer, counting every byte ever written */
+        std::uint64_t offset;
+    };
+    
+    /*
+    Publishes the chunks an Avi writes to any number of readers on other threads,
+    or in other processes through a named POSIX shared memory segment.
+    One writer copies each chunk once into a ring buffer and never waits;
+    readers get views into it. A reader the writer has overtaken is dropped.
+    Chunks bigger than the buffer are published without their data, as null.
+    
+    The ring is one block of memory, laid out in the writer's byte order as
+        64 byte header:
+            magic "AVITAP01", bufferSize (u64), numSlots (u64),
+            head (u64, chunks published), reclaimed (u64, bytes before it may be overwritten)
+        numSlots 48 byte slots:
+            sequence (u64), streamNo (u32), flags (u32), ticks (u64), scale (u32), rate (u32),
+            offset (u64), size (u64)
+        bufferSize bytes of payloads
+    Chunk n is in slot n % numSlots, whose sequence is 2n + 1 while it is written
+    and 2n + 2 after. Its payload starts at offset % bufferSize and doesn't wrap;
+    offset is all ones for a chunk without data.
+    */
+    class ChunkTap {
+        public:
+            constexpr static const size_t DEFAULT_BUFFER_SIZE = 16 << 20;
+            constexpr static const size_t DEFAULT_SLOTS = 1024;
+            
+            /*
+            Reads chunks from the tap, starting with the first one published after subscribe
+            */
+            class Consumer {
+                private:
+                    const ChunkTap *tap;
+                    std::uint64_t next;
+                    bool dropped;
+                public:
+                    Consumer(const ChunkTap& tap, std::uint64_t next) :
+                        tap {&tap},
+                        next {next},
+                        dropped {false} {}
+                    /*
+                    Takes the next chunk, false if there is none yet or the reader was dropped
+                    */
+                    bool poll(TapChunk& chunk);
+                    /*
+                    Whether the chunk's data hasn't been overwritten yet.
+                    Check after reading the data, a reader that fails is dropped.
+                    */
+                    bool valid(const TapChunk& chunk);
+                    inline bool isDropped() const
+                    {
+                        return dropped;
+                    }
+            };
+        private:
+            constexpr static const size_t HEADER_SIZE = 64;
+            struct Header {
+                char magic[8];
+                std::uint64_t bufferSize;
+                std::uint64_t numSlots;
+                std::atomic<std::uint64_t> head;
+                std::atomic<std::uint64_t> reclaimed;
+            };
+            struct Slot {
+                std::atomic<std::uint64_t> sequence;
+                std::atomic<std::uint32_t> streamNo;
+                std::atomic<std::uint32_t> flags;
+                std::atomic<std::uint64_t> ticks;
+                std::atomic<std::uint32_t> scale;
+                std::atomic<std::uint32_t> rate;
+                std::atomic<std::uint64_t> offset;
+                std::atomic<std::uint64_t> size;
+            };
+            /* The ring when it is private to the process */
+            std::unique_ptr<std::uint64_t[]> memory;
+            /* The ring when it is a shared memory segment */
+            void *mapping;
+            size_t mappingSize;
+            std::string name;
+            /* Whether this tap writes the ring, and removes the segment's name */
+            bool owner;
+            Header *header;
+            Slot *slots;
+            std::uint8_t *buffer;
+            size_t slotMask;
+            size_t bufferSize;
+            /* The writer's end of the buffer, counting every byte ever written */
+            std::uint64_t bufferEnd;
+            static size_t ringSize(size_t bufferSize, size_t numSlots);
+            /*
+            Points header, slots and buffer into the ring at base
+            */
+            void place(void *base);
+            /*
+            Fills in a new ring's header and slots
+            */
+            void format(size_t bufferSize, size_t numSlots);
+        public:
+            /*
+            A ring private to the process. numSlots is rounded up to a power of two.
+            */
+            ChunkTap(size_t bufferSize = DEFAULT_BUFFER_SIZE, size_t numSlots = DEFAULT_SLOTS);
+            /*
+            A ring in the shared memory segment name, e.g. "/preview", replacing any
+            segment of that name. The destructor removes the name; readers that have
+            it mapped keep their mapping. Check isOpen, it fails outside Linux.
+            */
+            ChunkTap(const std::string& name, size_t bufferSize, size_t numSlots);
+            /*
+            Maps the segment another process publishes to, read only, for subscribe.
+            Check isOpen.
+            */
+            explicit ChunkTap(const std::string& name);
+            ~ChunkTap();
+            ChunkTap(const ChunkTap&) = delete;
+            ChunkTap& operator=(const ChunkTap&) = delete;
+            inline bool isOpen() const
+            {
+                return header != nullptr;
+            }
+            /*
+            Only ever called from one thread at a time; does nothing on a tap mapped for reading
+            */
+            void publish(
+                size_t streamNo, const MediaTime& time, std::uint32_t flags,
+                const std::uint8_t *data, size_t size);
+            Consumer subscribe() const;
+            inline std::uint64_t getPublished() const
+            {
+                return header == nullptr ? 0 : header->head.load(std::memory_order_relaxed);
+            }
+    };
+    
     class Avi : public Riff::RiffFile {
         private:
             constexpr const static char *AVI_ID = "AVI ";
@@ -389,39 +956,118 @@ namespace Avi {
             AviHdrl headerList;
             Riff::RiffList moviList;
             size_t moviOffset;
+            size_t alignment;
+            bool alignVideo;
+            ChunkTap *tap;
+            bool checksums;
+            /* The first video stream, the only one counted in avih */
+            size_t primaryVideo;
+            /* The first PTS given to writeFrameAt, which every later one is counted from */
+            std::uint64_t ptsBase;
+            bool havePtsBase;
+            std::uint64_t maxGap;
+            /*
+            Pads with a JUNK chunk so the next one starts aligned
+            */
+            void writeJunk(std::ostream& stream, std::uint64_t position);
         public:
+            /* Drop chunks writeFrameAt fills one gap with at most, 10 s at 30 fps */
+            constexpr static const std::uint64_t DEFAULT_MAX_GAP = 300;
             Avi(const AviMainHeader& avih) :
                 Riff::RiffFile(AVI_ID), 
                 headerList(avih),
                 moviList(MOVI_ID),
-                moviOffset {0} {}
+                moviOffset {0},
+                alignment {0},
+                alignVideo {false},
+                tap {nullptr},
+                checksums {false},
+                primaryVideo {(size_t)-1},
+                ptsBase {0},
+                havePtsBase {false},
+                maxGap {DEFAULT_MAX_GAP} {}
             inline AviStream& operator[](size_t index)
             {
                 return headerList[index];
             }
+            inline size_t streamCount() const
+            {
+                return headerList.avih.numStreams;
+            }
+            /*
+            Pads the file with JUNK chunks so the movi list, idx1 and, if everyVideoChunk
+            is set, each video chunk start on a multiple of alignment bytes,
+            e.g. the 4096 byte blocks of a DirectFileBuf. 0 turns it off.
+            Takes effect at writeBeforeFrames.
+            */
+            inline void setAlignment(size_t alignment, bool everyVideoChunk = false)
+            {
+                this->alignment = alignment;
+                alignVideo = everyVideoChunk;
+            }
+            /*
+            Keeps the CRC32C of every chunk written from now on, and writes them
+            after idx1 in a c32c chunk, see verifyChecksums
+            */
+            inline void setChecksums(bool enable)
+            {
+                checksums = enable;
+            }
+            /*
+            Publishes every chunk written from now on to tap, nullptr stops.
+            The tap has to outlive the writes.
+            */
+            inline void setTap(ChunkTap *tap)
+            {
+                this->tap = tap;
+            }
             /*
             Writes the chunk to the stream,
             Pushes the indexentry into the index,
             Updates the stream's length and biggestChunk params
             */
-            void writeFrame(
+            virtual void writeFrame(
                 std::ostream& stream,
                 size_t streamNo,
-                float seconds, std::uint32_t flags, 
+                const MediaTime& time, std::uint32_t flags, 
                 const std::uint8_t *data, size_t size);
             inline void writeFrame(
                 std::ostream& stream,
                 size_t streamNo,
-                float seconds, std::uint32_t flags, 
+                const MediaTime& time, std::uint32_t flags, 
                 const std::vector<std::uint8_t>& data)
             {
-                writeFrame(stream, streamNo, seconds, flags, data.data(), data.size());
+                writeFrame(stream, streamNo, time, flags, data.data(), data.size());
+            }
+            /*
+            Most drop chunks writeFrameAt writes for one gap
+            */
+            inline void setMaxGap(std::uint64_t slots)
+            {
+                maxGap = slots;
             }
+            /*
+            Writes the chunk in the stream's slot nearest to pts, a capture time in microseconds
+            counted from the first pts given to any stream, after writing empty drop chunks
+            for every slot skipped since the last one.
+            A frame whose slot was already written goes in the next free slot.
+            Advances the stream's clock past the chunk.
+            Returns false, writing nothing, if the stream's rate or scale is 0
+            or the gap would take more than the maximum number of drop chunks.
+            */
+            bool writeFrameAt(
+                std::ostream& stream,
+                size_t streamNo,
+                std::uint64_t pts, std::uint32_t flags,
+                const std::uint8_t *data, size_t size);
     
             template <class T>
             inline void addStream(T stream)
             {
                 // headerList.strl.addStream(stream);
+                if (stream.type == VIDEO && primaryVideo == (size_t)-1) {
+                    primaryVideo = headerList.avih.numStreams;
+                }
                 headerList.addStream(stream);
                 headerList.avih.numStreams++;
             }
@@ -441,52 +1087,1161 @@ namespace Avi {
             void writeAfterFrames(std::ostream& stream);
     };
     
-    enum EncodingMode {
-        FAST = 0,
-        NORMAL = 1,
-        CAREFUL = 2,
-        FRUGAL = 3,
-        ENCODING_MODES = 4
-    };
-    
-    class FlacMjpegAvi : public Avi {
-        protected:
-            constexpr static const int FLAC_STR = 1;
-            constexpr static const int MJPG_STR = 0;
-            std::stringstream sstr;
-            std::unique_ptr<Flac::Flac> flac;
-            std::unique_ptr<Jpeg::Jpeg> jpeg;
-            void writeSamples(std::ostream& stream);
+    /*
+    An output file buffer for O_DIRECT files, which bypass the page cache.
+    Everything goes to the file in whole, aligned blocks from an aligned buffer;
+    seeking back to rewrite headers reads the blocks it touches and writes them back.
+    The file is cut to its real length on close.
+    Falls back to ordinary writes where the filesystem refuses O_DIRECT.
+    Linux only, open fails elsewhere.
+    */
+    class DirectFileBuf : public std::streambuf {
         public:
-            FlacMjpegAvi(
-                int width, int height, float fps = 30.0,
-                int bitsPerSample = 16, float sampleRate = 44100, int numChannels = 1,
-                EncodingMode mode = NORMAL, int jpegQuality = 50);
-            FlacMjpegAvi(
-                const Jpeg::JpegSettings& jpegSettings,
-                const Flac::FlacEncodeOptions& flacSettings,
-                float fps = 30.0);
-            
-            void prepare(std::ostream& stream);
-            
-            void finish(std::ostream& stream);
-            
-            void writeVideoFrame(std::ostream& stream, const std::uint8_t *rgb);
+            constexpr static const size_t DEFAULT_BLOCK_SIZE = 4096;
+            constexpr static const size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+        private:
+            int fd;
+            bool direct;
+            size_t blockSize;
+            size_t bufferSize;
+            char *buffer;
+            /* File offsets of the buffer, its blocks read or cleared so far, and the bytes changed */
+            std::uint64_t windowStart;
+            std::uint64_t loadedEnd;
+            std::uint64_t dirtyStart;
+            std::uint64_t dirtyEnd;
+            /* Bytes the file holds on disk, a whole number of blocks, and its real length */
+            std::uint64_t diskSize;
+            std::uint64_t fileSize;
             
-            template <class T>
-            inline void writeSamples(std::ostream& stream, const std::vector<T>& samples)
+            inline std::uint64_t position() const
             {
-                *flac << samples;
-                writeSamples(stream);
+                return windowStart + (pptr() - pbase());
             }
-            
-            inline void writeVideoFrame(std::ostream& stream, const std::vector<std::uint8_t>& rgb)
+            /*
+            Makes the buffer hold the file's blocks up to end
+            */
+            bool load(std::uint64_t end);
+            /*
+            Writes the changed blocks
+            */
+            bool flushWindow();
+            /*
+            Moves the buffer to hold position, writing it out first if it doesn't
+            */
+            bool moveTo(std::uint64_t position);
+        protected:
+            virtual int_type overflow(int_type c);
+            virtual int sync();
+            virtual pos_type seekoff(
+                off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+            virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+        public:
+            DirectFileBuf();
+            virtual ~DirectFileBuf();
+            DirectFileBuf(const DirectFileBuf&) = delete;
+            DirectFileBuf& operator=(const DirectFileBuf&) = delete;
+            /*
+            Creates or truncates the file.
+            blockSize must be a multiple of the device's logical block size,
+            bufferSize is rounded up to a multiple of it.
+            */
+            bool open(
+                const std::string& path,
+                size_t blockSize = DEFAULT_BLOCK_SIZE, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+            /*
+            Writes what is buffered and sets the file's length
+            */
+            bool close();
+            inline bool isOpen() const
             {
-                writeVideoFrame(stream, rgb.data());
+                return fd >= 0;
+            }
+            /*
+            Whether the file really is open with O_DIRECT
+            */
+            inline bool isDirect() const
+            {
+                return direct;
             }
-            
     };
     
+    /*
+    An ostream over a DirectFileBuf
+    */
+    class DirectFileStream : public std::ostream {
+        private:
+            DirectFileBuf buf;
+        public:
+            DirectFileStream() : std::ostream(&buf) {}
+            DirectFileStream(
+                const std::string& path,
+                size_t blockSize = DirectFileBuf::DEFAULT_BLOCK_SIZE,
+                size_t bufferSize = DirectFileBuf::DEFAULT_BUFFER_SIZE) :
+                std::ostream(&buf)
+            {
+                open(path, blockSize, bufferSize);
+            }
+            inline void open(
+                const std::string& path,
+                size_t blockSize = DirectFileBuf::DEFAULT_BLOCK_SIZE,
+                size_t bufferSize = DirectFileBuf::DEFAULT_BUFFER_SIZE)
+            {
+                if (!buf.open(path, blockSize, bufferSize)) {
+                    setstate(std::ios_base::failbit);
+                }
+            }
+            inline void close()
+            {
+                if (!buf.close()) {
+                    setstate(std::ios_base::failbit);
+                }
+            }
+            inline bool is_open() const
+            {
+                return buf.isOpen();
+            }
+            inline DirectFileBuf *rdbuf()
+            {
+                return &buf;
+            }
+    };
+    
+    /*
+    Where the pieces of an existing AVI file are, as found by readLayout
+    All offsets are absolute file positions
+    */
+    struct AviLayout {
+        struct Stream {
+            size_t strhOffset;
+            std::vector<std::uint8_t> strh;
+            std::vector<std::uint8_t> strf;
+            StreamType type;
+            std::uint32_t scale, rate, start, sampleSize;
+        };
+        struct Entry {
+            char fourCC[Riff::FOURCC_SIZE];
+            std::uint32_t flags;
+            std::uint64_t offset;
+            std::uint32_t size;
+            size_t streamNo;
+            /* From the c32c chunk, 0 without one */
+            std::uint32_t checksum;
+        };
+        /*
+        The whole hdrl list, header included
+        */
+        std::vector<std::uint8_t> hdrl;
+        size_t avihOffset;
+        std::vector<Stream> streams;
+        std::uint64_t moviOffset;
+        std::uint64_t moviEnd;
+        /*
+        idx1 in its own order, with offsets pointing at each chunk's header.
+        Files this library writes keep idx1 in time order, so chunks of different
+        streams aren't necessarily in file order; sort by offset for that.
+        */
+        std::vector<Entry> index;
+        /*
+        Whether the file has a c32c chunk for its idx1, and if so whether idx1 itself matches
+        */
+        bool hasChecksums;
+        bool indexIntact;
+    };
+    
+    bool readLayout(std::FILE *file, AviLayout& layout);
+    
+    /*
+    What verifyChecksums found: how many chunks it checked and the positions in
+    AviLayout::index of those whose data no longer matches
+    */
+    struct ChecksumReport {
+        bool indexIntact;
+        size_t checked;
+        std::vector<size_t> corrupt;
+    };
+    
+    /*
+    Checks every chunk of a file written with Avi::setChecksums against its CRC32C,
+    reading with numThreads threads, 0 for one per core.
+    Returns false if the file can't be read or has no checksums.
+    */
+    bool verifyChecksums(const std::string& path, ChecksumReport& report, size_t numThreads = 0);
+    
+    /*
+    Joins the inputs into one file by copying their movi chunks as they are.
+    Every input must have identical strh (besides length/buffer size) and strf.
+    The output has checksums if every input has them.
+    Returns false if they don't, or if a file could not be read or written.
+    */
+    bool concatenate(const std::vector<std::string>& inputs, const std::string& output);
+    
+    /*
+    Copies the chunks covering [start, end) seconds without re-encoding.
+    Video starts at the last keyframe at or before start, other streams keep every
+    chunk that overlaps the range from there. Each stream's strh start is set to
+    when its first kept chunk plays, counted from the earliest one, to the nearest tick.
+    The output has checksums if the input has them.
+    */
+    bool trim(const std::string& input, const std::string& output, double start, double end);
+    
+    /*
+    A single thread that runs posted jobs in the order they were posted
+    */
+    class SerialWorker {
+        private:
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::deque<std::packaged_task<void()>> jobs;
+            bool stopping;
+            std::thread thread;
+            void run();
+        public:
+            SerialWorker();
+            /*
+            Runs every job still queued, then joins the thread
+            */
+            ~SerialWorker();
+            SerialWorker(const SerialWorker&) = delete;
+            SerialWorker& operator=(const SerialWorker&) = delete;
+            /*
+            Ready once the job has run. An exception the job throws goes to the
+            future rather than out of the thread, which carries on with the next job.
+            */
+            std::future<void> post(std::function<void()> job);
+    };
+    
+    /*
+    A pool of encoding threads shared by any number of recordings.
+    Each thread has its own queues of jobs, one per priority, and takes from
+    the others when it runs out. Recordings submit through a Queue, which
+    limits how many of their jobs are in the pool at once.
+    */
+    class Scheduler {
+        public:
+            enum Priority {
+                HIGH = 0,
+                NORMAL = 1,
+                LOW = 2,
+                PRIORITIES = 3
+            };
+            
+            /*
+            One recording's (or stream's) share of the pool.
+            At most maxInFlight of its jobs are handed to the pool at a time,
+            the rest wait here in order; with maxInFlight 1 jobs run one after another.
+            The destructor waits for every posted job to finish.
+            */
+            class Queue {
+                private:
+                    Scheduler& scheduler;
+                    std::mutex mutex;
+                    std::condition_variable cv;
+                    std::deque<std::function<void()>> backlog;
+                    size_t maxInFlight;
+                    size_t inFlight;
+                    std::atomic<int> priority;
+                    std::atomic<size_t> completed;
+                    size_t peakDepth;
+                    void dispatch(std::function<void()> job);
+                public:
+                    Queue(Scheduler& scheduler, Priority priority = NORMAL, size_t maxInFlight = 1);
+                    ~Queue();
+                    Queue(const Queue&) = delete;
+                    Queue& operator=(const Queue&) = delete;
+                    void post(std::function<void()> job);
+                    inline void setPriority(Priority priority)
+                    {
+                        this->priority = priority;
+                    }
+                    /*
+                    Jobs posted but not yet finished
+                    */
+                    size_t depth();
+                    size_t getPeakDepth();
+                    inline size_t getCompleted() const
+                    {
+                        return completed;
+                    }
+            };
+        private:
+            struct WorkerQueues {
+                std::mutex mutex;
+                std::deque<std::function<void()>> jobs[PRIORITIES];
+                /* jobs[p].size(), readable without the mutex */
+                std::atomic<size_t> sizes[PRIORITIES] {};
+            };
+            std::vector<std::unique_ptr<WorkerQueues>> queues;
+            std::vector<std::thread> threads;
+            std::mutex sleepMutex;
+            std::condition_variable sleepCv;
+            std::atomic<size_t> queued;
+            /* Jobs queued at each priority, over all threads */
+            std::atomic<size_t> pending[PRIORITIES];
+            std::atomic<size_t> executed;
+            std::atomic<size_t> steals;
+            std::atomic<size_t> nextQueue;
+            bool stopping;
+            void run(size_t index);
+            bool take(size_t index, std::function<void()>& job);
+        public:
+            /*
+            0 threads means one per core
+            */
+            Scheduler(size_t numThreads = 0);
+            /*
+            Runs every job still queued, then joins the threads
+            */
+            ~Scheduler();
+            Scheduler(const Scheduler&) = delete;
+            Scheduler& operator=(const Scheduler&) = delete;
+            
+            /*
+            The process-wide pool, created on first use
+            */
+            static Scheduler& shared();
+            
+            /*
+            Jobs posted from one of this pool's threads stay on that thread's queue
+            */
+            void post(std::function<void()> job, Priority priority = NORMAL);
+            
+            inline size_t numThreads() const
+            {
+                return threads.size();
+            }
+            /*
+            Jobs waiting for a thread
+            */
+            inline size_t getQueued() const
+            {
+                return queued;
+            }
+            inline size_t getExecuted() const
+            {
+                return executed;
+            }
+            /*
+            Jobs a thread took from another thread's queue
+            */
+            inline size_t getSteals() const
+            {
+                return steals;
+            }
+    };
+    
+    /*
+    Encodes each frame as horizontal slices on several threads and joins them
+    into one baseline JPEG, with a restart marker (RSTn) between slices.
+    The slices must come out with identical tables, so this needs fixed Huffman
+    tables; encode returns false whenever a frame can't be joined.
+    */
+    class SlicedJpegEncoder {
+        public:
+            /*
+            Slice heights are a multiple of this, so slices end on MCU rows
+            */
+            constexpr static const unsigned int SLICE_ALIGN = 16;
+        private:
+            struct Slice {
+                std::unique_ptr<Jpeg::Jpeg> jpeg;
+                /* Encoders for the other qualities setQuality has switched to */
+                std::map<int, std::unique_ptr<Jpeg::Jpeg>> cached;
+                std::unique_ptr<SerialWorker> worker;
+                size_t firstRow;
+                size_t rows;
+                std::string out;
+            };
+            unsigned int width, height;
+            Jpeg::JpegSettings settings;
+            std::vector<Slice> slices;
+            void encodeSlice(Slice& slice, const std::uint8_t *rgb);
+        public:
+            SlicedJpegEncoder(const Jpeg::JpegSettings& settings, size_t numSlices);
+            inline size_t numSlices() const
+            {
+                return slices.size();
+            }
+            /*
+            Switches to new settings of the same image size, keeping the threads
+            */
+            void setSettings(const Jpeg::JpegSettings& settings);
+            /*
+            Switches to the current settings at another quality, reusing the
+            encoders of any quality used before
+            */
+            void setQuality(int quality);
+            /*
+            Returns false if the slices can't be stitched. An exception from any slice's
+            encoder is rethrown here, after every slice has finished with rgb.
+            */
+            bool encode(const std::uint8_t *rgb, std::string& out);
+    };
+    
+    /*
+    Re-codes baseline JPEGs with Huffman tables built from the statistics of a
+    sample of frames, so frames encoded with the default tables come out close
+    to per-frame optimal size without a second encoding pass.
+    The tables are kept until the last checkInterval frames would be more than
+    threshold larger with them than with their own optimal tables, or a frame
+    uses a symbol they lack; then the next sampleFrames frames are sampled again.
+    Every frame is decoded to re-code it, but optimal tables are only built once
+    per checkInterval frames.
+    The image data is untouched, only the entropy coding changes.
+    */
+    class AmortizedHuffman {
+        public:
+            constexpr static const double DEFAULT_THRESHOLD = 0.03;
+            constexpr static const size_t DEFAULT_SAMPLE_FRAMES = 8;
+            constexpr static const size_t DEFAULT_CHECK_INTERVAL = 16;
+            /*
+            Tables are indexed by class (DC 0, AC 1) * 4 + destination
+            */
+            constexpr static const size_t NUM_TABLES = 8;
+            
+            struct Table {
+                /* Number of codes of each length, bits[0] unused */
+                std::uint8_t bits[17];
+                std::uint8_t values[256];
+                size_t numValues;
+                std::uint16_t codes[256];
+                /* Code length of each symbol, 0 if it has no code */
+                std::uint8_t lengths[256];
+            };
+            /*
+            One decoded Huffman symbol with its extra bits, or a restart marker
+            */
+            struct Symbol {
+                std::uint8_t table;
+                std::uint8_t value;
+                std::uint16_t extra;
+            };
+        private:
+            double threshold;
+            size_t sampleFrames;
+            size_t sampled;
+            size_t checkInterval;
+            size_t sinceCheck;
+            bool haveTables;
+            std::uint32_t sampleCounts[NUM_TABLES][256];
+            /* Symbols coded with the kept tables since the last check */
+            std::uint32_t checkCounts[NUM_TABLES][256];
+            Table tables[NUM_TABLES];
+            std::vector<Symbol> symbols;
+            std::string out;
+            double efficiency;
+            size_t rebuilds;
+        public:
+            AmortizedHuffman(
+                double threshold = DEFAULT_THRESHOLD, size_t sampleFrames = DEFAULT_SAMPLE_FRAMES,
+                size_t checkInterval = DEFAULT_CHECK_INTERVAL);
+            /*
+            Replaces jpeg with the re-coded frame.
+            Returns false, leaving it as is, for anything but a single sequential Huffman scan.
+            */
+            bool recode(std::string& jpeg);
+            /*
+            Optimal size over size with the kept tables, for the last frames checked
+            */
+            inline double getEfficiency() const
+            {
+                return efficiency;
+            }
+            /*
+            Times the tables were dropped because they no longer fit
+            */
+            inline size_t getRebuilds() const
+            {
+                return rebuilds;
+            }
+    };
+    
+    /*
+    Picks a JPEG quality for each frame to hold a target data rate.
+    Frame sizes go into a buffer that drains at the target rate; the quality
+    is chosen so the predicted next frame empties the buffer over window seconds.
+    Sizes are predicted from the last frames, scaled by how the quality
+    changes the quantization tables.
+    */
+    class RateControl {
+        public:
+            constexpr static const double DEFAULT_WINDOW = 2.0;
+            constexpr static const int DEFAULT_MIN_QUALITY = 10;
+            constexpr static const int DEFAULT_MAX_QUALITY = 95;
+        private:
+            double frameBudget;
+            double bufferSize;
+            double fullness;
+            double complexity;
+            int minQuality, maxQuality;
+            int quality;
+        public:
+            /*
+            quality 0 starts halfway between the floor and ceiling
+            */
+            RateControl(
+                double bytesPerSecond, FrameRate fps, double window = DEFAULT_WINDOW,
+                int minQuality = DEFAULT_MIN_QUALITY, int maxQuality = DEFAULT_MAX_QUALITY,
+                int quality = 0);
+            /*
+            The quality to encode the next frame with
+            */
+            inline int getQuality() const
+            {
+                return quality;
+            }
+            /*
+            Bytes written above the target rate so far, never below 0
+            */
+            inline double getFullness() const
+            {
+                return fullness;
+            }
+            /*
+            Takes the size of the frame just encoded at getQuality()
+            */
+            void update(size_t frameSize);
+    };
+    
+    /*
+    Shrinks RGB frames by a whole factor, averaging each factor x factor block.
+    Rows and columns left over at the right and bottom edges are dropped.
+    */
+    class BoxDownscaler {
+        public:
+            constexpr static const size_t MAX_FACTOR = 16;
+        private:
+            size_t width, height, factor;
+            size_t outWidth, outHeight;
+            /* Each byte of one output row's source columns summed over factor rows */
+            std::vector<std::uint16_t> columnSums;
+            /* 65536 / factor^2, so averages are a multiply and a shift */
+            std::uint32_t reciprocal;
+        public:
+            /*
+            factor is clamped to 1 to MAX_FACTOR, and to the frame size
+            */
+            BoxDownscaler(size_t width, size_t height, size_t factor);
+            inline size_t getWidth() const
+            {
+                return outWidth;
+            }
+            inline size_t getHeight() const
+            {
+                return outHeight;
+            }
+            /*
+            out holds getWidth() * getHeight() * 3 bytes
+            */
+            void scale(const std::uint8_t *rgb, std::uint8_t *out);
+    };
+    
+    /*
+    AMORTIZED encodes like CAREFUL, but with default JPEG Huffman tables re-coded
+    through AmortizedHuffman instead of optimal tables for every frame
+    */
+    enum EncodingMode {
+        FAST = 0,
+        NORMAL = 1,
+        CAREFUL = 2,
+        FRUGAL = 3,
+        AMORTIZED = 4,
+        ENCODING_MODES = 5
+    };
+    
+    class FlacMjpegAvi : public Avi {
+        public:
+            constexpr static const int DEFAULT_PROXY_QUALITY = 50;
+        protected:
+            constexpr static const int FLAC_STR = 1;
+            constexpr static const int MJPG_STR = 0;
+            constexpr static const int PROXY_STR = 2;
+            std::stringstream sstr;
+            std::unique_ptr<Flac::Flac> flac;
+            std::unique_ptr<Jpeg::Jpeg> jpeg;
+            std::unique_ptr<SlicedJpegEncoder> slicer;
+            std::unique_ptr<AmortizedHuffman> huffman;
+            std::unique_ptr<RateControl> rateControl;
+            /* Set by prepare or the first chunk, after which no streams can be added */
+            bool started;
+            /* The quality jpeg and slicer are set up for */
+            int encodedQuality;
+            /* Encoders for the other qualities rate control has used */
+            std::map<int, std::unique_ptr<Jpeg::Jpeg>> encoders;
+            std::string frame;
+            std::unique_ptr<BoxDownscaler> downscaler;
+            std::unique_ptr<Jpeg::Jpeg> proxyJpeg;
+            size_t proxyInterval;
+            size_t proxyCount;
+            std::vector<std::uint8_t> proxyRgb;
+            std::string proxyFrame;
+            std::unique_ptr<SerialWorker> proxyWorker;
+            /* FLAC blocks gathered into each audio chunk, and the ones gathered so far */
+            size_t blocksPerChunk;
+            size_t chunkBlocks;
+            std::string audioChunk;
+            void writeSamples(std::ostream& stream);
+            /*
+            Writes the FLAC blocks gathered so far as one chunk
+            */
+            void writeAudioChunk(std::ostream& stream);
+            /*
+            Starts the proxy of rgb on the proxy worker, if this frame has one.
+            rgb has to stay valid until the future is ready, which the callers
+            make sure of with a ProxyWait.
+            */
+            std::future<void> encodeProxy(const std::uint8_t *rgb);
+            /*
+            Waits for the proxy encodeProxy started and writes it,
+            rethrowing anything the proxy encoder threw
+            */
+            void writeProxy(std::ostream& stream, std::future<void>& proxy, bool timed, std::uint64_t pts);
+            /*
+            Leaves the JPEG for rgb in frame
+            */
+            void encodeFrame(const std::uint8_t *rgb);
+            /*
+            The video stream's JPEG settings at another quality
+            */
+            Jpeg::JpegSettings settingsFor(int quality);
+            /*
+            Switches jpeg and slicer to quality
+            */
+            void setQuality(int quality);
+        public:
+            FlacMjpegAvi(
+                int width, int height, FrameRate fps = 30.0f,
+                int bitsPerSample = 16, float sampleRate = 44100, int numChannels = 1,
+                EncodingMode mode = NORMAL, int jpegQuality = 50);
+            FlacMjpegAvi(
+                const Jpeg::JpegSettings& jpegSettings,
+                const Flac::FlacEncodeOptions& flacSettings,
+                FrameRate fps = 30.0f);
+            
+            void prepare(std::ostream& stream);
+            
+            void finish(std::ostream& stream);
+            
+            /*
+            Splits every later frame into numSlices slices encoded in parallel,
+            cutting per-frame latency. 0 or 1 encodes whole frames again.
+            Frames that can't be sliced, e.g. with optimal Huffman tables,
+            are encoded whole and slicing is turned off.
+            */
+            void setSlices(size_t numSlices);
+            
+            /*
+            Re-codes every later frame with Huffman tables shared across frames,
+            see AmortizedHuffman. Best with default tables in the JPEG settings,
+            which AMORTIZED mode selects.
+            */
+            void setHuffmanReuse(
+                bool enable,
+                double threshold = AmortizedHuffman::DEFAULT_THRESHOLD,
+                size_t sampleFrames = AmortizedHuffman::DEFAULT_SAMPLE_FRAMES,
+                size_t checkInterval = AmortizedHuffman::DEFAULT_CHECK_INTERVAL);
+            
+            /*
+            Varies the JPEG quality of every later frame between minQuality and maxQuality
+            to hold bytesPerSecond of video, see RateControl. 0 goes back to the fixed settings.
+            Only the quality of the video stream's settings changes, starting from theirs.
+            */
+            void setRateControl(
+                double bytesPerSecond,
+                double window = RateControl::DEFAULT_WINDOW,
+                int minQuality = RateControl::DEFAULT_MIN_QUALITY,
+                int maxQuality = RateControl::DEFAULT_MAX_QUALITY);
+            
+            /*
+            Adds a downscaled copy of every interval-th frame as a third, MJPEG stream,
+            for scrubbing without decoding full frames. The proxy is shrunk by factor
+            in each direction and encoded on its own thread while the full frame is,
+            with the video stream's JPEG settings at the proxy's size and quality.
+            Proxy frames aren't counted in the avih frame count.
+            Fails if factor is out of range, there already is a proxy, or the headers
+            or a chunk have already been written.
+            */
+            bool addProxyStream(
+                size_t factor, size_t interval = 1, int quality = DEFAULT_PROXY_QUALITY);
+            
+            /*
+            Packs blocksPerChunk FLAC blocks into each audio chunk, for fewer chunks and
+            index entries. The audio stream's scale grows to match, so this fails,
+            changing nothing, once the headers or a chunk have been written.
+            */
+            bool setAudioChunking(size_t blocksPerChunk);
+            
+            /*
+            Packs the whole number of FLAC blocks nearest videoFrames video frames
+            into each audio chunk, see setAudioChunking
+            */
+            bool setAudioChunkingToVideo(size_t videoFrames);
+            
+            void writeVideoFrame(std::ostream& stream, const std::uint8_t *rgb);
+            
+            /*
+            Places the frame by its capture time in microseconds instead of
+            assuming a constant rate, see Avi::writeFrameAt, which gives the result
+            */
+            bool writeVideoFrame(std::ostream& stream, const std::uint8_t *rgb, std::uint64_t pts);
+            
+            template <class T>
+            inline void writeSamples(std::ostream& stream, const std::vector<T>& samples)
+            {
+                Profiler::Scope profileScope(Profiler::WRITE_SAMPLES);
+                *flac << samples;
+                writeSamples(stream);
+            }
+            
+            inline void writeVideoFrame(std::ostream& stream, const std::vector<std::uint8_t>& rgb)
+            {
+                writeVideoFrame(stream, rgb.data());
+            }
+            
+    };
+    
+    /*
+    An AVI with any number of MJPEG, FLAC, and raw video streams.
+    Every stream encodes on its own worker thread, and the encoded chunks are
+    written to the file in the order their frames/samples were submitted.
+    At most MAX_STREAMS streams, since chunk IDs only have two digits.
+    */
+    class MuxAvi : public Avi {
+        public:
+            constexpr static const size_t MAX_STREAMS = 100;
+            constexpr static const size_t DEFAULT_MAX_PENDING = 64;
+            /* Returned for a stream past MAX_STREAMS */
+            constexpr static const size_t NO_STREAM = (size_t)-1;
+        protected:
+            typedef std::vector<std::vector<std::uint8_t>> ChunkList;
+            
+            /*
+            Runs the stream's jobs one at a time, on its own thread or in the scheduler
+            */
+            class Track {
+                public:
+                    std::unique_ptr<SerialWorker> worker;
+                    std::unique_ptr<Scheduler::Queue> queue;
+                    virtual ~Track() {}
+                    inline void post(std::function<void()> job)
+                    {
+                        if (queue) {
+                            queue->post(std::move(job));
+                        }
+                        else {
+                            worker->post(std::move(job));
+                        }
+                    }
+            };
+            
+            class MjpegTrack : public Track {
+                public:
+                    Jpeg::Jpeg jpeg;
+                    size_t frameSize;
+                    MjpegTrack(const Jpeg::JpegSettings& settings) :
+                        jpeg(settings),
+                        frameSize {(size_t)settings.size.first * settings.size.second * 3} {}
+                    void encode(const std::uint8_t *rgb, ChunkList& out);
+            };
+            
+            class FlacTrack : public Track {
+                public:
+                    Flac::Flac flac;
+                    FlacTrack(const Flac::FlacEncodeOptions& settings) : flac(settings) {}
+                    /*
+                    Moves every complete block the encoder holds into out
+                    */
+                    void drainBlocks(ChunkList& out);
+            };
+            
+            class RawVideoTrack : public Track {
+                public:
+                    size_t frameSize;
+                    RawVideoTrack(size_t frameSize) : frameSize {frameSize} {}
+            };
+            
+            /*
+            One submitted job, which may encode to any number of chunks of its stream
+            */
+            struct Pending {
+                size_t streamNo;
+                std::uint32_t flags;
+                ChunkList chunks;
+                bool ready;
+                /* What the encode threw, its chunks are skipped */
+                std::exception_ptr error;
+                bool timed;
+                std::uint64_t pts;
+                /* Set once the chunks are written, only for async submissions */
+                std::unique_ptr<std::promise<void>> written;
+                std::function<void()> onWritten;
+                /* Writes the index instead of chunks */
+                bool last;
+            };
+            
+            std::vector<std::unique_ptr<Track>> tracks;
+            std::deque<std::shared_ptr<Pending>> pending;
+            std::mutex pendingMutex;
+            std::condition_variable pendingCv;
+            size_t maxPending;
+            bool draining;
+            /* Set by finish, whose own jobs aren't bounded by maxPending */
+            bool finishing;
+            std::ostream *out;
+            Scheduler *scheduler;
+            Scheduler::Priority priority;
+            /* The first exception an encode threw, finish rethrows it */
+            std::exception_ptr failure;
+            
+            /*
+            The stream's track if it is a T, nullptr for any other stream number
+            */
+            template <class T>
+            inline T *trackAs(size_t streamNo)
+            {
+                return streamNo < tracks.size() ? dynamic_cast<T*>(tracks[streamNo].get()) : nullptr;
+            }
+            /*
+            A future holding std::invalid_argument, for async writes to the wrong stream
+            */
+            static std::future<void> invalidStream();
+            /*
+            A future holding std::length_error, for async writes past maxPending
+            */
+            static std::future<void> queueFull();
+            /*
+            A future holding std::logic_error, for writes before prepare
+            */
+            static std::future<void> notPrepared();
+            /*
+            Gives a new track its worker thread or scheduler queue and adds it
+            */
+            size_t addTrack(std::unique_ptr<Track> track);
+            
+            /*
+            Queues a job on the stream's worker and reserves its place in the file
+            Blocks while maxPending jobs are already queued, unless async is set,
+            in which case the future is ready once the chunks are written, or holds
+            what the encode threw; an async job past maxPending isn't queued at all
+            */
+            std::future<void> submit(
+                size_t streamNo, std::uint32_t flags, std::function<void(ChunkList&)> encode,
+                bool timed = false, std::uint64_t pts = 0,
+                bool async = false, std::function<void()> onWritten = nullptr);
+            /*
+            Writes every finished job at the front of the queue.
+            Only one thread drains at a time, others return immediately.
+            */
+            void drain();
+            std::future<void> writeVideoFrame(
+                size_t streamNo, const std::uint8_t *frame, bool timed, std::uint64_t pts,
+                bool async, std::function<void()> onWritten);
+            /*
+            Queues the FLAC finalize jobs and the index after them
+            */
+            std::future<void> finish(bool async);
+        public:
+            MuxAvi(
+                unsigned int width, unsigned int height, FrameRate fps,
+                size_t maxPending = DEFAULT_MAX_PENDING);
+            /*
+            Encodes on scheduler's threads instead of one thread per stream.
+            Each stream's jobs still run in order, one at a time.
+            */
+            MuxAvi(
+                unsigned int width, unsigned int height, FrameRate fps,
+                Scheduler& scheduler, Scheduler::Priority priority = Scheduler::NORMAL,
+                size_t maxPending = DEFAULT_MAX_PENDING);
+            /*
+            Waits for queued jobs to finish, but doesn't finalize the file
+            */
+            virtual ~MuxAvi();
+            
+            void setPriority(Scheduler::Priority priority);
+            
+            /*
+            Jobs submitted whose chunks aren't written yet
+            */
+            size_t pendingJobs();
+            
+            /*
+            Each returns the new stream's number, or NO_STREAM once there are MAX_STREAMS
+            or once prepare has written the headers
+            */
+            size_t addMjpegStream(const Jpeg::JpegSettings& settings, FrameRate fps);
+            size_t addFlacStream(const Flac::FlacEncodeOptions& settings);
+            size_t addRawVideoStream(unsigned int width, unsigned int height, FrameRate fps);
+            
+            /*
+            Writes the headers and binds the output stream for every later write
+            */
+            void prepare(std::ostream& stream);
+            
+            /*
+            Copies the frame and returns once it is queued for encoding.
+            MJPEG streams take packed RGB, raw streams take frames already in DIB layout.
+            Returns false, queueing nothing, if streamNo isn't a video stream
+            or prepare hasn't been called.
+            */
+            bool writeVideoFrame(size_t streamNo, const std::uint8_t *frame);
+            
+            /*
+            As above, placed by capture time in microseconds, see Avi::writeFrameAt.
+            A frame that can't be placed is skipped and finish throws std::out_of_range.
+            */
+            bool writeVideoFrame(size_t streamNo, const std::uint8_t *frame, std::uint64_t pts);
+            
+            inline bool writeVideoFrame(size_t streamNo, const std::vector<std::uint8_t>& frame)
+            {
+                return writeVideoFrame(streamNo, frame.data());
+            }
+            
+            /*
+            Returns false, queueing nothing, if streamNo isn't a FLAC stream
+            or prepare hasn't been called
+            */
+            template <class T>
+            inline bool writeSamples(size_t streamNo, const std::vector<T>& samples)
+            {
+                FlacTrack *track = trackAs<FlacTrack>(streamNo);
+                if (track == nullptr || out == nullptr) {
+                    return false;
+                }
+                writeSamples(track, streamNo, samples, false, nullptr);
+                return true;
+            }
+            
+            /*
+            Flushes every FLAC stream, waits for all queued jobs to be written,
+            then finalizes the file.
+            If an encode threw, the file is finalized without that job's chunks
+            and the first such exception is rethrown here.
+            Throws std::logic_error, doing nothing, if prepare hasn't been called.
+            */
+            void finish();
+            
+            /*
+            Non-blocking versions of the above, for driving many files from an event loop.
+            They never wait for room in the queue; the future becomes ready, and onWritten
+            is called on the writing thread, once the chunks are in the output stream.
+            Completions follow submission order, as the chunks are written in that order.
+            The future holds the exception if the encode threw, std::invalid_argument for a
+            stream number of the wrong type, std::logic_error before prepare, and
+            std::length_error if maxPending jobs are already queued, in which case
+            nothing is queued and the write can be retried.
+            onWritten runs while that thread writes the jobs behind it, so it may queue
+            async writes or finishAsync but must not call the blocking writes or finish,
+            which would wait for it.
+            */
+            std::future<void> writeVideoFrameAsync(
+                size_t streamNo, const std::uint8_t *frame, std::function<void()> onWritten = nullptr);
+            std::future<void> writeVideoFrameAsync(
+                size_t streamNo, const std::uint8_t *frame, std::uint64_t pts,
+                std::function<void()> onWritten = nullptr);
+            
+            inline std::future<void> writeVideoFrameAsync(
+                size_t streamNo, const std::vector<std::uint8_t>& frame,
+                std::function<void()> onWritten = nullptr)
+            {
+                return writeVideoFrameAsync(streamNo, frame.data(), onWritten);
+            }
+            
+            template <class T>
+            inline std::future<void> writeSamplesAsync(
+                size_t streamNo, const std::vector<T>& samples, std::function<void()> onWritten = nullptr)
+            {
+                FlacTrack *track = trackAs<FlacTrack>(streamNo);
+                if (track == nullptr) {
+                    return invalidStream();
+                }
+                return writeSamples(track, streamNo, samples, true, onWritten);
+            }
+            
+            /*
+            Ready once the index is written and the file is complete
+            */
+            std::future<void> finishAsync();
+        protected:
+            template <class T>
+            inline std::future<void> writeSamples(
+                FlacTrack *track, size_t streamNo, const std::vector<T>& samples,
+                bool async, std::function<void()> onWritten)
+            {
+                Profiler::Scope profileScope(Profiler::WRITE_SAMPLES);
+                return submit(streamNo, 0, [track, samples](ChunkList& chunks) {
+                    track->flac << samples;
+                    track->drainBlocks(chunks);
+                }, false, 0, async, onWritten);
+            }
+    };
+    
+    /*
+    The most recent chunks of a recording, kept in one slab of memory.
+    Pushing drops the oldest chunks when the slab or the record ring is full;
+    nothing is allocated after construction.
+    */
+    class PrerollBuffer {
+        public:
+            struct Record {
+                size_t streamNo;
+                MediaTime time;
+                std::uint32_t flags;
+                size_t start;
+                size_t size;
+            };
+        private:
+            std::vector<std::uint8_t> slab;
+            std::vector<Record> records;
+            size_t head;
+            size_t count;
+            size_t writePos;
+            /*
+            Finds where size bytes would go without dropping anything
+            */
+            bool place(size_t size, size_t& start) const;
+            /*
+            Whether the oldest chunk is still playing at time, its stream's next one starting later
+            */
+            bool oldestPlaysAt(double time) const;
+        public:
+            PrerollBuffer(size_t bytes, size_t maxChunks);
+            /*
+            Returns false, storing nothing, if the chunk can't fit even in an empty buffer,
+            or if it can't fit now and evict is false
+            */
+            bool push(
+                size_t streamNo, const MediaTime& time, std::uint32_t flags,
+                const std::uint8_t *data, size_t size, bool evict = true);
+            /*
+            Drops chunks more than window seconds older than the newest one,
+            except the one of each stream still playing window seconds back
+            */
+            void expire(double window);
+            bool canPush(size_t size) const;
+            inline bool empty() const
+            {
+                return count == 0;
+            }
+            inline size_t size() const
+            {
+                return count;
+            }
+            inline size_t capacity() const
+            {
+                return slab.size();
+            }
+            inline const Record& front() const
+            {
+                return records[head];
+            }
+            inline const std::uint8_t* data(const Record& record) const
+            {
+                return slab.data() + record.start;
+            }
+            void pop();
+    };
+    
+    /*
+    A FlacMjpegAvi that keeps only the last few seconds of chunks in memory
+    until trigger is called. Then a writer thread writes the headers, the
+    buffered chunks starting from the first video keyframe, and every later
+    chunk, while encoding continues on the caller's thread.
+    Encoding never waits for the writer: a chunk that doesn't fit is replaced
+    by an empty drop chunk, which keeps the stream's timing, and counted.
+    */
+    class PrerollAvi : public FlacMjpegAvi {
+        private:
+            PrerollBuffer buffer;
+            double window;
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::ostream *out;
+            bool triggered;
+            bool stopping;
+            size_t dropped;
+            size_t oversize;
+            std::thread writer;
+            std::ostream discard;
+            void writeLoop();
+        public:
+            PrerollAvi(
+                double seconds, size_t bytes, size_t maxChunks,
+                int width, int height, FrameRate fps = 30.0f,
+                int bitsPerSample = 16, float sampleRate = 44100, int numChannels = 1,
+                EncodingMode mode = NORMAL, int jpegQuality = 50);
+            PrerollAvi(
+                double seconds, size_t bytes, size_t maxChunks,
+                const Jpeg::JpegSettings& jpegSettings,
+                const Flac::FlacEncodeOptions& flacSettings,
+                FrameRate fps = 30.0f);
+            virtual ~PrerollAvi();
+            
+            using Avi::writeFrame;
+            /*
+            Stores the chunk instead of writing it. Before the trigger the oldest
+            chunks make room; after it the writer owns them, so a chunk that
+            doesn't fit is stored as a drop chunk instead.
+            */
+            virtual void writeFrame(
+                std::ostream& stream,
+                size_t streamNo,
+                const MediaTime& time, std::uint32_t flags, 
+                const std::uint8_t *data, size_t size);
+            
+            /*
+            Starts recording to stream, including what is buffered from the oldest video
+            keyframe on, and each other stream's chunk playing at that keyframe.
+            Streams whose first chunk starts later than another's get a strh start to match.
+            Later calls do nothing.
+            */
+            void trigger(std::ostream& stream);
+            
+            inline bool isTriggered()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return triggered;
+            }
+            
+            /*
+            Chunks dropped since the trigger because the writer hadn't made room,
+            including any lost outright when even the record ring was full
+            */
+            inline size_t droppedChunks()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return dropped;
+            }
+            
+            /*
+            Chunks bigger than the whole buffer, which can never be stored
+            */
+            inline size_t oversizeChunks()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return oversize;
+            }
+            
+            void writeVideoFrame(const std::uint8_t *rgb);
+            
+            bool writeVideoFrame(const std::uint8_t *rgb, std::uint64_t pts);
+            
+            inline void writeVideoFrame(const std::vector<std::uint8_t>& rgb)
+            {
+                writeVideoFrame(rgb.data());
+            }
+            
+            template <class T>
+            inline void writeSamples(const std::vector<T>& samples)
+            {
+                FlacMjpegAvi::writeSamples(discard, samples);
+            }
+            
+            /*
+            Flushes the encoder and, if triggered, waits for the writer
+            and finalizes the file
+            */
+            void finish();
+    };
     
 }
 
@@ -3,6 +3,7 @@ avi.cpp
 */
 
 #include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <iostream>
 #include <vector>
@@ -11,25 +12,67 @@ avi.cpp
 namespace Avi {
     
     constexpr const static char *IDX1_ID = "idx1";
+    constexpr const static char *CHECKSUM_ID = "c32c";
+    constexpr static std::uint32_t NTSC_RATES[] = {24, 30, 48, 60, 120, 240};
+    constexpr static std::uint32_t NTSC_SCALE = 1001;
+    constexpr static std::uint32_t FPS_PRECISION = 1000;
+    
+    FrameRate::FrameRate(float fps)
+    {
+        for (size_t i = 0; i < sizeof(NTSC_RATES) / sizeof(NTSC_RATES[0]); i++) {
+            if (std::fabs(fps - NTSC_RATES[i] * 1000.0 / NTSC_SCALE) < 0.005) {
+                rate = NTSC_RATES[i] * 1000;
+                scale = NTSC_SCALE;
+                return;
+            }
+        }
+        rate = (std::uint32_t)std::lround(fps * FPS_PRECISION);
+        scale = FPS_PRECISION;
+        std::uint32_t gcd = rate == 0 ? scale : rate;
+        for (std::uint32_t b = scale; b != 0;) {
+            std::uint32_t t = gcd % b;
+            gcd = b;
+            b = t;
+        }
+        rate /= gcd;
+        scale /= gcd;
+    }
+    
+    std::uint64_t mulDiv(std::uint64_t a, std::uint64_t b, std::uint64_t c)
+    {
+#ifdef __SIZEOF_INT128__
+        return (std::uint64_t)(((unsigned __int128)a * b + c / 2) / c);
+#else
+        return (std::uint64_t)((long double)a * b / c + 0.5L);
+#endif
+    }
+    
+    bool MediaTime::operator<(const MediaTime& other) const
+    {
+#ifdef __SIZEOF_INT128__
+        return (unsigned __int128)ticks * scale * other.rate <
+            (unsigned __int128)other.ticks * other.scale * rate;
+#else
+        return (long double)ticks * scale / rate < (long double)other.ticks * other.scale / other.rate;
+#endif
+    }
     
     void IndexEntry::match(const Riff::RiffData& rd)
     {
-        const char *cc = rd.getFourCC();
-        std::copy(cc, cc + Riff::FOURCC_SIZE, fourCC);
+        match(rd.getFourCC());
     }
     
     std::vector<std::uint8_t>& operator<<(
                 std::vector<std::uint8_t>& vector, const IndexEntry& ie)
     {
-        toVectorBytes(vector, reinterpret_cast<const std::uint8_t*>(ie.fourCC), Riff::FOURCC_SIZE);
-        toVectorLE(vector, ie.flags, sizeof(std::uint32_t));
-        toVectorLE(vector, ie.offset, sizeof(std::uint32_t));
-        toVectorLE(vector, ie.size, sizeof(std::uint32_t));
+        const std::uint8_t *raw = reinterpret_cast<const std::uint8_t*>(&ie.raw);
+        vector.insert(vector.end(), raw, raw + sizeof(ie.raw));
         return vector;
     }
     
     void AviMainHeader::writeTo(std::ostream& stream)
     {
+        AVIUTIL_PROFILE_SCOPE_IF(HEADER_REWRITE, offset != -1);
         std::streampos store = -1;
         if (offset != -1) {
             store = stream.tellp();
@@ -37,26 +80,17 @@ namespace Avi {
             stream.seekp(offset);
         }
         std::cout << "Writing AVIH at " << stream.tellp() << std::endl;
-        std::vector<std::uint8_t> vec;
-        std::uint32_t usecPerFrame = 1000000 / fps;
-        toVectorLE(vec, usecPerFrame, sizeof(std::uint32_t));
-        toVectorLE(vec, 500000, sizeof(std::uint32_t));
-        toVectorLE(vec, 0, sizeof(std::uint32_t));
-        toVectorLE(
-            vec, 0 | 0 | AVIF_ISINTERLEAVED, sizeof(std::uint32_t));
-        toVectorLE(vec, numFrames, sizeof(std::uint32_t));
-        toVectorLE(vec, 0, sizeof(std::uint32_t));
-        toVectorLE(vec, numStreams, sizeof(std::uint32_t));
-        toVectorLE(vec, 0x100000, sizeof(std::uint32_t));
-        toVectorLE(vec, width, sizeof(std::uint32_t));
-        toVectorLE(vec, height, sizeof(std::uint32_t));
-        toVectorLE(vec, 0, sizeof(std::uint32_t));
-        toVectorLE(vec, 0, sizeof(std::uint32_t));
-        toVectorLE(vec, 0, sizeof(std::uint32_t));
-        toVectorLE(vec, 0, sizeof(std::uint32_t));
-        dataSize = vec.size();
-        Riff::RiffChunk::writeTo(stream);
-        stream.write(reinterpret_cast<const char*>(vec.data()), vec.size());
+        dataSize = sizeof(Raw::AviMainHeader);
+        Raw::Chunk<Raw::AviMainHeader> avih {
+            {fourCC, (std::uint32_t)dataSize},
+            {
+                (std::uint32_t)(fps.rate == 0 ? 0 : mulDiv(1000000, fps.scale, fps.rate)),
+                500000, 0, 0 | 0 | AVIF_ISINTERLEAVED,
+                (std::uint32_t)numFrames, 0, numStreams, 0x100000, width, height
+            }
+        };
+        markOffset(stream);
+        Raw::write(stream, avih);
         // if (store != -1) {
             // stream.seekp(store);
         // }
@@ -90,55 +124,143 @@ namespace Avi {
             (*it)->writeTo(stream);
         }
         markSize(stream);
-        rewriteLength(stream);
+        {
+            AVIUTIL_PROFILE_SCOPE(HEADER_REWRITE);
+            rewriteLength(stream);
+        }
         // if (store != -1) {
             // stream.seekp(store);
         // }
     }
     
+    void Avi::writeJunk(std::ostream& stream, std::uint64_t position)
+    {
+        size_t padding = Riff::RiffJunk::padding(position, alignment);
+        if (padding != 0) {
+            Riff::RiffJunk junk(padding - Riff::FOURCC_SIZE - Riff::LENGTH_SIZE);
+            junk.writeTo(stream);
+        }
+    }
+    
     void Avi::writeFrame(
         std::ostream& stream,
-        size_t streamNo, float seconds, std::uint32_t flags, const std::uint8_t *data, size_t size)
+        size_t streamNo, const MediaTime& time, std::uint32_t flags, const std::uint8_t *data, size_t size)
     {
-        Riff::RiffData rd = operator[](streamNo).dataToChunk(data, size, streamNo);
+        AVIUTIL_PROFILE_SCOPE(WRITE_FRAME);
+        AviStream& as = operator[](streamNo);
+        if (alignVideo && as.type == VIDEO && moviList.getOffset() >= 0) {
+            /* Chunks start after the movi list's header and type */
+            std::uint64_t position = (std::uint64_t)moviList.getOffset() +
+                Riff::FOURCC_SIZE + Riff::LENGTH_SIZE + Riff::FOURCC_SIZE + moviOffset;
+            size_t padding = Riff::RiffJunk::padding(position, alignment);
+            writeJunk(stream, position);
+            moviOffset += padding;
+        }
+        Raw::ChunkHeader header {as.chunkId(streamNo), (std::uint32_t)size};
         IndexEntry ie(
-            seconds, moviOffset + Riff::FOURCC_SIZE, rd.getSize(), flags);
-        ie.match(rd);
+            time, moviOffset + Riff::FOURCC_SIZE, size, flags);
+        ie.match(header.id.chars);
+        if (checksums) {
+            ie.setChecksum(crc32c(data, size));
+        }
         indexEntries.push_back(ie);
-        rd.writeTo(stream);
-        operator[](streamNo).updateChunkSize(rd.getSize());
-        moviOffset += rd.getSize() + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE;
+        std::streampos cpos = stream.tellp();
+        if (cpos >= 0 && (cpos & 1) != 0) {
+            stream.put(0x00);
+        }
+        Raw::write(stream, header);
+        stream.write(reinterpret_cast<const char*>(data), size);
+        as.updateChunkSize(size);
+        if (tap != nullptr) {
+            tap->publish(streamNo, time, flags, data, size);
+        }
+        moviOffset += size + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE;
         moviOffset += moviOffset & 1;
-        if (operator[](streamNo).type == VIDEO) {
+        if (streamNo == primaryVideo) {
             headerList.avih.numFrames++;
         }
     }
     
+    bool Avi::writeFrameAt(
+        std::ostream& stream,
+        size_t streamNo, std::uint64_t pts, std::uint32_t flags, const std::uint8_t *data, size_t size)
+    {
+        AviStream& as = operator[](streamNo);
+        FrameRate fps = as.getRate();
+        if (fps.rate == 0 || fps.scale == 0) {
+            return false;
+        }
+        if (!havePtsBase) {
+            ptsBase = pts;
+            havePtsBase = true;
+        }
+        /* A PTS from before the first one goes in the next free slot */
+        std::uint64_t slot = as.slotAt(pts > ptsBase ? pts - ptsBase : 0);
+        if (slot > as.getTicks() + maxGap) {
+            return false;
+        }
+        while (as.getTicks() < slot) {
+            writeFrame(stream, streamNo, as.getTime(), 0, nullptr, 0);
+            as.increment();
+        }
+        writeFrame(stream, streamNo, as.getTime(), flags, data, size);
+        as.increment();
+        return true;
+    }
+    
     void Avi::writeBeforeFrames(std::ostream& stream)
     {
         writeTo(stream);
         headerList.writeTo(stream);
+        std::streampos cpos = stream.tellp();
+        if (alignment != 0 && cpos >= 0) {
+            writeJunk(stream, cpos);
+        }
         moviList.writeTo(stream);
     }
     
     void Avi::writeAfterFrames(std::ostream& stream)
     {
+        AVIUTIL_PROFILE_SCOPE(FINALIZE);
         // headerList.avih.writeTo(stream);
-        moviList.expand(moviOffset);
-        moviList.rewriteLength(stream);
-        std::streampos store = stream.tellp();
-        stream.flush();
-        stream.seekp(headerList.getOffset());
-        headerList.writeTo(stream);
-        stream.flush();
-        stream.seekp(store);
-        std::vector<std::uint8_t> indexData;
+        std::streampos store;
+        {
+            AVIUTIL_PROFILE_SCOPE(HEADER_REWRITE);
+            moviList.expand(moviOffset);
+            moviList.rewriteLength(stream);
+            store = stream.tellp();
+            stream.flush();
+            stream.seekp(headerList.getOffset());
+            headerList.writeTo(stream);
+            stream.flush();
+            stream.seekp(store);
+        }
         std::sort(indexEntries.begin(), indexEntries.end());
-        for (auto it = indexEntries.begin(); it != indexEntries.end(); it++) {
-            indexData << *it;
+        std::vector<Raw::AviIndexEntry> indexData(indexEntries.size());
+        for (size_t i = 0; i < indexEntries.size(); i++) {
+            indexData[i] = indexEntries[i].toRaw();
         }
-        Riff::RiffData index(IDX1_ID, indexData);
+        std::streamoff cpos = stream.tellp();
+        if (alignment != 0 && cpos >= 0) {
+            /* Chunks start on even positions */
+            writeJunk(stream, cpos + (cpos & 1));
+        }
+        Riff::RiffHeaderOnly index(IDX1_ID);
+        index.expand(indexData.size() * sizeof(Raw::AviIndexEntry));
         index.writeTo(stream);
+        stream.write(reinterpret_cast<const char*>(indexData.data()), index.getSize());
+        if (checksums) {
+            /* idx1's own CRC, then each chunk's in idx1 order */
+            std::vector<std::uint32_t> checksumData(indexEntries.size() + 1);
+            checksumData[0] = crc32c(indexData.data(), index.getSize());
+            for (size_t i = 0; i < indexEntries.size(); i++) {
+                checksumData[i + 1] = indexEntries[i].getChecksum();
+            }
+            Riff::RiffHeaderOnly checksumChunk(CHECKSUM_ID);
+            checksumChunk.expand(checksumData.size() * sizeof(std::uint32_t));
+            checksumChunk.writeTo(stream);
+            stream.write(reinterpret_cast<const char*>(checksumData.data()), checksumChunk.getSize());
+        }
         finalize(stream);
     }
     
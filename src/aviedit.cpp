@@ -0,0 +1,521 @@
+/*
+aviedit.cpp
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace Avi {
+    
+    constexpr static size_t COPY_BUFFER_SIZE = 1 << 20;
+    constexpr static size_t AVIH_TOTAL_FRAMES = offsetof(Raw::AviMainHeader, totalFrames);
+    constexpr static size_t STRH_SCALE = offsetof(Raw::AviStreamHeader, scale);
+    constexpr static size_t STRH_RATE = offsetof(Raw::AviStreamHeader, rate);
+    constexpr static size_t STRH_START = offsetof(Raw::AviStreamHeader, start);
+    constexpr static size_t STRH_LENGTH = offsetof(Raw::AviStreamHeader, length);
+    constexpr static size_t STRH_BUFFER_SIZE = offsetof(Raw::AviStreamHeader, suggestedBufferSize);
+    constexpr static size_t STRH_SAMPLE_SIZE = offsetof(Raw::AviStreamHeader, sampleSize);
+    constexpr static size_t STRH_MIN_SIZE = offsetof(Raw::AviStreamHeader, left);
+    constexpr static size_t IDX1_ENTRY_SIZE = sizeof(Raw::AviIndexEntry);
+    
+    /*
+    A byte range of one input that goes into the output as is
+    */
+    struct CopyRun {
+        std::FILE *file;
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+    
+    static std::uint32_t readLE(const std::uint8_t *data, size_t bytes)
+    {
+        std::uint32_t num = 0;
+        for (size_t i = 0; i < bytes; i++) {
+            num |= (std::uint32_t)data[i] << (8 * i);
+        }
+        return num;
+    }
+    
+    static void writeLE(std::uint8_t *data, std::uint32_t num, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; i++) {
+            data[i] = (std::uint8_t)(num >> (8 * i));
+        }
+    }
+    
+    static bool readAt(std::FILE *file, std::uint64_t offset, std::uint8_t *data, size_t size)
+    {
+        return fseeko(file, offset, SEEK_SET) == 0 && std::fread(data, 1, size, file) == size;
+    }
+    
+    static bool patchAt(std::FILE *file, std::uint64_t offset, std::uint32_t num)
+    {
+        std::uint8_t data[sizeof(std::uint32_t)];
+        writeLE(data, num, sizeof(std::uint32_t));
+        return fseeko(file, offset, SEEK_SET) == 0 && std::fwrite(data, 1, sizeof(data), file) == sizeof(data);
+    }
+    
+    static StreamType typeOf(const std::uint8_t *fccType)
+    {
+        if (std::memcmp(fccType, "vids", Riff::FOURCC_SIZE) == 0) {
+            return VIDEO;
+        }
+        if (std::memcmp(fccType, "mids", Riff::FOURCC_SIZE) == 0) {
+            return MIDI;
+        }
+        if (std::memcmp(fccType, "txts", Riff::FOURCC_SIZE) == 0) {
+            return TEXT;
+        }
+        return AUDIO;
+    }
+    
+    /*
+    Reads avih and every strl out of the hdrl list held in layout.hdrl
+    */
+    static bool parseHdrl(AviLayout& layout)
+    {
+        const std::vector<std::uint8_t>& hdrl = layout.hdrl;
+        size_t pos = Riff::FOURCC_SIZE + Riff::LENGTH_SIZE + Riff::FOURCC_SIZE;
+        layout.avihOffset = 0;
+        while (pos + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE <= hdrl.size()) {
+            const std::uint8_t *cc = hdrl.data() + pos;
+            size_t size = readLE(cc + Riff::FOURCC_SIZE, Riff::LENGTH_SIZE);
+            size_t body = pos + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE;
+            if (body + size > hdrl.size()) {
+                return false;
+            }
+            if (std::memcmp(cc, "avih", Riff::FOURCC_SIZE) == 0) {
+                layout.avihOffset = pos;
+            }
+            else if (std::memcmp(cc, Riff::RiffList::LIST_FILE, Riff::FOURCC_SIZE) == 0) {
+                /* Descend into strl lists, their contents are handled below */
+                pos = body + Riff::FOURCC_SIZE;
+                continue;
+            }
+            else if (std::memcmp(cc, "strh", Riff::FOURCC_SIZE) == 0) {
+                if (size < STRH_MIN_SIZE) {
+                    return false;
+                }
+                AviLayout::Stream stream;
+                stream.strhOffset = pos;
+                stream.strh.assign(hdrl.begin() + body, hdrl.begin() + body + size);
+                stream.type = typeOf(hdrl.data() + body);
+                stream.scale = readLE(hdrl.data() + body + STRH_SCALE, sizeof(std::uint32_t));
+                stream.rate = readLE(hdrl.data() + body + STRH_RATE, sizeof(std::uint32_t));
+                stream.start = readLE(hdrl.data() + body + STRH_START, sizeof(std::uint32_t));
+                stream.sampleSize = readLE(hdrl.data() + body + STRH_SAMPLE_SIZE, sizeof(std::uint32_t));
+                layout.streams.push_back(stream);
+            }
+            else if (std::memcmp(cc, "strf", Riff::FOURCC_SIZE) == 0 && !layout.streams.empty()) {
+                layout.streams.back().strf.assign(hdrl.begin() + body, hdrl.begin() + body + size);
+            }
+            pos = body + size + (size & 1);
+        }
+        return layout.avihOffset != 0 && !layout.streams.empty();
+    }
+    
+    static size_t streamNumber(const char *fourCC)
+    {
+        if (fourCC[0] < '0' || fourCC[0] > '9' || fourCC[1] < '0' || fourCC[1] > '9') {
+            return SIZE_MAX;
+        }
+        return (fourCC[0] - '0') * 10 + (fourCC[1] - '0');
+    }
+    
+    bool readLayout(std::FILE *file, AviLayout& layout)
+    {
+        std::uint8_t header[Riff::FOURCC_SIZE * 3];
+        if (!readAt(file, 0, header, sizeof(header)) ||
+            std::memcmp(header, Riff::RiffFile::RIFF_FILE, Riff::FOURCC_SIZE) != 0 ||
+            std::memcmp(header + 8, "AVI ", Riff::FOURCC_SIZE) != 0) {
+            return false;
+        }
+        std::uint64_t end = 8 + (std::uint64_t)readLE(header + 4, Riff::LENGTH_SIZE);
+        std::uint64_t pos = sizeof(header);
+        std::vector<std::uint8_t> idx1;
+        std::vector<std::uint8_t> checksums;
+        layout.moviOffset = 0;
+        while (pos + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE <= end) {
+            if (!readAt(file, pos, header, sizeof(header))) {
+                break;
+            }
+            std::uint32_t size = readLE(header + 4, Riff::LENGTH_SIZE);
+            if (std::memcmp(header, Riff::RiffList::LIST_FILE, Riff::FOURCC_SIZE) == 0) {
+                if (std::memcmp(header + 8, "hdrl", Riff::FOURCC_SIZE) == 0) {
+                    layout.hdrl.resize(8 + size);
+                    if (!readAt(file, pos, layout.hdrl.data(), layout.hdrl.size())) {
+                        return false;
+                    }
+                }
+                else if (std::memcmp(header + 8, "movi", Riff::FOURCC_SIZE) == 0) {
+                    layout.moviOffset = pos;
+                    layout.moviEnd = pos + 8 + size;
+                }
+            }
+            else if (std::memcmp(header, "idx1", Riff::FOURCC_SIZE) == 0) {
+                idx1.resize(size);
+                if (!readAt(file, pos + 8, idx1.data(), size)) {
+                    return false;
+                }
+            }
+            else if (std::memcmp(header, "c32c", Riff::FOURCC_SIZE) == 0) {
+                checksums.resize(size);
+                if (!readAt(file, pos + 8, checksums.data(), size)) {
+                    return false;
+                }
+            }
+            pos += 8 + (std::uint64_t)size + (size & 1);
+        }
+        if (layout.hdrl.empty() || layout.moviOffset == 0 || !parseHdrl(layout)) {
+            return false;
+        }
+        /*
+        idx1 offsets are relative to the movi FourCC, though some writers store
+        absolute positions; whichever points at the first entry's chunk is used
+        */
+        std::uint64_t base = layout.moviOffset + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE;
+        if (idx1.size() >= IDX1_ENTRY_SIZE) {
+            std::uint8_t found[Riff::FOURCC_SIZE];
+            if (!readAt(file, base + readLE(idx1.data() + 8, sizeof(std::uint32_t)), found, sizeof(found)) ||
+                std::memcmp(found, idx1.data(), Riff::FOURCC_SIZE) != 0) {
+                base = 0;
+            }
+        }
+        /* One CRC for idx1 itself, then one per entry */
+        size_t numEntries = idx1.size() / IDX1_ENTRY_SIZE;
+        layout.hasChecksums = !checksums.empty() && checksums.size() == (numEntries + 1) * sizeof(std::uint32_t);
+        layout.indexIntact = layout.hasChecksums &&
+            readLE(checksums.data(), sizeof(std::uint32_t)) == crc32c(idx1.data(), idx1.size());
+        for (size_t i = 0; i + IDX1_ENTRY_SIZE <= idx1.size(); i += IDX1_ENTRY_SIZE) {
+            AviLayout::Entry entry;
+            std::copy(idx1.data() + i, idx1.data() + i + Riff::FOURCC_SIZE,
+                reinterpret_cast<std::uint8_t*>(entry.fourCC));
+            entry.flags = readLE(idx1.data() + i + 4, sizeof(std::uint32_t));
+            entry.offset = base + readLE(idx1.data() + i + 8, sizeof(std::uint32_t));
+            entry.size = readLE(idx1.data() + i + 12, sizeof(std::uint32_t));
+            entry.streamNo = streamNumber(entry.fourCC);
+            entry.checksum = 0;
+            if (layout.hasChecksums) {
+                entry.checksum = readLE(
+                    checksums.data() + (i / IDX1_ENTRY_SIZE + 1) * sizeof(std::uint32_t), sizeof(std::uint32_t));
+            }
+            if (entry.streamNo < layout.streams.size()) {
+                layout.index.push_back(entry);
+            }
+        }
+        return true;
+    }
+    
+    static bool copyRange(std::FILE *in, std::uint64_t offset, std::FILE *out, std::uint64_t size)
+    {
+#ifdef __linux__
+        /* Let the kernel move the bytes, falling back to a buffered copy if it can't */
+        if (std::fflush(out) != 0) {
+            return false;
+        }
+        off_t inOffset = offset;
+        off_t outOffset = ftello(out);
+        while (size > 0) {
+            ssize_t copied = copy_file_range(fileno(in), &inOffset, fileno(out), &outOffset, size, 0);
+            if (copied <= 0) {
+                break;
+            }
+            size -= copied;
+        }
+        offset = inOffset;
+        if (fseeko(out, outOffset, SEEK_SET) != 0) {
+            return false;
+        }
+#endif
+        std::vector<std::uint8_t> buffer(std::min<std::uint64_t>(size, COPY_BUFFER_SIZE));
+        if (size > 0 && fseeko(in, offset, SEEK_SET) != 0) {
+            return false;
+        }
+        while (size > 0) {
+            size_t step = std::min<std::uint64_t>(size, buffer.size());
+            if (std::fread(buffer.data(), 1, step, in) != step ||
+                std::fwrite(buffer.data(), 1, step, out) != step) {
+                return false;
+            }
+            size -= step;
+        }
+        return true;
+    }
+    
+    /*
+    Writes a file with the header of layout, the runs as its movi data,
+    and an index built from entries, whose offsets are relative to the first run.
+    Frame counts, stream lengths and buffer sizes are recomputed from entries.
+    With checksums, a c32c chunk follows the index, carrying each entry's checksum over
+    since the chunks are copied as they are.
+    */
+    static bool writeEdited(
+        const std::string& output, const AviLayout& layout,
+        const std::vector<CopyRun>& runs, const std::vector<AviLayout::Entry>& entries, bool checksums)
+    {
+        std::vector<std::uint8_t> hdrl = layout.hdrl;
+        std::vector<std::uint64_t> lengths(layout.streams.size(), 0);
+        std::vector<std::uint32_t> biggest(layout.streams.size(), 0);
+        std::uint32_t totalFrames = 0;
+        /* avih counts the frames of the first video stream only, as Avi::writeFrame does */
+        size_t primaryVideo = SIZE_MAX;
+        for (size_t i = 0; i < layout.streams.size() && primaryVideo == SIZE_MAX; i++) {
+            if (layout.streams[i].type == VIDEO) {
+                primaryVideo = i;
+            }
+        }
+        std::vector<Raw::AviIndexEntry> idx1;
+        idx1.reserve(entries.size());
+        for (auto it = entries.begin(); it != entries.end(); it++) {
+            const AviLayout::Stream& stream = layout.streams[it->streamNo];
+            lengths[it->streamNo] += stream.sampleSize == 0 ? 1 : it->size / stream.sampleSize;
+            biggest[it->streamNo] = std::max(biggest[it->streamNo], it->size);
+            if (it->streamNo == primaryVideo) {
+                totalFrames++;
+            }
+            idx1.push_back(Raw::AviIndexEntry {
+                it->fourCC, it->flags, (std::uint32_t)(it->offset + Riff::FOURCC_SIZE), it->size});
+        }
+        writeLE(hdrl.data() + layout.avihOffset + 8 + AVIH_TOTAL_FRAMES, totalFrames, sizeof(std::uint32_t));
+        for (size_t i = 0; i < layout.streams.size(); i++) {
+            std::uint8_t *strh = hdrl.data() + layout.streams[i].strhOffset + 8;
+            writeLE(strh + STRH_LENGTH, lengths[i], sizeof(std::uint32_t));
+            writeLE(strh + STRH_BUFFER_SIZE, biggest[i], sizeof(std::uint32_t));
+        }
+    
+        std::FILE *out = std::fopen(output.c_str(), "w+b");
+        if (out == nullptr) {
+            return false;
+        }
+        std::uint8_t header[Riff::FOURCC_SIZE * 3];
+        std::copy(Riff::RiffFile::RIFF_FILE, Riff::RiffFile::RIFF_FILE + Riff::FOURCC_SIZE, header);
+        std::copy("AVI ", "AVI " + Riff::FOURCC_SIZE, header + 8);
+        bool ok = std::fwrite(header, 1, sizeof(header), out) == sizeof(header) &&
+            std::fwrite(hdrl.data(), 1, hdrl.size(), out) == hdrl.size();
+        std::uint64_t moviOffset = ftello(out);
+        std::copy(Riff::RiffList::LIST_FILE, Riff::RiffList::LIST_FILE + Riff::FOURCC_SIZE, header);
+        std::copy("movi", "movi" + Riff::FOURCC_SIZE, header + 8);
+        ok = ok && std::fwrite(header, 1, sizeof(header), out) == sizeof(header);
+        for (auto it = runs.begin(); ok && it != runs.end(); it++) {
+            ok = copyRange(it->file, it->offset, out, it->size);
+        }
+        std::uint64_t moviEnd = ftello(out);
+        if (ok && (moviEnd & 1) != 0) {
+            ok = std::fputc(0, out) != EOF;
+            moviEnd++;
+        }
+        Raw::ChunkHeader indexHeader {"idx1", (std::uint32_t)(idx1.size() * IDX1_ENTRY_SIZE)};
+        ok = ok && std::fwrite(&indexHeader, sizeof(indexHeader), 1, out) == 1 &&
+            std::fwrite(idx1.data(), IDX1_ENTRY_SIZE, idx1.size(), out) == idx1.size();
+        if (checksums) {
+            std::vector<std::uint32_t> checksumData(entries.size() + 1);
+            checksumData[0] = crc32c(idx1.data(), idx1.size() * IDX1_ENTRY_SIZE);
+            for (size_t i = 0; i < entries.size(); i++) {
+                checksumData[i + 1] = entries[i].checksum;
+            }
+            Raw::ChunkHeader checksumHeader {"c32c", (std::uint32_t)(checksumData.size() * sizeof(std::uint32_t))};
+            ok = ok && std::fwrite(&checksumHeader, sizeof(checksumHeader), 1, out) == 1 &&
+                std::fwrite(checksumData.data(), sizeof(std::uint32_t), checksumData.size(), out) ==
+                    checksumData.size();
+        }
+        std::uint64_t fileEnd = ftello(out);
+        ok = ok && patchAt(out, moviOffset + 4, moviEnd - moviOffset - 8) &&
+            patchAt(out, 4, fileEnd - 8);
+        return std::fclose(out) == 0 && ok;
+    }
+    
+    /*
+    The chunk plus its header and padding
+    */
+    static inline std::uint64_t spanOf(const AviLayout::Entry& entry)
+    {
+        return (std::uint64_t)entry.size + (entry.size & 1) + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE;
+    }
+    
+    static bool compatible(const AviLayout& a, const AviLayout& b)
+    {
+        if (a.streams.size() != b.streams.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.streams.size(); i++) {
+            std::vector<std::uint8_t> strhA = a.streams[i].strh, strhB = b.streams[i].strh;
+            if (strhA.size() != strhB.size()) {
+                return false;
+            }
+            std::fill(strhA.begin() + STRH_LENGTH, strhA.begin() + STRH_BUFFER_SIZE + 4, 0);
+            std::fill(strhB.begin() + STRH_LENGTH, strhB.begin() + STRH_BUFFER_SIZE + 4, 0);
+            if (strhA != strhB || a.streams[i].strf != b.streams[i].strf) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    bool concatenate(const std::vector<std::string>& inputs, const std::string& output)
+    {
+        std::vector<std::FILE*> files;
+        std::vector<AviLayout> layouts(inputs.size());
+        std::vector<CopyRun> runs;
+        std::vector<AviLayout::Entry> entries;
+        bool ok = !inputs.empty();
+        bool checksums = true;
+        std::uint64_t outPos = 0;
+        for (size_t i = 0; ok && i < inputs.size(); i++) {
+            std::FILE *file = std::fopen(inputs[i].c_str(), "rb");
+            if (file == nullptr) {
+                ok = false;
+                break;
+            }
+            files.push_back(file);
+            ok = readLayout(file, layouts[i]) && compatible(layouts[0], layouts[i]);
+            if (!ok) {
+                break;
+            }
+            checksums = checksums && layouts[i].hasChecksums;
+            /* The whole movi body goes over in one run */
+            std::uint64_t start = layouts[i].moviOffset + Riff::FOURCC_SIZE * 3;
+            std::uint64_t size = layouts[i].moviEnd - start;
+            runs.push_back(CopyRun {file, start, size});
+            for (auto it = layouts[i].index.begin(); it != layouts[i].index.end(); it++) {
+                AviLayout::Entry entry = *it;
+                entry.offset = entry.offset - start + outPos;
+                entries.push_back(entry);
+            }
+            outPos += size;
+        }
+        ok = ok && writeEdited(output, layouts[0], runs, entries, checksums);
+        for (auto it = files.begin(); it != files.end(); it++) {
+            std::fclose(*it);
+        }
+        return ok;
+    }
+    
+    bool trim(const std::string& input, const std::string& output, double start, double end)
+    {
+        std::FILE *file = std::fopen(input.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        AviLayout layout;
+        if (!readLayout(file, layout)) {
+            std::fclose(file);
+            return false;
+        }
+    
+        /* Each stream's chunks in file order, with their start times and durations */
+        size_t numStreams = layout.streams.size();
+        std::vector<std::vector<size_t>> chunks(numStreams);
+        for (size_t i = 0; i < layout.index.size(); i++) {
+            chunks[layout.index[i].streamNo].push_back(i);
+        }
+        std::vector<double> times(layout.index.size()), durations(layout.index.size());
+        for (size_t s = 0; s < numStreams; s++) {
+            const AviLayout::Stream& stream = layout.streams[s];
+            std::sort(chunks[s].begin(), chunks[s].end(), [&layout](size_t a, size_t b) {
+                return layout.index[a].offset < layout.index[b].offset;
+            });
+            double tick = stream.rate == 0 ? 0 : (double)stream.scale / stream.rate;
+            std::uint64_t ticks = stream.start;
+            for (auto it = chunks[s].begin(); it != chunks[s].end(); it++) {
+                std::uint64_t units = stream.sampleSize == 0 ? 1 : layout.index[*it].size / stream.sampleSize;
+                times[*it] = ticks * tick;
+                durations[*it] = units * tick;
+                ticks += units;
+            }
+        }
+    
+        /* Pull the start back to the latest keyframe of every video stream */
+        double cut = start;
+        for (size_t s = 0; s < numStreams; s++) {
+            if (layout.streams[s].type != VIDEO) {
+                continue;
+            }
+            double keyTime = 0;
+            for (auto it = chunks[s].begin(); it != chunks[s].end(); it++) {
+                const AviLayout::Entry& entry = layout.index[*it];
+                if (times[*it] > start) {
+                    break;
+                }
+                if ((entry.flags & AVIIF_KEYFRAME) != 0) {
+                    keyTime = times[*it];
+                }
+            }
+            cut = std::min(cut, keyTime);
+        }
+    
+        std::vector<size_t> kept;
+        std::vector<double> firstTimes(numStreams, -1);
+        double origin = cut;
+        for (size_t i = 0; i < layout.index.size(); i++) {
+            size_t s = layout.index[i].streamNo;
+            bool video = layout.streams[s].type == VIDEO;
+            double from = times[i], to = times[i] + durations[i];
+            if (from < end && (video ? from >= cut : to > cut)) {
+                kept.push_back(i);
+                if (firstTimes[s] < 0 || from < firstTimes[s]) {
+                    firstTimes[s] = from;
+                }
+                origin = std::min(origin, from);
+            }
+        }
+    
+        /*
+        Chunks of other streams that overlap the keyframe start before it,
+        so every stream is delayed by how much later than the earliest one it starts
+        */
+        for (size_t s = 0; s < numStreams; s++) {
+            const AviLayout::Stream& stream = layout.streams[s];
+            double ticks = 0;
+            if (firstTimes[s] > origin && stream.scale != 0) {
+                ticks = (firstTimes[s] - origin) * stream.rate / stream.scale;
+            }
+            writeLE(
+                layout.hdrl.data() + stream.strhOffset + 8 + STRH_START,
+                (std::uint32_t)std::llround(ticks), sizeof(std::uint32_t));
+        }
+    
+        /* Coalesce chunks that sit next to each other in the file into single copies */
+        std::vector<size_t> byOffset = kept;
+        std::sort(byOffset.begin(), byOffset.end(), [&layout](size_t a, size_t b) {
+            return layout.index[a].offset < layout.index[b].offset;
+        });
+        std::vector<std::uint64_t> newOffsets(layout.index.size());
+        std::vector<CopyRun> runs;
+        std::uint64_t outPos = 0;
+        for (auto it = byOffset.begin(); it != byOffset.end(); it++) {
+            const AviLayout::Entry& entry = layout.index[*it];
+            if (!runs.empty() && runs.back().offset + runs.back().size == entry.offset) {
+                runs.back().size += spanOf(entry);
+            }
+            else {
+                runs.push_back(CopyRun {file, entry.offset, spanOf(entry)});
+            }
+            newOffsets[*it] = outPos;
+            outPos += spanOf(entry);
+        }
+        std::vector<AviLayout::Entry> entries;
+        entries.reserve(kept.size());
+        for (auto it = kept.begin(); it != kept.end(); it++) {
+            AviLayout::Entry entry = layout.index[*it];
+            entry.offset = newOffsets[*it];
+            entries.push_back(entry);
+        }
+        bool ok = writeEdited(output, layout, runs, entries, layout.hasChecksums);
+        std::fclose(file);
+        return ok;
+    }
+    
+}
@@ -0,0 +1,405 @@
+/*
+avimux.cpp
+*/
+
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    SerialWorker::SerialWorker() :
+        stopping {false},
+        thread(&SerialWorker::run, this) {}
+    
+    SerialWorker::~SerialWorker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+    
+    std::future<void> SerialWorker::post(std::function<void()> job)
+    {
+        std::packaged_task<void()> task(std::move(job));
+        std::future<void> future = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(task));
+        }
+        cv.notify_one();
+        return future;
+    }
+    
+    void SerialWorker::run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] {return stopping || !jobs.empty();});
+            if (jobs.empty()) {
+                return;
+            }
+            std::packaged_task<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+    
+    void MuxAvi::MjpegTrack::encode(const std::uint8_t *rgb, ChunkList& out)
+    {
+        std::stringstream sstr;
+        jpeg.encodeRGB(rgb);
+        jpeg.write(sstr);
+        std::string str = sstr.str();
+        out.emplace_back(str.begin(), str.end());
+    }
+    
+    void MuxAvi::FlacTrack::drainBlocks(ChunkList& out)
+    {
+        std::stringstream sstr;
+        while (!flac.empty()) {
+            sstr << flac;
+            std::string str = sstr.str();
+            out.emplace_back(str.begin(), str.end());
+            sstr.str(std::string());
+        }
+    }
+    
+    MuxAvi::MuxAvi(unsigned int width, unsigned int height, FrameRate fps, size_t maxPending) :
+        Avi(AviMainHeader(fps, width, height)),
+        maxPending {maxPending},
+        draining {false},
+        finishing {false},
+        out {nullptr},
+        scheduler {nullptr},
+        priority {Scheduler::NORMAL} {}
+    
+    MuxAvi::MuxAvi(
+            unsigned int width, unsigned int height, FrameRate fps,
+            Scheduler& scheduler, Scheduler::Priority priority, size_t maxPending) :
+        Avi(AviMainHeader(fps, width, height)),
+        maxPending {maxPending},
+        draining {false},
+        finishing {false},
+        out {nullptr},
+        scheduler {&scheduler},
+        priority {priority} {}
+    
+    MuxAvi::~MuxAvi()
+    {
+        /* Stop the jobs before the tracks they use are destroyed */
+        for (auto it = tracks.begin(); it != tracks.end(); it++) {
+            (*it)->queue.reset();
+            (*it)->worker.reset();
+        }
+    }
+    
+    size_t MuxAvi::addTrack(std::unique_ptr<Track> track)
+    {
+        if (scheduler != nullptr) {
+            track->queue = std::make_unique<Scheduler::Queue>(*scheduler, priority);
+        }
+        else {
+            track->worker = std::make_unique<SerialWorker>();
+        }
+        tracks.push_back(std::move(track));
+        return tracks.size() - 1;
+    }
+    
+    void MuxAvi::setPriority(Scheduler::Priority priority)
+    {
+        this->priority = priority;
+        for (auto it = tracks.begin(); it != tracks.end(); it++) {
+            if ((*it)->queue) {
+                (*it)->queue->setPriority(priority);
+            }
+        }
+    }
+    
+    size_t MuxAvi::pendingJobs()
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        return pending.size();
+    }
+    
+    std::future<void> MuxAvi::invalidStream()
+    {
+        std::promise<void> promise;
+        promise.set_exception(std::make_exception_ptr(std::invalid_argument("no such stream of that type")));
+        return promise.get_future();
+    }
+    
+    std::future<void> MuxAvi::queueFull()
+    {
+        std::promise<void> promise;
+        promise.set_exception(std::make_exception_ptr(std::length_error("too many writes queued")));
+        return promise.get_future();
+    }
+    
+    std::future<void> MuxAvi::notPrepared()
+    {
+        std::promise<void> promise;
+        promise.set_exception(std::make_exception_ptr(std::logic_error("prepare hasn't been called")));
+        return promise.get_future();
+    }
+    
+    size_t MuxAvi::addMjpegStream(const Jpeg::JpegSettings& settings, FrameRate fps)
+    {
+        if (tracks.size() >= MAX_STREAMS || out != nullptr) {
+            return NO_STREAM;
+        }
+        addStream(AviMjpegStream(settings, fps));
+        return addTrack(std::make_unique<MjpegTrack>(settings));
+    }
+    
+    size_t MuxAvi::addFlacStream(const Flac::FlacEncodeOptions& settings)
+    {
+        if (tracks.size() >= MAX_STREAMS || out != nullptr) {
+            return NO_STREAM;
+        }
+        addStream(AviFlacStream(settings));
+        return addTrack(std::make_unique<FlacTrack>(settings));
+    }
+    
+    size_t MuxAvi::addRawVideoStream(unsigned int width, unsigned int height, FrameRate fps)
+    {
+        if (tracks.size() >= MAX_STREAMS || out != nullptr) {
+            return NO_STREAM;
+        }
+        AviRawVideoStream stream(width, height, fps);
+        addStream(stream);
+        return addTrack(std::make_unique<RawVideoTrack>(stream.frameSize()));
+    }
+    
+    void MuxAvi::prepare(std::ostream& stream)
+    {
+        out = &stream;
+        writeBeforeFrames(stream);
+    }
+    
+    std::future<void> MuxAvi::submit(
+        size_t streamNo, std::uint32_t flags, std::function<void(ChunkList&)> encode,
+        bool timed, std::uint64_t pts,
+        bool async, std::function<void()> onWritten)
+    {
+        if (out == nullptr) {
+            return notPrepared();
+        }
+        std::shared_ptr<Pending> job = std::make_shared<Pending>();
+        job->streamNo = streamNo;
+        job->flags = flags;
+        job->ready = false;
+        job->timed = timed;
+        job->pts = pts;
+        job->last = false;
+        std::future<void> future;
+        if (async) {
+            job->written = std::make_unique<std::promise<void>>();
+            job->onWritten = std::move(onWritten);
+            future = job->written->get_future();
+        }
+        {
+            std::unique_lock<std::mutex> lock(pendingMutex);
+            if (!async) {
+                pendingCv.wait(lock, [this] {return pending.size() < maxPending;});
+            }
+            else if (!finishing && pending.size() >= maxPending) {
+                return queueFull();
+            }
+            pending.push_back(job);
+        }
+        tracks[streamNo]->post([this, job, encode] {
+            ChunkList chunks;
+            std::exception_ptr error;
+            /* The job has to become ready either way, or the queue behind it never drains */
+            try {
+                encode(chunks);
+            }
+            catch (...) {
+                error = std::current_exception();
+                chunks.clear();
+            }
+            {
+                std::lock_guard<std::mutex> lock(pendingMutex);
+                job->chunks = std::move(chunks);
+                job->error = error;
+                job->ready = true;
+            }
+            drain();
+        });
+        return future;
+    }
+    
+    void MuxAvi::drain()
+    {
+        std::unique_lock<std::mutex> lock(pendingMutex);
+        if (draining) {
+            return;
+        }
+        draining = true;
+        while (!pending.empty() && pending.front()->ready) {
+            std::shared_ptr<Pending> job = pending.front();
+            pending.pop_front();
+            lock.unlock();
+            pendingCv.notify_all();
+            std::exception_ptr error = job->error;
+            if (job->last) {
+                writeAfterFrames(*out);
+#ifdef AVIUTIL_PROFILE
+                Profiler::global().fileFinished();
+#endif
+            }
+            for (auto it = job->chunks.begin(); it != job->chunks.end(); it++) {
+                if (job->timed) {
+                    if (!writeFrameAt(*out, job->streamNo, job->pts, job->flags, it->data(), it->size()) &&
+                        !error) {
+                        error = std::make_exception_ptr(std::out_of_range("frame time out of range"));
+                    }
+                    continue;
+                }
+                AviStream& as = operator[](job->streamNo);
+                writeFrame(*out, job->streamNo, as.getTime(), job->flags, *it);
+                as.increment();
+            }
+            if (error && !failure) {
+                failure = error;
+            }
+            if (job->last) {
+                error = failure;
+            }
+            if (job->written && error) {
+                job->written->set_exception(error);
+            }
+            else if (job->written) {
+                job->written->set_value();
+            }
+            if (job->onWritten) {
+                job->onWritten();
+            }
+            lock.lock();
+        }
+        draining = false;
+        lock.unlock();
+        pendingCv.notify_all();
+    }
+    
+    bool MuxAvi::writeVideoFrame(size_t streamNo, const std::uint8_t *frame)
+    {
+        if (out == nullptr ||
+            (trackAs<MjpegTrack>(streamNo) == nullptr && trackAs<RawVideoTrack>(streamNo) == nullptr)) {
+            return false;
+        }
+        writeVideoFrame(streamNo, frame, false, 0, false, nullptr);
+        return true;
+    }
+    
+    bool MuxAvi::writeVideoFrame(size_t streamNo, const std::uint8_t *frame, std::uint64_t pts)
+    {
+        if (out == nullptr ||
+            (trackAs<MjpegTrack>(streamNo) == nullptr && trackAs<RawVideoTrack>(streamNo) == nullptr)) {
+            return false;
+        }
+        writeVideoFrame(streamNo, frame, true, pts, false, nullptr);
+        return true;
+    }
+    
+    std::future<void> MuxAvi::writeVideoFrameAsync(
+        size_t streamNo, const std::uint8_t *frame, std::function<void()> onWritten)
+    {
+        return writeVideoFrame(streamNo, frame, false, 0, true, onWritten);
+    }
+    
+    std::future<void> MuxAvi::writeVideoFrameAsync(
+        size_t streamNo, const std::uint8_t *frame, std::uint64_t pts, std::function<void()> onWritten)
+    {
+        return writeVideoFrame(streamNo, frame, true, pts, true, onWritten);
+    }
+    
+    std::future<void> MuxAvi::writeVideoFrame(
+        size_t streamNo, const std::uint8_t *frame, bool timed, std::uint64_t pts,
+        bool async, std::function<void()> onWritten)
+    {
+        AVIUTIL_PROFILE_SCOPE(WRITE_VIDEO_FRAME);
+        MjpegTrack *mjpeg = trackAs<MjpegTrack>(streamNo);
+        if (mjpeg != nullptr) {
+            std::shared_ptr<std::vector<std::uint8_t>> rgb =
+                std::make_shared<std::vector<std::uint8_t>>(frame, frame + mjpeg->frameSize);
+            return submit(streamNo, AVIIF_KEYFRAME, [mjpeg, rgb](ChunkList& chunks) {
+                mjpeg->encode(rgb->data(), chunks);
+            }, timed, pts, async, onWritten);
+        }
+        RawVideoTrack *raw = trackAs<RawVideoTrack>(streamNo);
+        if (raw == nullptr) {
+            return invalidStream();
+        }
+        std::shared_ptr<std::vector<std::uint8_t>> dib =
+            std::make_shared<std::vector<std::uint8_t>>(frame, frame + raw->frameSize);
+        return submit(streamNo, AVIIF_KEYFRAME, [dib](ChunkList& chunks) {
+            chunks.push_back(std::move(*dib));
+        }, timed, pts, async, onWritten);
+    }
+    
+    void MuxAvi::finish()
+    {
+        finish(false).get();
+    }
+    
+    std::future<void> MuxAvi::finishAsync()
+    {
+        return finish(true);
+    }
+    
+    std::future<void> MuxAvi::finish(bool async)
+    {
+        if (out == nullptr) {
+            return notPrepared();
+        }
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            finishing = true;
+        }
+        for (size_t i = 0; i < tracks.size(); i++) {
+            FlacTrack *track = dynamic_cast<FlacTrack*>(tracks[i].get());
+            if (track != nullptr) {
+                submit(i, 0, [track](ChunkList& chunks) {
+                    track->flac.finalize();
+                    track->drainBlocks(chunks);
+                }, false, 0, async);
+            }
+        }
+        std::shared_ptr<Pending> job = std::make_shared<Pending>();
+        job->streamNo = 0;
+        job->flags = 0;
+        job->ready = true;
+        job->timed = false;
+        job->pts = 0;
+        job->last = true;
+        job->written = std::make_unique<std::promise<void>>();
+        std::future<void> future = job->written->get_future();
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            pending.push_back(job);
+        }
+        if (tracks.empty()) {
+            drain();
+        }
+        else {
+            /* Whichever worker is draining may have stopped before the index was queued */
+            tracks.front()->post([this] {drain();});
+        }
+        return future;
+    }
+    
+}
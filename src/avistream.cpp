@@ -2,6 +2,7 @@
 avistream.cpp
 */
 
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
 #include <sstream>
@@ -21,17 +22,18 @@ namespace Avi {
     constexpr static size_t FLAC_STREAMINFO_OFFSET = 8;
     
     AviStream::AviStream(
-        StreamType type, float fps, const char *handler, unsigned int scale,
+        StreamType type, FrameRate fps, const char *handler,
         unsigned int width, unsigned int height) :
             Riff::RiffList(STRL_ID),
             type {type},
-            scale {scale},
-            rate {(unsigned int)(fps * scale)},
+            scale {fps.scale},
+            rate {fps.rate},
             width {width},
             height {height},
             length {0},
             biggestChunk {0},
-            time {0}
+            ticks {0},
+            start {0}
     {
         if (handler != nullptr) {
             std::copy(handler, handler + Riff::FOURCC_SIZE, this->handler);
@@ -45,82 +47,98 @@ namespace Avi {
     {
         std::cout << "Writing strl at " << stream.tellp() << std::endl;
         Riff::RiffList::writeTo(stream);
-        Riff::RiffData strh = getStrhChunk();
-        strh.writeTo(stream);
-        Riff::RiffData strf = getStrfChunk();
+        strh = {
+            {STRH_ID, sizeof(Raw::AviStreamHeader)},
+            {
+                FOURCCS[type], handler, 0, 0, 0, 0, scale, rate, start,
+                (std::uint32_t)length, (std::uint32_t)biggestChunk, 0xFFFFFFFF, 0,
+                0, 0, width, height
+            }
+        };
+        Raw::write(stream, strh);
         std::cout << "Writing STRF at " << stream.tellp() << std::endl;
-        strf.writeTo(stream);
+        writeStrf(stream);
         markSize(stream);
-        rewriteLength(stream);
+        {
+            AVIUTIL_PROFILE_SCOPE(HEADER_REWRITE);
+            rewriteLength(stream);
+        }
+    }
+    
+    AviMjpegStream::AviMjpegStream(const Jpeg::JpegSettings& settings, FrameRate fps) :
+        AviStream(VIDEO, fps, MJPEG_HANDLER, settings.size.first, settings.size.second),
+        settings {settings}
+    {
+        idCode = VIDEO_ID;
+        std::uint32_t bitCount = settings.components.size() * settings.bitDepth;
+        strf = {
+            {STRF_ID, sizeof(Raw::BitmapInfoHeader)},
+            {
+                sizeof(Raw::BitmapInfoHeader), width, height, 1, bitCount, MJPEG_HANDLER,
+                (width * height * bitCount) >> 3, 0, 0, 0, 0
+            }
+        };
     }
     
-    Riff::RiffData AviStream::getStrhChunk() const
+    void AviMjpegStream::writeStrf(std::ostream& stream)
     {
-        std::vector<std::uint8_t> data;
-        toVectorBytes(data, reinterpret_cast<const std::uint8_t*>(FOURCCS[type]), Riff::FOURCC_SIZE);
-        toVectorBytes(data, reinterpret_cast<const std::uint8_t*>(handler), Riff::FOURCC_SIZE);
-        toVectorLE(data, 0, sizeof(std::uint32_t));
-        toVectorLE(data, 0, sizeof(std::uint16_t));
-        toVectorLE(data, 0, sizeof(std::uint16_t));
-        toVectorLE(data, 0, sizeof(std::uint32_t));
-        toVectorLE(data, scale, sizeof(std::uint32_t));
-        toVectorLE(data, rate, sizeof(std::uint32_t));
-        toVectorLE(data, 0, sizeof(std::uint32_t));
-        toVectorLE(data, length, sizeof(std::uint32_t));
-        toVectorLE(data, biggestChunk, sizeof(std::uint32_t));
-        toVectorLE(data, 0xFFFFFFFF, sizeof(std::uint32_t));
-        toVectorLE(data, 0, sizeof(std::uint32_t));
-        toVectorLE(data, 0, sizeof(std::uint16_t));
-        toVectorLE(data, 0, sizeof(std::uint16_t));
-        toVectorLE(data, width, sizeof(std::uint16_t));
-        toVectorLE(data, height, sizeof(std::uint16_t));
-        return Riff::RiffData(STRH_ID, data);
+        Raw::write(stream, strf);
     }
     
-    Riff::RiffData AviMjpegStream::getStrfChunk()
+    AviRawVideoStream::AviRawVideoStream(
+        unsigned int width, unsigned int height, FrameRate fps, unsigned int bitsPerPixel) :
+        AviStream(VIDEO, fps, nullptr, width, height),
+        bitsPerPixel {bitsPerPixel}
     {
-        std::vector<std::uint8_t> data;
-        toVectorLE(data, 40, sizeof(std::uint32_t));
-        toVectorLE(data, width, sizeof(std::uint32_t));
-        toVectorLE(data, height, sizeof(std::uint32_t));
-        toVectorLE(data, 1, sizeof(std::uint16_t));
-        toVectorLE(data, settings.components.size() * settings.bitDepth, sizeof(std::uint16_t));
-        toVectorBytes(data, reinterpret_cast<const std::uint8_t*>(MJPEG_HANDLER), 4);
-        toVectorLE(data, (width * height * settings.components.size() * settings.bitDepth) >> 3,
-            sizeof(std::uint32_t));
-        toVectorLE(data, 0, sizeof(std::uint32_t));
-        toVectorLE(data, 0, sizeof(std::uint32_t));
-        toVectorLE(data, 0, sizeof(std::uint32_t));
-        toVectorLE(data, 0, sizeof(std::uint32_t));
-        return Riff::RiffData(STRF_ID, data);
+        idCode = RAW_VIDEO_ID;
+        strf = {
+            {STRF_ID, sizeof(Raw::BitmapInfoHeader)},
+            {
+                sizeof(Raw::BitmapInfoHeader), width, height, 1, bitsPerPixel, Raw::FourCC(),
+                (std::uint32_t)frameSize(), 0, 0, 0, 0
+            }
+        };
     }
     
-    Riff::RiffData AviFlacStream::getStrfChunk()
+    void AviRawVideoStream::writeStrf(std::ostream& stream)
     {
-        std::vector<std::uint8_t> data;
-        toVectorLE(data, FLAC_TAG, sizeof(std::uint16_t));
-        toVectorLE(data, settings.numChannels, sizeof(std::uint16_t));
-        toVectorLE(data, settings.sampleRate, sizeof(std::uint32_t));
-        toVectorLE(data, 16000, sizeof(std::uint32_t));
-        toVectorLE(
-            data, (settings.bitsPerSample * settings.numChannels + 7) >> 3, sizeof(std::uint16_t));
-        toVectorLE(data, settings.bitsPerSample, sizeof(std::uint16_t));
-        std::stringstream sstr;
-        flac.writeHeaderTo(sstr);
-        std::string str = sstr.str();
-        toVectorLE(data, str.size() - FLAC_STREAMINFO_OFFSET, sizeof(std::uint16_t));
-        toVectorBytes(data,
-            reinterpret_cast<const std::uint8_t*>(str.data() + FLAC_STREAMINFO_OFFSET),
-            str.size() - FLAC_STREAMINFO_OFFSET);
-        return Riff::RiffData(STRF_ID, data);
+        Raw::write(stream, strf);
+    }
+    
+    void AviFlacStream::writeStrf(std::ostream& stream)
+    {
+        if (strf.empty()) {
+            std::stringstream sstr;
+            flac.writeHeaderTo(sstr);
+            std::string streamInfo = sstr.str().substr(FLAC_STREAMINFO_OFFSET);
+            Raw::ChunkHeader header {STRF_ID, (std::uint32_t)(sizeof(Raw::WaveFormatEx) + streamInfo.size())};
+            Raw::WaveFormatEx format {
+                FLAC_TAG, (std::uint32_t)settings.numChannels, (std::uint32_t)settings.sampleRate, 16000,
+                (std::uint32_t)(settings.bitsPerSample * settings.numChannels + 7) >> 3,
+                (std::uint32_t)settings.bitsPerSample, (std::uint32_t)streamInfo.size()
+            };
+            /* Padded to an even length, as the next chunk has to start on one */
+            strf.resize(sizeof(header) + header.size + (header.size & 1));
+            std::copy(reinterpret_cast<const std::uint8_t*>(&header),
+                reinterpret_cast<const std::uint8_t*>(&header) + sizeof(header), strf.begin());
+            std::copy(reinterpret_cast<const std::uint8_t*>(&format),
+                reinterpret_cast<const std::uint8_t*>(&format) + sizeof(format), strf.begin() + sizeof(header));
+            std::copy(streamInfo.begin(), streamInfo.end(), strf.begin() + sizeof(header) + sizeof(format));
+        }
+        stream.write(reinterpret_cast<const char*>(strf.data()), strf.size());
     }
     
     Riff::RiffData AviStream::dataToChunk(
         const std::uint8_t *data, size_t size, size_t streamNo) const
+    {
+        return Riff::RiffData(chunkId(streamNo).chars, data, size);
+    }
+    
+    Raw::FourCC AviStream::chunkId(size_t streamNo) const
     {
         char subCC[4] = {(char)('0' + (streamNo / 10)), (char)('0' + (streamNo % 10)),
             idCode[0], idCode[1]};
-        return Riff::RiffData(subCC, data, size);
+        return Raw::FourCC(subCC);
     }
     
 }
\ No newline at end of file
@@ -0,0 +1,277 @@
+/*
+checksum.cpp
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+#include "aviutil.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <wmmintrin.h>
+#endif
+
+namespace Avi {
+    
+    constexpr static std::uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+    constexpr static size_t VERIFY_BUFFER_SIZE = 4 << 20;
+    /* Bytes per lane of the interleaved loop, a multiple of 8 */
+    constexpr static size_t CRC_LANE_SIZE = 1024;
+    
+    /*
+    Slicing-by-8 tables, table[k][b] being the CRC of byte b followed by k zero bytes
+    */
+    struct Crc32cTables {
+        std::uint32_t table[8][256];
+        Crc32cTables()
+        {
+            for (std::uint32_t b = 0; b < 256; b++) {
+                std::uint32_t crc = b;
+                for (int bit = 0; bit < 8; bit++) {
+                    crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+                }
+                table[0][b] = crc;
+            }
+            for (std::uint32_t b = 0; b < 256; b++) {
+                for (size_t k = 1; k < 8; k++) {
+                    table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+                }
+            }
+        }
+    };
+    
+    static std::uint32_t crc32cPortable(std::uint32_t crc, const std::uint8_t *data, size_t size)
+    {
+        static const Crc32cTables tables;
+        const std::uint32_t (*table)[256] = tables.table;
+        for (; size >= 8; size -= 8, data += 8) {
+            std::uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (std::uint32_t)data[3] << 24);
+            crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^
+                table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+                table[3][data[4]] ^ table[2][data[5]] ^ table[1][data[6]] ^ table[0][data[7]];
+        }
+        for (; size > 0; size--, data++) {
+            crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xFF];
+        }
+        return crc;
+    }
+    
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse4.2")))
+    static std::uint32_t crc32cHardware(std::uint32_t crc, const std::uint8_t *data, size_t size)
+    {
+        for (; size > 0 && (reinterpret_cast<std::uintptr_t>(data) & 7) != 0; size--, data++) {
+            crc = _mm_crc32_u8(crc, *data);
+        }
+#ifdef __x86_64__
+        std::uint64_t wide = crc;
+        for (; size >= 8; size -= 8, data += 8) {
+            std::uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            wide = _mm_crc32_u64(wide, word);
+        }
+        crc = (std::uint32_t)wide;
+#else
+        for (; size >= 4; size -= 4, data += 4) {
+            std::uint32_t word;
+            std::memcpy(&word, data, sizeof(word));
+            crc = _mm_crc32_u32(crc, word);
+        }
+#endif
+        for (; size > 0; size--, data++) {
+            crc = _mm_crc32_u8(crc, *data);
+        }
+        return crc;
+    }
+#endif
+    
+#ifdef __x86_64__
+    /*
+    a * b mod the polynomial, both bit-reflected like the CRC itself
+    */
+    static std::uint32_t multiplyModP(std::uint32_t a, std::uint32_t b)
+    {
+        std::uint32_t product = 0;
+        for (std::uint32_t bit = 1u << 31; bit != 0; bit >>= 1) {
+            if ((a & bit) != 0) {
+                product ^= b;
+            }
+            b = (b >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (b & 1)));
+        }
+        return product;
+    }
+    
+    /*
+    x^n mod the polynomial, bit-reflected
+    */
+    static std::uint32_t xPowerModP(std::uint64_t n)
+    {
+        std::uint32_t result = 1u << 31, square = 1u << 30;
+        for (; n != 0; n >>= 1) {
+            if ((n & 1) != 0) {
+                result = multiplyModP(result, square);
+            }
+            square = multiplyModP(square, square);
+        }
+        return result;
+    }
+    
+    /*
+    The crc32 instruction takes 3 cycles but can start one every cycle, so three
+    lanes of CRC_LANE_SIZE bytes run at once, each from 0. A lane's CRC followed by
+    n more bytes is its CRC times x^8n: the carry-less product with x^(8n - 33),
+    which crc32 reduces while multiplying it by the missing x^33.
+    */
+    __attribute__((target("sse4.2,pclmul")))
+    static std::uint32_t crc32cInterleaved(std::uint32_t crc, const std::uint8_t *data, size_t size)
+    {
+        static const std::uint32_t shift[2] = {
+            xPowerModP(8 * CRC_LANE_SIZE - 33), xPowerModP(16 * CRC_LANE_SIZE - 33)
+        };
+        for (; size > 0 && (reinterpret_cast<std::uintptr_t>(data) & 7) != 0; size--, data++) {
+            crc = _mm_crc32_u8(crc, *data);
+        }
+        for (; size >= 3 * CRC_LANE_SIZE; size -= 3 * CRC_LANE_SIZE, data += 3 * CRC_LANE_SIZE) {
+            std::uint64_t a = crc, b = 0, c = 0;
+            for (size_t i = 0; i < CRC_LANE_SIZE; i += 8) {
+                std::uint64_t words[3];
+                std::memcpy(&words[0], data + i, 8);
+                std::memcpy(&words[1], data + CRC_LANE_SIZE + i, 8);
+                std::memcpy(&words[2], data + 2 * CRC_LANE_SIZE + i, 8);
+                a = _mm_crc32_u64(a, words[0]);
+                b = _mm_crc32_u64(b, words[1]);
+                c = _mm_crc32_u64(c, words[2]);
+            }
+            __m128i shiftedA = _mm_clmulepi64_si128(
+                _mm_cvtsi64_si128((long long)a), _mm_cvtsi32_si128((int)shift[1]), 0);
+            __m128i shiftedB = _mm_clmulepi64_si128(
+                _mm_cvtsi64_si128((long long)b), _mm_cvtsi32_si128((int)shift[0]), 0);
+            crc = (std::uint32_t)_mm_crc32_u64(
+                0, (std::uint64_t)_mm_cvtsi128_si64(_mm_xor_si128(shiftedA, shiftedB))) ^ (std::uint32_t)c;
+        }
+        return crc32cHardware(crc, data, size);
+    }
+#endif
+    
+    std::uint32_t crc32c(const void *data, size_t size, std::uint32_t crc)
+    {
+        const std::uint8_t *bytes = static_cast<const std::uint8_t*>(data);
+#ifdef __x86_64__
+        static const bool carryless = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+        if (carryless) {
+            return ~crc32cInterleaved(~crc, bytes, size);
+        }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+        static const bool hardware = __builtin_cpu_supports("sse4.2");
+        if (hardware) {
+            return ~crc32cHardware(~crc, bytes, size);
+        }
+#endif
+        return ~crc32cPortable(~crc, bytes, size);
+    }
+    
+    /*
+    Checks the entries at order[first, last), which are in file order, reading the file front to back
+    */
+    static void verifyRange(
+        const std::string& path, const AviLayout& layout,
+        const std::vector<size_t>& order, size_t first, size_t last,
+        std::vector<char>& bad)
+    {
+        std::FILE *file = std::fopen(path.c_str(), "rb");
+        std::vector<std::uint8_t> buffer(VERIFY_BUFFER_SIZE);
+        std::uint64_t bufferStart = 0, bufferEnd = 0;
+        for (size_t i = first; i < last; i++) {
+            const AviLayout::Entry& entry = layout.index[order[i]];
+            std::uint64_t start = entry.offset + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE;
+            std::uint64_t end = start + entry.size;
+            std::uint32_t crc = 0;
+            while (file != nullptr && start < end) {
+                if (start < bufferStart || start >= bufferEnd) {
+                    size_t read = 0;
+                    if (fseeko(file, start, SEEK_SET) == 0) {
+                        read = std::fread(buffer.data(), 1, buffer.size(), file);
+                    }
+                    if (read == 0) {
+                        break;
+                    }
+                    bufferStart = start;
+                    bufferEnd = start + read;
+                }
+                std::uint64_t to = std::min(end, bufferEnd);
+                crc = crc32c(buffer.data() + (start - bufferStart), to - start, crc);
+                start = to;
+            }
+            bad[order[i]] = start != end || crc != entry.checksum;
+        }
+        if (file != nullptr) {
+            std::fclose(file);
+        }
+    }
+    
+    bool verifyChecksums(const std::string& path, ChecksumReport& report, size_t numThreads)
+    {
+        AviLayout layout;
+        std::FILE *file = std::fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        bool read = readLayout(file, layout);
+        std::fclose(file);
+        if (!read || !layout.hasChecksums) {
+            return false;
+        }
+        std::vector<size_t> order(layout.index.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&layout](size_t a, size_t b) {
+            return layout.index[a].offset < layout.index[b].offset;
+        });
+        if (numThreads == 0) {
+            numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        /* Contiguous runs of about the same number of bytes, so each thread reads sequentially */
+        std::uint64_t total = 0;
+        for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+            total += it->size;
+        }
+        std::vector<char> bad(layout.index.size());
+        std::vector<std::thread> threads;
+        size_t first = 0;
+        std::uint64_t covered = 0;
+        for (size_t t = 0; t < numThreads && first < order.size(); t++) {
+            std::uint64_t target = total * (t + 1) / numThreads;
+            size_t last = first;
+            while (last < order.size() && (covered < target || last == first || t + 1 == numThreads)) {
+                covered += layout.index[order[last]].size;
+                last++;
+            }
+            threads.emplace_back(verifyRange, std::cref(path), std::cref(layout),
+                std::cref(order), first, last, std::ref(bad));
+            first = last;
+        }
+        for (auto it = threads.begin(); it != threads.end(); it++) {
+            it->join();
+        }
+        report.indexIntact = layout.indexIntact;
+        report.checked = layout.index.size();
+        report.corrupt.clear();
+        for (size_t i = 0; i < bad.size(); i++) {
+            if (bad[i]) {
+                report.corrupt.push_back(i);
+            }
+        }
+        return true;
+    }
+    
+}
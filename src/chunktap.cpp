@@ -0,0 +1,252 @@
+/*
+chunktap.cpp
+*/
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    constexpr static std::uint64_t NO_DATA = std::numeric_limits<std::uint64_t>::max();
+    constexpr static const char *TAP_MAGIC = "AVITAP01";
+    
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "the ring is shared between processes");
+    
+    size_t ChunkTap::ringSize(size_t bufferSize, size_t numSlots)
+    {
+        return HEADER_SIZE + numSlots * sizeof(Slot) + bufferSize;
+    }
+    
+    void ChunkTap::place(void *base)
+    {
+        static_assert(sizeof(Header) <= HEADER_SIZE && sizeof(Slot) == 48, "see the layout in aviutil.hpp");
+        std::uint8_t *bytes = static_cast<std::uint8_t*>(base);
+        header = reinterpret_cast<Header*>(bytes);
+        slots = reinterpret_cast<Slot*>(bytes + HEADER_SIZE);
+        buffer = bytes + HEADER_SIZE + header->numSlots * sizeof(Slot);
+        slotMask = header->numSlots - 1;
+        bufferSize = header->bufferSize;
+    }
+    
+    void ChunkTap::format(size_t bufferSize, size_t numSlots)
+    {
+        header->bufferSize = bufferSize;
+        header->numSlots = numSlots;
+        header->head.store(0, std::memory_order_relaxed);
+        header->reclaimed.store(0, std::memory_order_relaxed);
+        place(header);
+        for (size_t i = 0; i < numSlots; i++) {
+            slots[i].sequence.store(0, std::memory_order_relaxed);
+        }
+        /* Readers in other processes check the magic last */
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(header->magic, TAP_MAGIC, sizeof(header->magic));
+    }
+    
+    static size_t roundSlots(size_t numSlots)
+    {
+        size_t size = 1;
+        while (size < numSlots) {
+            size <<= 1;
+        }
+        return size;
+    }
+    
+    ChunkTap::ChunkTap(size_t bufferSize, size_t numSlots) :
+        mapping {nullptr},
+        mappingSize {0},
+        owner {true},
+        header {nullptr},
+        bufferEnd {0}
+    {
+        numSlots = roundSlots(numSlots);
+        size_t size = ringSize(bufferSize, numSlots);
+        memory = std::make_unique<std::uint64_t[]>((size + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t));
+        header = reinterpret_cast<Header*>(memory.get());
+        format(bufferSize, numSlots);
+    }
+    
+    ChunkTap::ChunkTap(const std::string& name, size_t bufferSize, size_t numSlots) :
+        mapping {nullptr},
+        mappingSize {0},
+        name {name},
+        owner {true},
+        header {nullptr},
+        bufferEnd {0}
+    {
+#ifdef __linux__
+        numSlots = roundSlots(numSlots);
+        size_t size = ringSize(bufferSize, numSlots);
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return;
+        }
+        if (ftruncate(fd, size) == 0) {
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapping == nullptr || mapping == MAP_FAILED) {
+            mapping = nullptr;
+            shm_unlink(name.c_str());
+            return;
+        }
+        mappingSize = size;
+        header = static_cast<Header*>(mapping);
+        format(bufferSize, numSlots);
+#endif
+    }
+    
+    ChunkTap::ChunkTap(const std::string& name) :
+        mapping {nullptr},
+        mappingSize {0},
+        name {name},
+        owner {false},
+        header {nullptr},
+        bufferEnd {0}
+    {
+#ifdef __linux__
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= HEADER_SIZE) {
+            mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapping == nullptr || mapping == MAP_FAILED) {
+            mapping = nullptr;
+            return;
+        }
+        mappingSize = st.st_size;
+        const Header *shared = static_cast<const Header*>(mapping);
+        bool formatted = std::memcmp(shared->magic, TAP_MAGIC, sizeof(shared->magic)) == 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!formatted || shared->numSlots == 0 || (shared->numSlots & (shared->numSlots - 1)) != 0 ||
+            ringSize(shared->bufferSize, shared->numSlots) > mappingSize) {
+            munmap(mapping, mappingSize);
+            mapping = nullptr;
+            return;
+        }
+        place(mapping);
+#endif
+    }
+    
+    ChunkTap::~ChunkTap()
+    {
+#ifdef __linux__
+        if (mapping != nullptr) {
+            munmap(mapping, mappingSize);
+            if (owner) {
+                shm_unlink(name.c_str());
+            }
+        }
+#endif
+    }
+    
+    void ChunkTap::publish(
+        size_t streamNo, const MediaTime& time, std::uint32_t flags,
+        const std::uint8_t *data, size_t size)
+    {
+        if (!owner || header == nullptr) {
+            return;
+        }
+        std::uint64_t offset = NO_DATA;
+        if (size <= bufferSize && size != 0) {
+            /* Payloads don't wrap, the end of the buffer is skipped instead */
+            offset = bufferEnd;
+            size_t position = offset % bufferSize;
+            if (position + size > bufferSize) {
+                offset += bufferSize - position;
+            }
+            bufferEnd = offset + size;
+            if (bufferEnd > bufferSize) {
+                header->reclaimed.store(bufferEnd - bufferSize, std::memory_order_relaxed);
+            }
+            /* Readers see the bytes as reclaimed before they change */
+            std::atomic_thread_fence(std::memory_order_release);
+            std::memcpy(buffer + offset % bufferSize, data, size);
+        }
+        std::uint64_t n = header->head.load(std::memory_order_relaxed);
+        Slot& slot = slots[n & slotMask];
+        slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.streamNo.store(streamNo, std::memory_order_relaxed);
+        slot.flags.store(flags, std::memory_order_relaxed);
+        slot.ticks.store(time.ticks, std::memory_order_relaxed);
+        slot.scale.store(time.scale, std::memory_order_relaxed);
+        slot.rate.store(time.rate, std::memory_order_relaxed);
+        slot.offset.store(offset, std::memory_order_relaxed);
+        slot.size.store(size, std::memory_order_relaxed);
+        slot.sequence.store(2 * n + 2, std::memory_order_release);
+        header->head.store(n + 1, std::memory_order_release);
+    }
+    
+    ChunkTap::Consumer ChunkTap::subscribe() const
+    {
+        return Consumer(*this, getPublished());
+    }
+    
+    bool ChunkTap::Consumer::poll(TapChunk& chunk)
+    {
+        if (dropped || tap->header == nullptr || next >= tap->header->head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        const Slot& slot = tap->slots[next & tap->slotMask];
+        std::uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * next + 2) {
+            /* Already reused for a later chunk */
+            dropped = true;
+            return false;
+        }
+        chunk.sequence = next;
+        chunk.streamNo = slot.streamNo.load(std::memory_order_relaxed);
+        chunk.flags = slot.flags.load(std::memory_order_relaxed);
+        chunk.time = MediaTime(
+            slot.ticks.load(std::memory_order_relaxed),
+            slot.scale.load(std::memory_order_relaxed),
+            slot.rate.load(std::memory_order_relaxed));
+        chunk.offset = slot.offset.load(std::memory_order_relaxed);
+        chunk.size = slot.size.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            dropped = true;
+            return false;
+        }
+        chunk.data = nullptr;
+        if (chunk.offset != NO_DATA) {
+            if (chunk.offset % tap->bufferSize + chunk.size > tap->bufferSize) {
+                dropped = true;
+                return false;
+            }
+            chunk.data = tap->buffer + chunk.offset % tap->bufferSize;
+        }
+        if (!valid(chunk)) {
+            return false;
+        }
+        next++;
+        return true;
+    }
+    
+    bool ChunkTap::Consumer::valid(const TapChunk& chunk)
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (chunk.data != nullptr && tap->header->reclaimed.load(std::memory_order_relaxed) > chunk.offset) {
+            dropped = true;
+        }
+        return !dropped;
+    }
+    
+}
@@ -0,0 +1,247 @@
+/*
+directfile.cpp
+*/
+
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    static inline std::uint64_t roundDown(std::uint64_t value, size_t block)
+    {
+        return value - value % block;
+    }
+    
+    static inline std::uint64_t roundUp(std::uint64_t value, size_t block)
+    {
+        return roundDown(value + block - 1, block);
+    }
+    
+    DirectFileBuf::DirectFileBuf() :
+        fd {-1},
+        direct {false},
+        blockSize {0},
+        bufferSize {0},
+        buffer {nullptr},
+        windowStart {0},
+        loadedEnd {0},
+        dirtyStart {0},
+        dirtyEnd {0},
+        diskSize {0},
+        fileSize {0} {}
+    
+    DirectFileBuf::~DirectFileBuf()
+    {
+        close();
+    }
+    
+    bool DirectFileBuf::open(const std::string& path, size_t blockSize, size_t bufferSize)
+    {
+#ifdef __linux__
+        close();
+        if (blockSize == 0 || (blockSize & (blockSize - 1)) != 0) {
+            return false;
+        }
+        bufferSize = std::max<size_t>(roundUp(bufferSize, blockSize), blockSize);
+        void *memory;
+        if (posix_memalign(&memory, blockSize, bufferSize) != 0) {
+            return false;
+        }
+        /* Rewriting part of a block needs the rest of it read back */
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        direct = fd >= 0;
+        if (fd < 0 && errno == EINVAL) {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+        if (fd < 0) {
+            std::free(memory);
+            return false;
+        }
+        buffer = static_cast<char*>(memory);
+        this->blockSize = blockSize;
+        this->bufferSize = bufferSize;
+        windowStart = loadedEnd = dirtyStart = dirtyEnd = diskSize = fileSize = 0;
+        setp(buffer, buffer);
+        return true;
+#else
+        return false;
+#endif
+    }
+    
+    bool DirectFileBuf::close()
+    {
+        if (fd < 0) {
+            return true;
+        }
+        bool ok = flushWindow();
+#ifdef __linux__
+        if (diskSize > fileSize) {
+            ok &= ftruncate(fd, fileSize) == 0;
+        }
+        ok &= ::close(fd) == 0;
+#endif
+        std::free(buffer);
+        buffer = nullptr;
+        fd = -1;
+        direct = false;
+        setp(nullptr, nullptr);
+        return ok;
+    }
+    
+    bool DirectFileBuf::load(std::uint64_t end)
+    {
+        end = roundUp(end, blockSize);
+        if (end <= loadedEnd) {
+            return true;
+        }
+        std::uint64_t offset = position() - windowStart;
+        char *to = buffer + (loadedEnd - windowStart);
+        size_t size = end - loadedEnd;
+        size_t read = 0;
+#ifdef __linux__
+        /* Only blocks the file already has are read, new ones start out zeroed */
+        size_t onDisk = loadedEnd < diskSize ? std::min<std::uint64_t>(size, diskSize - loadedEnd) : 0;
+        while (read < onDisk) {
+            ssize_t result = pread(fd, to + read, onDisk - read, loadedEnd + read);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                break;
+            }
+            read += result;
+        }
+#endif
+        std::memset(to + read, 0, size - read);
+        loadedEnd = end;
+        setp(buffer, buffer + (loadedEnd - windowStart));
+        pbump(offset);
+        return true;
+    }
+    
+    bool DirectFileBuf::flushWindow()
+    {
+        if (fd < 0) {
+            return false;
+        }
+        dirtyEnd = std::max(dirtyEnd, position());
+        if (dirtyEnd > dirtyStart) {
+            std::uint64_t from = roundDown(dirtyStart, blockSize);
+            std::uint64_t to = roundUp(dirtyEnd, blockSize);
+            size_t written = 0;
+#ifdef __linux__
+            while (from + written < to) {
+                ssize_t result = pwrite(
+                    fd, buffer + (from - windowStart) + written, to - from - written, from + written);
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (result <= 0) {
+                    return false;
+                }
+                written += result;
+            }
+#endif
+            diskSize = std::max(diskSize, to);
+            fileSize = std::max(fileSize, dirtyEnd);
+        }
+        dirtyStart = dirtyEnd = position();
+        return true;
+    }
+    
+    bool DirectFileBuf::moveTo(std::uint64_t position)
+    {
+        if (position >= windowStart && position < windowStart + bufferSize) {
+            dirtyEnd = std::max(dirtyEnd, this->position());
+            if (dirtyStart == dirtyEnd) {
+                dirtyStart = dirtyEnd = position;
+            }
+            else {
+                dirtyStart = std::min(dirtyStart, position);
+            }
+            setp(buffer, buffer + (loadedEnd - windowStart));
+            pbump(position - windowStart);
+            return load(position + 1);
+        }
+        if (!flushWindow()) {
+            return false;
+        }
+        windowStart = roundDown(position, blockSize);
+        loadedEnd = windowStart;
+        dirtyStart = dirtyEnd = position;
+        setp(buffer, buffer);
+        pbump(position - windowStart);
+        return load(position + 1);
+    }
+    
+    DirectFileBuf::int_type DirectFileBuf::overflow(int_type c)
+    {
+        if (fd < 0) {
+            return traits_type::eof();
+        }
+        std::uint64_t windowEnd = windowStart + bufferSize;
+        if (loadedEnd < windowEnd) {
+            /* Past what the file holds the rest of the buffer is only cleared, not read */
+            if (!load(loadedEnd >= diskSize ? windowEnd : loadedEnd + blockSize)) {
+                return traits_type::eof();
+            }
+        }
+        else if (!moveTo(position())) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+            return c;
+        }
+        return traits_type::not_eof(c);
+    }
+    
+    int DirectFileBuf::sync()
+    {
+        return flushWindow() ? 0 : -1;
+    }
+    
+    DirectFileBuf::pos_type DirectFileBuf::seekoff(
+        off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        if (fd < 0 || (which & std::ios_base::out) == 0) {
+            return pos_type(off_type(-1));
+        }
+        std::uint64_t target;
+        if (dir == std::ios_base::beg) {
+            target = off;
+        }
+        else if (dir == std::ios_base::cur) {
+            if (off == 0) {
+                return pos_type(position());
+            }
+            target = position() + off;
+        }
+        else {
+            target = std::max(std::max(fileSize, dirtyEnd), position()) + off;
+        }
+        if (!moveTo(target)) {
+            return pos_type(off_type(-1));
+        }
+        return pos_type(target);
+    }
+    
+    DirectFileBuf::pos_type DirectFileBuf::seekpos(pos_type pos, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+    
+}
@@ -0,0 +1,55 @@
+/*
+downscale.cpp
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    BoxDownscaler::BoxDownscaler(size_t width, size_t height, size_t factor) :
+        width {width},
+        height {height},
+        factor {std::max<size_t>(std::min({factor, MAX_FACTOR, width, height}), 1)}
+    {
+        outWidth = width / this->factor;
+        outHeight = height / this->factor;
+        columnSums.resize(outWidth * this->factor * 3);
+        reciprocal = (65536 + this->factor * this->factor / 2) / (this->factor * this->factor);
+    }
+    
+    void BoxDownscaler::scale(const std::uint8_t *rgb, std::uint8_t *out)
+    {
+        /* Plain loops over contiguous rows, which the compiler vectorizes */
+        size_t columns = columnSums.size();
+        std::uint16_t *sums = columnSums.data();
+        for (size_t y = 0; y < outHeight; y++) {
+            const std::uint8_t *row = rgb + y * factor * width * 3;
+            for (size_t i = 0; i < columns; i++) {
+                sums[i] = row[i];
+            }
+            for (size_t r = 1; r < factor; r++) {
+                row += width * 3;
+                for (size_t i = 0; i < columns; i++) {
+                    sums[i] += row[i];
+                }
+            }
+            std::uint8_t *to = out + y * outWidth * 3;
+            for (size_t x = 0; x < outWidth; x++) {
+                const std::uint16_t *block = sums + x * factor * 3;
+                std::uint32_t r = 0, g = 0, b = 0;
+                for (size_t k = 0; k < factor; k++) {
+                    r += block[3 * k];
+                    g += block[3 * k + 1];
+                    b += block[3 * k + 2];
+                }
+                to[3 * x] = (r * reciprocal + 32768) >> 16;
+                to[3 * x + 1] = (g * reciprocal + 32768) >> 16;
+                to[3 * x + 2] = (b * reciprocal + 32768) >> 16;
+            }
+        }
+    }
+    
+}
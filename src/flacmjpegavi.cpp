@@ -2,8 +2,11 @@
 flacmjpegavi.cpp
 */
 
+#include <algorithm>
 #include <cstdint>
+#include <future>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -15,28 +18,51 @@ namespace Avi {
         Flac::lpcMethodNone | Flac::riceMethodEstimate,
         Flac::lpcMethodFixed | Flac::riceMethodEstimate,
         Flac::lpcMethodEstimate | Flac::riceMethodEstimate,
-        Flac::lpcMethodBruteForce | Flac::riceMethodExact
+        Flac::lpcMethodBruteForce | Flac::riceMethodExact,
+        Flac::lpcMethodEstimate | Flac::riceMethodEstimate
     };
     
     const static unsigned int maxK[ENCODING_MODES] = {
         1,
         14,
         30,
+        30,
         30
     };
     
+    /*
+    Waits for a proxy job however writeVideoFrame is left, since the job reads
+    the caller's frame, which may be freed as soon as writeVideoFrame returns or throws
+    */
+    struct ProxyWait {
+        std::future<void>& proxy;
+        ~ProxyWait()
+        {
+            if (proxy.valid()) {
+                proxy.wait();
+            }
+        }
+    };
+    
     const std::uint32_t jpegFlags[ENCODING_MODES] = {
         Jpeg::flagHuffmanDefault,
         Jpeg::flagHuffmanDefault,
         Jpeg::flagHuffmanOptimal,
-        Jpeg::flagHuffmanOptimal
+        Jpeg::flagHuffmanOptimal,
+        Jpeg::flagHuffmanDefault
     };
     
     FlacMjpegAvi::FlacMjpegAvi(
-            int width, int height, float fps,
+            int width, int height, FrameRate fps,
             int bitsPerSample, float sampleRate, int numChannels,
             EncodingMode mode, int jpegQuality) :
-        Avi(AviMainHeader(fps, width, height))
+        Avi(AviMainHeader(fps, width, height)),
+        started {false},
+        encodedQuality {jpegQuality},
+        proxyInterval {1},
+        proxyCount {0},
+        blocksPerChunk {1},
+        chunkBlocks {0}
     {
         Flac::FlacEncodeOptions flacOptions(
             numChannels,
@@ -63,15 +89,24 @@ namespace Avi {
         jpeg = std::make_unique<Jpeg::Jpeg>(jpegSettings);
         addStream(AviMjpegStream(jpegSettings, fps));
         addStream(AviFlacStream(flacOptions));
+        if (mode == AMORTIZED) {
+            setHuffmanReuse(true);
+        }
     }
     
     FlacMjpegAvi::FlacMjpegAvi(
             const Jpeg::JpegSettings& jpegSettings,
             const Flac::FlacEncodeOptions& flacSettings,
-            float fps) :
+            FrameRate fps) :
         Avi(AviMainHeader(fps, jpegSettings.size.first, jpegSettings.size.second)),
         flac {std::make_unique<Flac::Flac>(flacSettings)},
-        jpeg {std::make_unique<Jpeg::Jpeg>(jpegSettings)}
+        jpeg {std::make_unique<Jpeg::Jpeg>(jpegSettings)},
+        started {false},
+        encodedQuality {jpegSettings.quality},
+        proxyInterval {1},
+        proxyCount {0},
+        blocksPerChunk {1},
+        chunkBlocks {0}
     {
         addStream(AviMjpegStream(jpegSettings, fps));
         addStream(AviFlacStream(flacSettings));
@@ -81,18 +116,32 @@ namespace Avi {
     {
         while (!flac->empty()) {
             sstr << *flac;
-            std::string str = sstr.str();
-            AviStream& as = operator[](FLAC_STR);
-            writeFrame(
-                stream, FLAC_STR, as.getTime(), 0,
-                reinterpret_cast<const std::uint8_t*>(str.data()), str.size());
-            as.increment();
+            audioChunk += sstr.str();
             sstr.str(std::string());
+            if (++chunkBlocks == blocksPerChunk) {
+                writeAudioChunk(stream);
+            }
         }
     }
     
+    void FlacMjpegAvi::writeAudioChunk(std::ostream& stream)
+    {
+        if (chunkBlocks == 0) {
+            return;
+        }
+        started = true;
+        AviStream& as = operator[](FLAC_STR);
+        writeFrame(
+            stream, FLAC_STR, as.getTime(), 0,
+            reinterpret_cast<const std::uint8_t*>(audioChunk.data()), audioChunk.size());
+        as.increment();
+        audioChunk.clear();
+        chunkBlocks = 0;
+    }
+    
     void FlacMjpegAvi::prepare(std::ostream& stream)
     {
+        started = true;
         writeBeforeFrames(stream);
     }
     
@@ -100,20 +149,188 @@ namespace Avi {
     {
         flac->finalize();
         writeSamples(stream);
+        writeAudioChunk(stream);
         writeAfterFrames(stream);
+#ifdef AVIUTIL_PROFILE
+        Profiler::global().fileFinished();
+#endif
+    }
+    
+    void FlacMjpegAvi::setSlices(size_t numSlices)
+    {
+        if (numSlices <= 1) {
+            slicer.reset();
+            return;
+        }
+        slicer = std::make_unique<SlicedJpegEncoder>(settingsFor(encodedQuality), numSlices);
+    }
+    
+    void FlacMjpegAvi::setHuffmanReuse(bool enable, double threshold, size_t sampleFrames, size_t checkInterval)
+    {
+        if (!enable) {
+            huffman.reset();
+            return;
+        }
+        huffman = std::make_unique<AmortizedHuffman>(threshold, sampleFrames, checkInterval);
+    }
+    
+    Jpeg::JpegSettings FlacMjpegAvi::settingsFor(int quality)
+    {
+        const AviMjpegStream& as = static_cast<const AviMjpegStream&>(operator[](MJPG_STR));
+        Jpeg::JpegSettings settings = as.getSettings();
+        settings.quality = quality;
+        return settings;
+    }
+    
+    void FlacMjpegAvi::setQuality(int quality)
+    {
+        if (quality == encodedQuality) {
+            return;
+        }
+        /* Rate control tends to move between a few qualities, so encoders are kept rather than rebuilt */
+        encoders[encodedQuality] = std::move(jpeg);
+        std::unique_ptr<Jpeg::Jpeg>& cached = encoders[quality];
+        if (!cached) {
+            cached = std::make_unique<Jpeg::Jpeg>(settingsFor(quality));
+        }
+        jpeg = std::move(cached);
+        if (slicer) {
+            slicer->setQuality(quality);
+        }
+        encodedQuality = quality;
+    }
+    
+    void FlacMjpegAvi::setRateControl(double bytesPerSecond, double window, int minQuality, int maxQuality)
+    {
+        const AviMjpegStream& as = static_cast<const AviMjpegStream&>(operator[](MJPG_STR));
+        if (bytesPerSecond <= 0) {
+            rateControl.reset();
+            setQuality(as.getSettings().quality);
+            return;
+        }
+        rateControl = std::make_unique<RateControl>(
+            bytesPerSecond, as.getRate(), window, minQuality, maxQuality, as.getSettings().quality);
+    }
+    
+    bool FlacMjpegAvi::setAudioChunking(size_t blocksPerChunk)
+    {
+        if (started || chunkBlocks != 0) {
+            return false;
+        }
+        this->blocksPerChunk = std::max<size_t>(blocksPerChunk, 1);
+        AviFlacStream& as = static_cast<AviFlacStream&>(operator[](FLAC_STR));
+        as.setRate(FrameRate(
+            as.getSettings().sampleRate, as.getSettings().blockSize * this->blocksPerChunk));
+        return true;
+    }
+    
+    bool FlacMjpegAvi::setAudioChunkingToVideo(size_t videoFrames)
+    {
+        const AviFlacStream& as = static_cast<const AviFlacStream&>(operator[](FLAC_STR));
+        FrameRate fps = operator[](MJPG_STR).getRate();
+        double samples = (double)videoFrames * fps.scale / fps.rate * as.getSettings().sampleRate;
+        return setAudioChunking((size_t)(samples / as.getSettings().blockSize + 0.5));
+    }
+    
+    bool FlacMjpegAvi::addProxyStream(size_t factor, size_t interval, int quality)
+    {
+        if (started || downscaler || factor < 1 || factor > BoxDownscaler::MAX_FACTOR) {
+            return false;
+        }
+        const AviMjpegStream& as = static_cast<const AviMjpegStream&>(operator[](MJPG_STR));
+        downscaler = std::make_unique<BoxDownscaler>(
+            as.getSettings().size.first, as.getSettings().size.second, factor);
+        proxyInterval = std::max<size_t>(interval, 1);
+        proxyCount = 0;
+        proxyRgb.resize(downscaler->getWidth() * downscaler->getHeight() * 3);
+        Jpeg::JpegSettings settings = as.getSettings();
+        settings.size = std::pair<int, int>(downscaler->getWidth(), downscaler->getHeight());
+        settings.quality = quality;
+        proxyJpeg = std::make_unique<Jpeg::Jpeg>(settings);
+        FrameRate fps = as.getRate();
+        addStream(AviMjpegStream(settings, FrameRate(fps.rate, fps.scale * proxyInterval)));
+        proxyWorker = std::make_unique<SerialWorker>();
+        return true;
+    }
+    
+    std::future<void> FlacMjpegAvi::encodeProxy(const std::uint8_t *rgb)
+    {
+        if (!downscaler || proxyCount++ % proxyInterval != 0) {
+            return std::future<void>();
+        }
+        return proxyWorker->post([this, rgb] {
+            std::stringstream proxySstr;
+            downscaler->scale(rgb, proxyRgb.data());
+            proxyJpeg->encodeRGB(proxyRgb.data());
+            proxyJpeg->write(proxySstr);
+            proxyFrame = proxySstr.str();
+        });
+    }
+    
+    void FlacMjpegAvi::writeProxy(
+        std::ostream& stream, std::future<void>& proxy, bool timed, std::uint64_t pts)
+    {
+        if (!proxy.valid()) {
+            return;
+        }
+        proxy.get();
+        const std::uint8_t *data = reinterpret_cast<const std::uint8_t*>(proxyFrame.data());
+        if (timed) {
+            writeFrameAt(stream, PROXY_STR, pts, AVIIF_KEYFRAME, data, proxyFrame.size());
+            return;
+        }
+        AviStream& as = operator[](PROXY_STR);
+        writeFrame(stream, PROXY_STR, as.getTime(), AVIIF_KEYFRAME, data, proxyFrame.size());
+        as.increment();
+    }
+    
+    void FlacMjpegAvi::encodeFrame(const std::uint8_t *rgb)
+    {
+        if (rateControl) {
+            setQuality(rateControl->getQuality());
+        }
+        if (!slicer || !slicer->encode(rgb, frame)) {
+            slicer.reset();
+            jpeg->encodeRGB(rgb);
+            jpeg->write(sstr);
+            frame = sstr.str();
+            sstr.str(std::string());
+        }
+        if (huffman) {
+            huffman->recode(frame);
+        }
+        if (rateControl) {
+            rateControl->update(frame.size());
+        }
     }
     
     void FlacMjpegAvi::writeVideoFrame(std::ostream& stream, const std::uint8_t *rgb)
     {
-        jpeg->encodeRGB(rgb);
-        jpeg->write(sstr);
-        std::string str = sstr.str();
+        AVIUTIL_PROFILE_SCOPE(WRITE_VIDEO_FRAME);
+        started = true;
+        std::future<void> proxy = encodeProxy(rgb);
+        ProxyWait proxyWait {proxy};
+        encodeFrame(rgb);
         AviStream& as = operator[](MJPG_STR);
         writeFrame(
             stream, MJPG_STR, as.getTime(), AVIIF_KEYFRAME,
-            reinterpret_cast<const std::uint8_t*>(str.data()), str.size());
+            reinterpret_cast<const std::uint8_t*>(frame.data()), frame.size());
         as.increment();
-        sstr.str(std::string());
+        writeProxy(stream, proxy, false, 0);
+    }
+    
+    bool FlacMjpegAvi::writeVideoFrame(std::ostream& stream, const std::uint8_t *rgb, std::uint64_t pts)
+    {
+        AVIUTIL_PROFILE_SCOPE(WRITE_VIDEO_FRAME);
+        started = true;
+        std::future<void> proxy = encodeProxy(rgb);
+        ProxyWait proxyWait {proxy};
+        encodeFrame(rgb);
+        bool written = writeFrameAt(
+            stream, MJPG_STR, pts, AVIIF_KEYFRAME,
+            reinterpret_cast<const std::uint8_t*>(frame.data()), frame.size());
+        writeProxy(stream, proxy, true, pts);
+        return written;
     }
     
 }
\ No newline at end of file
@@ -0,0 +1,673 @@
+/*
+huffman.cpp
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    constexpr static std::uint8_t MARKER = 0xFF;
+    constexpr static std::uint8_t SOI = 0xD8;
+    constexpr static std::uint8_t EOI = 0xD9;
+    constexpr static std::uint8_t SOF0 = 0xC0;
+    constexpr static std::uint8_t SOF1 = 0xC1;
+    constexpr static std::uint8_t DHT = 0xC4;
+    constexpr static std::uint8_t DRI = 0xDD;
+    constexpr static std::uint8_t SOS = 0xDA;
+    constexpr static std::uint8_t RST0 = 0xD0;
+    constexpr static std::uint8_t RST7 = 0xD7;
+    constexpr static std::uint8_t RESTART = 0xFF;
+    constexpr static size_t MAX_COMPONENTS = 4;
+    constexpr static size_t LOOKAHEAD = 8;
+    /* Code lengths can exceed 16 bits before they are limited, see Annex K.2 */
+    constexpr static size_t MAX_CODE_LENGTH = 32;
+    
+    static inline unsigned int be16(const std::string& data, size_t pos)
+    {
+        return ((std::uint8_t)data[pos] << 8) | (std::uint8_t)data[pos + 1];
+    }
+    
+    /*
+    Canonical Huffman decoder for one table, Annex F.2.2.3,
+    with a lookup table for codes up to LOOKAHEAD bits
+    */
+    struct HuffmanDecoder {
+        bool defined;
+        std::uint8_t values[256];
+        std::int32_t minCode[17];
+        std::int32_t maxCode[17];
+        std::int32_t valuePtr[17];
+        std::uint8_t lookLength[1 << LOOKAHEAD];
+        std::uint8_t lookValue[1 << LOOKAHEAD];
+    
+        bool define(const std::uint8_t *bits, const std::uint8_t *huffval, size_t numValues)
+        {
+            std::memcpy(values, huffval, numValues);
+            std::memset(lookLength, 0, sizeof(lookLength));
+            std::int32_t code = 0;
+            size_t k = 0;
+            for (size_t length = 1; length <= 16; length++) {
+                valuePtr[length] = k;
+                minCode[length] = code;
+                for (size_t i = 0; i < bits[length]; i++, k++, code++) {
+                    if (length <= LOOKAHEAD) {
+                        size_t first = code << (LOOKAHEAD - length);
+                        for (size_t j = 0; j < ((size_t)1 << (LOOKAHEAD - length)); j++) {
+                            lookLength[first + j] = length;
+                            lookValue[first + j] = values[k];
+                        }
+                    }
+                }
+                maxCode[length] = bits[length] != 0 ? code - 1 : -1;
+                if (code > (1 << length)) {
+                    return false;
+                }
+                code <<= 1;
+            }
+            defined = true;
+            return true;
+        }
+    };
+    
+    /*
+    Reads entropy-coded data, removing stuffed zero bytes.
+    Past the end or a marker it reads zeros, counting them so restarts can be checked.
+    */
+    class BitReader {
+        private:
+            const std::uint8_t *data;
+            size_t pos;
+            size_t end;
+            std::uint64_t acc;
+            size_t numBits;
+            size_t zeros;
+            bool stopped;
+    
+            inline void fill()
+            {
+                if (!stopped && pos + 8 <= end) {
+                    /* Whole bytes at once up to the first 0xFF, which needs unstuffing */
+                    std::uint64_t word;
+                    std::memcpy(&word, data + pos, 8);
+                    word = __builtin_bswap64(word);
+                    const std::uint64_t low = 0x7F7F7F7F7F7F7F7F;
+                    std::uint64_t ones = ((word & low) + 0x0101010101010101) & word & ~low;
+                    size_t n = std::min<size_t>((64 - numBits) / 8, 7);
+                    if (ones != 0) {
+                        n = std::min<size_t>(n, __builtin_clzll(ones) / 8);
+                    }
+                    if (n != 0) {
+                        acc = (acc << (8 * n)) | (word >> (64 - 8 * n));
+                        numBits += 8 * n;
+                        pos += n;
+                    }
+                    if (numBits >= 32) {
+                        return;
+                    }
+                }
+                while (numBits <= 56) {
+                    std::uint8_t byte = 0;
+                    if (!stopped && pos < end && !(data[pos] == MARKER && data[pos + 1] != 0)) {
+                        byte = data[pos];
+                        pos += byte == MARKER ? 2 : 1;
+                    }
+                    else {
+                        stopped = true;
+                        zeros++;
+                    }
+                    acc = (acc << 8) | byte;
+                    numBits += 8;
+                }
+            }
+        public:
+            BitReader(const std::uint8_t *data, size_t start, size_t end) :
+                data {data},
+                pos {start},
+                end {end},
+                acc {0},
+                numBits {0},
+                zeros {0},
+                stopped {false} {}
+    
+            /*
+            Reads one symbol and the extra bits after it, as many as its low 4 bits say.
+            Returns -1 for an invalid code.
+            */
+            inline int decode(const HuffmanDecoder& table, std::uint16_t& extra)
+            {
+                if (numBits < 32) {
+                    fill();
+                }
+                unsigned int look = (acc >> (numBits - LOOKAHEAD)) & ((1 << LOOKAHEAD) - 1);
+                int value = -1;
+                if (table.lookLength[look] != 0) {
+                    numBits -= table.lookLength[look];
+                    value = table.lookValue[look];
+                }
+                else {
+                    for (size_t length = LOOKAHEAD + 1; length <= 16; length++) {
+                        std::int32_t code = (acc >> (numBits - length)) & ((1 << length) - 1);
+                        if (code <= table.maxCode[length]) {
+                            numBits -= length;
+                            value = table.values[table.valuePtr[length] + code - table.minCode[length]];
+                            break;
+                        }
+                    }
+                    if (value < 0) {
+                        return -1;
+                    }
+                }
+                size_t size = value & 0xF;
+                numBits -= size;
+                extra = (acc >> numBits) & ((1u << size) - 1);
+                return value;
+            }
+    
+            /*
+            Whether everything up to the end was read, apart from padding
+            */
+            inline bool finished()
+            {
+                numBits -= numBits % 8;
+                return numBits == zeros * 8 && pos == end;
+            }
+            
+            /*
+            Skips the padding before a restart marker and the marker itself.
+            Returns the marker, or -1 if there's data left or no marker.
+            */
+            int restart()
+            {
+                numBits -= numBits % 8;
+                if (numBits != zeros * 8 || pos + 1 >= end || data[pos] != MARKER ||
+                    data[pos + 1] < RST0 || data[pos + 1] > RST7) {
+                    return -1;
+                }
+                int marker = data[pos + 1];
+                pos += 2;
+                acc = 0;
+                numBits = 0;
+                zeros = 0;
+                stopped = false;
+                return marker;
+            }
+    };
+    
+    /*
+    Writes entropy-coded data into a buffer big enough for it,
+    stuffing a zero after every 0xFF
+    */
+    class BitWriter {
+        private:
+            char *out;
+            std::uint64_t acc;
+            size_t numBits;
+            
+            inline void putByte(std::uint8_t byte)
+            {
+                *out++ = (char)byte;
+                if (byte == MARKER) {
+                    *out++ = 0;
+                }
+            }
+        public:
+            BitWriter(char *out) : out {out}, acc {0}, numBits {0} {}
+            
+            /*
+            At most 32 bits at a time
+            */
+            inline void put(std::uint32_t code, size_t length)
+            {
+                acc = (acc << length) | code;
+                numBits += length;
+                if (numBits < 32) {
+                    return;
+                }
+                numBits -= 32;
+                std::uint32_t word = acc >> numBits;
+                std::uint32_t inverse = ~word;
+                if (((inverse - 0x01010101) & ~inverse & 0x80808080) == 0) {
+                    /* No 0xFF bytes */
+                    out[0] = (char)(word >> 24);
+                    out[1] = (char)(word >> 16);
+                    out[2] = (char)(word >> 8);
+                    out[3] = (char)word;
+                    out += 4;
+                    return;
+                }
+                for (int shift = 24; shift >= 0; shift -= 8) {
+                    putByte(word >> shift);
+                }
+            }
+            
+            /*
+            Pads the last byte with ones and returns the end of the data
+            */
+            inline char *flush()
+            {
+                if (numBits % 8 != 0) {
+                    size_t pad = 8 - numBits % 8;
+                    acc = (acc << pad) | ((1u << pad) - 1);
+                    numBits += pad;
+                }
+                while (numBits != 0) {
+                    numBits -= 8;
+                    putByte(acc >> numBits);
+                }
+                return out;
+            }
+    };
+    
+    /*
+    Builds the optimal length-limited table for the counts, Annex K.2
+    */
+    static void buildTable(const std::uint32_t *counts, AmortizedHuffman::Table& table)
+    {
+        std::memset(&table, 0, sizeof(table));
+        if (std::all_of(counts, counts + 256, [](std::uint32_t count) {return count == 0;})) {
+            return;
+        }
+        std::uint64_t freq[257];
+        size_t codeSize[257] = {0};
+        int others[257];
+        /* Only symbols that occur take part, which keeps this quick for sparse tables */
+        int active[257];
+        size_t numActive = 0;
+        for (int i = 0; i < 256; i++) {
+            freq[i] = counts[i];
+            if (counts[i] != 0) {
+                active[numActive++] = i;
+            }
+        }
+        /* A reserved symbol keeps any code from being all ones */
+        freq[256] = 1;
+        active[numActive++] = 256;
+        std::fill(others, others + 257, -1);
+        while (numActive > 1) {
+            size_t i1 = 0, i2 = 1;
+            if (freq[active[i2]] < freq[active[i1]]) {
+                std::swap(i1, i2);
+            }
+            for (size_t i = 2; i < numActive; i++) {
+                if (freq[active[i]] < freq[active[i1]]) {
+                    i2 = i1;
+                    i1 = i;
+                }
+                else if (freq[active[i]] < freq[active[i2]]) {
+                    i2 = i;
+                }
+            }
+            int c1 = active[i1], c2 = active[i2];
+            active[i2] = active[--numActive];
+            freq[c1] += freq[c2];
+            freq[c2] = 0;
+            codeSize[c1]++;
+            while (others[c1] >= 0) {
+                c1 = others[c1];
+                codeSize[c1]++;
+            }
+            others[c1] = c2;
+            codeSize[c2]++;
+            while (others[c2] >= 0) {
+                c2 = others[c2];
+                codeSize[c2]++;
+            }
+        }
+        size_t bits[MAX_CODE_LENGTH + 1] = {0};
+        for (size_t i = 0; i <= 256; i++) {
+            bits[std::min(codeSize[i], MAX_CODE_LENGTH)] += codeSize[i] != 0;
+        }
+        for (size_t i = MAX_CODE_LENGTH; i > 16; i--) {
+            while (bits[i] > 0) {
+                size_t j = i - 2;
+                while (bits[j] == 0) {
+                    j--;
+                }
+                bits[i] -= 2;
+                bits[i - 1]++;
+                bits[j + 1] += 2;
+                bits[j]--;
+            }
+        }
+        size_t longest = 16;
+        while (bits[longest] == 0) {
+            longest--;
+        }
+        bits[longest]--;
+    
+        table.numValues = 0;
+        for (size_t size = 1; size <= MAX_CODE_LENGTH; size++) {
+            for (size_t i = 0; i < 256; i++) {
+                if (codeSize[i] == size) {
+                    table.values[table.numValues++] = i;
+                }
+            }
+        }
+        std::uint16_t code = 0;
+        size_t k = 0;
+        for (size_t length = 1; length <= 16; length++) {
+            table.bits[length] = bits[length];
+            for (size_t i = 0; i < bits[length]; i++, k++, code++) {
+                table.codes[table.values[k]] = code;
+                table.lengths[table.values[k]] = length;
+            }
+            code <<= 1;
+        }
+    }
+    
+    static std::uint64_t codedBits(const std::uint32_t *counts, const std::uint8_t *lengths)
+    {
+        std::uint64_t total = 0;
+        for (size_t i = 0; i < 256; i++) {
+            total += (std::uint64_t)counts[i] * lengths[i];
+        }
+        return total;
+    }
+    
+    AmortizedHuffman::AmortizedHuffman(double threshold, size_t sampleFrames, size_t checkInterval) :
+        threshold {threshold},
+        sampleFrames {std::max<size_t>(sampleFrames, 1)},
+        sampled {0},
+        checkInterval {std::max<size_t>(checkInterval, 1)},
+        sinceCheck {0},
+        haveTables {false},
+        efficiency {1},
+        rebuilds {0}
+    {
+        std::memset(sampleCounts, 0, sizeof(sampleCounts));
+        std::memset(checkCounts, 0, sizeof(checkCounts));
+        std::memset(tables, 0, sizeof(tables));
+    }
+    
+    bool AmortizedHuffman::recode(std::string& jpeg)
+    {
+        if (jpeg.size() < 4 || (std::uint8_t)jpeg[0] != MARKER || (std::uint8_t)jpeg[1] != SOI ||
+            (std::uint8_t)jpeg[jpeg.size() - 2] != MARKER || (std::uint8_t)jpeg[jpeg.size() - 1] != EOI) {
+            return false;
+        }
+    
+        /* Headers */
+        HuffmanDecoder decoders[NUM_TABLES];
+        for (size_t i = 0; i < NUM_TABLES; i++) {
+            decoders[i].defined = false;
+        }
+        std::vector<std::pair<size_t, size_t>> tableSegments;
+        struct Component {
+            unsigned int id, h, v;
+        } components[MAX_COMPONENTS];
+        size_t numComponents = 0;
+        unsigned int width = 0, height = 0, maxH = 1, maxV = 1, restartInterval = 0;
+        size_t sos = 0;
+        size_t pos = 2;
+        while (sos == 0) {
+            if (pos + 4 > jpeg.size() || (std::uint8_t)jpeg[pos] != MARKER) {
+                return false;
+            }
+            std::uint8_t marker = jpeg[pos + 1];
+            if (marker == MARKER) {
+                pos++;
+                continue;
+            }
+            size_t length = be16(jpeg, pos + 2);
+            if (length < 2 || pos + 2 + length > jpeg.size()) {
+                return false;
+            }
+            const std::uint8_t *segment = reinterpret_cast<const std::uint8_t*>(jpeg.data()) + pos + 4;
+            if (marker == SOF0 || marker == SOF1) {
+                height = be16(jpeg, pos + 5);
+                width = be16(jpeg, pos + 7);
+                numComponents = segment[5];
+                if (numComponents == 0 || numComponents > MAX_COMPONENTS || length != 8 + 3 * numComponents) {
+                    return false;
+                }
+                for (size_t i = 0; i < numComponents; i++) {
+                    components[i].id = segment[6 + 3 * i];
+                    components[i].h = segment[7 + 3 * i] >> 4;
+                    components[i].v = segment[7 + 3 * i] & 0xF;
+                    maxH = std::max(maxH, components[i].h);
+                    maxV = std::max(maxV, components[i].v);
+                }
+            }
+            else if ((marker & 0xF0) == 0xC0 && marker != DHT && marker != 0xC8) {
+                /* Progressive, lossless, or arithmetic coding */
+                return false;
+            }
+            else if (marker == DHT) {
+                tableSegments.emplace_back(pos, 2 + length);
+                size_t i = 0;
+                while (i + 17 <= length - 2) {
+                    size_t index = (segment[i] >> 4) * 4 + (segment[i] & 0xF);
+                    size_t numValues = 0;
+                    for (size_t j = 1; j <= 16; j++) {
+                        numValues += segment[i + j];
+                    }
+                    if (index >= NUM_TABLES || numValues > 256 || i + 17 + numValues > length - 2 ||
+                        !decoders[index].define(segment + i, segment + i + 17, numValues)) {
+                        return false;
+                    }
+                    i += 17 + numValues;
+                }
+            }
+            else if (marker == DRI) {
+                restartInterval = be16(jpeg, pos + 4);
+            }
+            else if (marker == SOS) {
+                sos = pos;
+            }
+            pos += 2 + length;
+        }
+        if (numComponents == 0 || width == 0 || height == 0) {
+            return false;
+        }
+    
+        /* Scan header */
+        const std::uint8_t *scan = reinterpret_cast<const std::uint8_t*>(jpeg.data()) + sos + 4;
+        size_t scanComponents = scan[0];
+        size_t scanStart = pos;
+        if (scanComponents == 0 || scanComponents > numComponents || be16(jpeg, sos + 2) != 6 + 2 * scanComponents) {
+            return false;
+        }
+        const std::uint8_t *spectral = scan + 1 + 2 * scanComponents;
+        if (spectral[0] != 0 || spectral[1] != 63 || spectral[2] != 0) {
+            return false;
+        }
+        struct ScanComponent {
+            size_t blocksX, blocksY, dc, ac;
+            unsigned int h, v;
+        } scanned[MAX_COMPONENTS];
+        bool used[NUM_TABLES] = {false};
+        for (size_t i = 0; i < scanComponents; i++) {
+            size_t c = 0;
+            while (c < numComponents && components[c].id != scan[1 + 2 * i]) {
+                c++;
+            }
+            if (c == numComponents) {
+                return false;
+            }
+            scanned[i].h = components[c].h;
+            scanned[i].v = components[c].v;
+            scanned[i].dc = scan[2 + 2 * i] >> 4;
+            scanned[i].ac = 4 + (scan[2 + 2 * i] & 0xF);
+            if (scanned[i].dc >= 4 || scanned[i].ac >= NUM_TABLES ||
+                !decoders[scanned[i].dc].defined || !decoders[scanned[i].ac].defined) {
+                return false;
+            }
+            used[scanned[i].dc] = true;
+            used[scanned[i].ac] = true;
+            /* A scan of one component codes its blocks in raster order, one per MCU */
+            size_t componentWidth = (width * scanned[i].h + maxH - 1) / maxH;
+            size_t componentHeight = (height * scanned[i].v + maxV - 1) / maxV;
+            scanned[i].blocksX = (componentWidth + 7) / 8;
+            scanned[i].blocksY = (componentHeight + 7) / 8;
+        }
+        size_t numMcus;
+        if (scanComponents == 1) {
+            scanned[0].h = 1;
+            scanned[0].v = 1;
+            numMcus = scanned[0].blocksX * scanned[0].blocksY;
+        }
+        else {
+            numMcus = ((width + 8 * maxH - 1) / (8 * maxH)) * ((height + 8 * maxV - 1) / (8 * maxV));
+        }
+    
+        /* The scan must be the last thing before EOI, which finished() checks */
+        size_t scanEnd = jpeg.size() - 2;
+        if (scanStart > scanEnd) {
+            return false;
+        }
+    
+        /* Decode every symbol and count them */
+        std::uint32_t counts[NUM_TABLES][256];
+        std::memset(counts, 0, sizeof(counts));
+        size_t blocksPerMcu = 0;
+        for (size_t i = 0; i < scanComponents; i++) {
+            blocksPerMcu += scanned[i].h * scanned[i].v;
+        }
+        /* Room for a restart marker and 64 symbols per block is made an MCU at a time */
+        size_t mcuSymbols = 1 + 64 * blocksPerMcu;
+        size_t numSymbols = 0;
+        BitReader reader(reinterpret_cast<const std::uint8_t*>(jpeg.data()), scanStart, scanEnd);
+        for (size_t mcu = 0; mcu < numMcus; mcu++) {
+            if (numSymbols + mcuSymbols > symbols.size()) {
+                symbols.resize(std::max(2 * symbols.size(), numSymbols + mcuSymbols));
+            }
+            Symbol *next = symbols.data() + numSymbols;
+            if (restartInterval != 0 && mcu != 0 && mcu % restartInterval == 0) {
+                int marker = reader.restart();
+                if (marker < 0) {
+                    return false;
+                }
+                *next++ = {RESTART, (std::uint8_t)marker, 0};
+            }
+            for (size_t i = 0; i < scanComponents; i++) {
+                for (size_t block = 0; block < scanned[i].h * scanned[i].v; block++) {
+                    std::uint16_t extra;
+                    int size = reader.decode(decoders[scanned[i].dc], extra);
+                    if (size < 0 || size > 15) {
+                        return false;
+                    }
+                    counts[scanned[i].dc][size]++;
+                    *next++ = {(std::uint8_t)scanned[i].dc, (std::uint8_t)size, extra};
+                    for (size_t k = 1; k < 64; k++) {
+                        int rs = reader.decode(decoders[scanned[i].ac], extra);
+                        if (rs < 0) {
+                            return false;
+                        }
+                        counts[scanned[i].ac][rs]++;
+                        *next++ = {(std::uint8_t)scanned[i].ac, (std::uint8_t)rs, extra};
+                        if (rs == 0) {
+                            break;
+                        }
+                        k += rs >> 4;
+                    }
+                }
+            }
+            numSymbols = next - symbols.data();
+        }
+        if (!reader.finished()) {
+            return false;
+        }
+    
+        /* Keep the tables, or sample again if the last frames no longer fit them */
+        bool missing = false;
+        if (haveTables && sampled >= sampleFrames) {
+            for (size_t t = 0; t < NUM_TABLES; t++) {
+                if (!used[t]) {
+                    continue;
+                }
+                for (size_t i = 0; i < 256; i++) {
+                    missing |= counts[t][i] != 0 && tables[t].lengths[i] == 0;
+                    checkCounts[t][i] += counts[t][i];
+                }
+            }
+            /* Building optimal tables costs more than counting, so it waits for a few frames */
+            if (++sinceCheck >= checkInterval) {
+                std::uint64_t kept = 0, optimal = 0;
+                Table own;
+                for (size_t t = 0; t < NUM_TABLES; t++) {
+                    buildTable(checkCounts[t], own);
+                    kept += codedBits(checkCounts[t], tables[t].lengths);
+                    optimal += codedBits(checkCounts[t], own.lengths);
+                }
+                efficiency = kept == 0 ? 1 : (double)optimal / kept;
+                std::memset(checkCounts, 0, sizeof(checkCounts));
+                sinceCheck = 0;
+                if (efficiency < 1 - threshold) {
+                    std::memset(sampleCounts, 0, sizeof(sampleCounts));
+                    sampled = 0;
+                    missing = false;
+                    rebuilds++;
+                }
+            }
+        }
+        /* A symbol the tables lack only adds this frame to the sample */
+        if (!haveTables || sampled < sampleFrames || missing) {
+            for (size_t t = 0; t < NUM_TABLES; t++) {
+                for (size_t i = 0; i < 256; i++) {
+                    sampleCounts[t][i] += counts[t][i];
+                }
+                buildTable(sampleCounts[t], tables[t]);
+            }
+            sampled += !missing;
+            haveTables = true;
+        }
+        
+        /* Everything up to the scan but the old tables, then the new ones */
+        out.clear();
+        out.reserve(jpeg.size());
+        size_t copied = 0;
+        for (auto it = tableSegments.begin(); it != tableSegments.end(); it++) {
+            out.append(jpeg, copied, it->first - copied);
+            copied = it->first + it->second;
+        }
+        out.append(jpeg, copied, sos - copied);
+        size_t dhtLength = 2;
+        for (size_t t = 0; t < NUM_TABLES; t++) {
+            dhtLength += used[t] ? 17 + tables[t].numValues : 0;
+        }
+        out.push_back((char)MARKER);
+        out.push_back((char)DHT);
+        out.push_back((char)(dhtLength >> 8));
+        out.push_back((char)dhtLength);
+        for (size_t t = 0; t < NUM_TABLES; t++) {
+            if (used[t]) {
+                out.push_back((char)((t / 4) << 4 | (t % 4)));
+                out.append(reinterpret_cast<const char*>(tables[t].bits) + 1, 16);
+                out.append(reinterpret_cast<const char*>(tables[t].values), tables[t].numValues);
+            }
+        }
+        out.append(jpeg, sos, scanStart - sos);
+    
+        /* Every symbol takes at most 4 bytes, or 8 when stuffed */
+        size_t header = out.size();
+        out.resize(header + 8 * numSymbols + 2);
+        char *end = &out[header];
+        BitWriter writer(end);
+        for (const Symbol *it = symbols.data(); it != symbols.data() + numSymbols; it++) {
+            if (it->table == RESTART) {
+                end = writer.flush();
+                end[0] = (char)MARKER;
+                end[1] = (char)it->value;
+                writer = BitWriter(end + 2);
+                continue;
+            }
+            const Table& table = tables[it->table];
+            size_t extraBits = it->table < 4 ? it->value : it->value & 0xF;
+            writer.put(
+                (std::uint32_t)table.codes[it->value] << extraBits | it->extra,
+                table.lengths[it->value] + extraBits);
+        }
+        end = writer.flush();
+        end[0] = (char)MARKER;
+        end[1] = (char)EOI;
+        out.resize(end + 2 - out.data());
+        jpeg.swap(out);
+        return true;
+    }
+    
+}
@@ -0,0 +1,246 @@
+/*
+mjpegslice.cpp
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <exception>
+#include <future>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    constexpr static std::uint8_t MARKER = 0xFF;
+    constexpr static std::uint8_t SOI = 0xD8;
+    constexpr static std::uint8_t EOI = 0xD9;
+    constexpr static std::uint8_t SOF0 = 0xC0;
+    constexpr static std::uint8_t SOF1 = 0xC1;
+    constexpr static std::uint8_t DRI = 0xDD;
+    constexpr static std::uint8_t SOS = 0xDA;
+    constexpr static std::uint8_t RST0 = 0xD0;
+    constexpr static size_t SOF_HEIGHT = 5;
+    constexpr static size_t MAX_RESTART_INTERVAL = 0xFFFF;
+    
+    /*
+    Where the pieces of one baseline JPEG are
+    */
+    struct JpegLayout {
+        size_t sof;
+        size_t sos;
+        size_t scanStart;
+        size_t scanEnd;
+        unsigned int mcuWidth;
+        unsigned int mcuHeight;
+    };
+    
+    static inline unsigned int be16(const std::string& data, size_t pos)
+    {
+        return ((std::uint8_t)data[pos] << 8) | (std::uint8_t)data[pos + 1];
+    }
+    
+    /*
+    Finds the frame header, the scan and the MCU size.
+    Fails for anything but a single sequential scan without restart markers.
+    */
+    static bool parseJpeg(const std::string& data, JpegLayout& layout)
+    {
+        if (data.size() < 4 || (std::uint8_t)data[0] != MARKER || (std::uint8_t)data[1] != SOI ||
+            (std::uint8_t)data[data.size() - 2] != MARKER || (std::uint8_t)data[data.size() - 1] != EOI) {
+            return false;
+        }
+        layout.sof = 0;
+        size_t pos = 2;
+        while (pos + 4 <= data.size()) {
+            if ((std::uint8_t)data[pos] != MARKER) {
+                return false;
+            }
+            std::uint8_t marker = data[pos + 1];
+            if (marker == MARKER) {
+                pos++;
+                continue;
+            }
+            size_t length = be16(data, pos + 2);
+            if (pos + 2 + length > data.size()) {
+                return false;
+            }
+            if (marker == SOF0 || marker == SOF1) {
+                layout.sof = pos;
+                size_t numComponents = (std::uint8_t)data[pos + 9];
+                unsigned int maxH = 1, maxV = 1;
+                for (size_t i = 0; i < numComponents && numComponents > 1; i++) {
+                    std::uint8_t sampling = data[pos + 11 + 3 * i];
+                    maxH = std::max(maxH, (unsigned int)(sampling >> 4));
+                    maxV = std::max(maxV, (unsigned int)(sampling & 0xF));
+                }
+                layout.mcuWidth = 8 * maxH;
+                layout.mcuHeight = 8 * maxV;
+            }
+            else if ((marker & 0xF0) == 0xC0 && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                /* Progressive, lossless, or arithmetic coding */
+                return false;
+            }
+            else if (marker == DRI) {
+                return false;
+            }
+            else if (marker == SOS) {
+                layout.sos = pos;
+                layout.scanStart = pos + 2 + length;
+                layout.scanEnd = data.size() - 2;
+                return layout.sof != 0;
+            }
+            pos += 2 + length;
+        }
+        return false;
+    }
+    
+    /*
+    Whether everything up to the scan data matches, apart from the image height
+    */
+    static bool sameTables(
+        const std::string& a, const JpegLayout& la, const std::string& b, const JpegLayout& lb)
+    {
+        if (la.scanStart != lb.scanStart || la.sof != lb.sof) {
+            return false;
+        }
+        size_t height = la.sof + SOF_HEIGHT;
+        return std::equal(a.begin(), a.begin() + height, b.begin()) &&
+            std::equal(a.begin() + height + 2, a.begin() + la.scanStart, b.begin() + height + 2);
+    }
+    
+    SlicedJpegEncoder::SlicedJpegEncoder(const Jpeg::JpegSettings& settings, size_t numSlices) :
+        width (settings.size.first),
+        height (settings.size.second),
+        settings (settings)
+    {
+        size_t rows = (height + numSlices - 1) / numSlices;
+        rows = (rows + SLICE_ALIGN - 1) / SLICE_ALIGN * SLICE_ALIGN;
+        for (size_t first = 0; first < height; first += rows) {
+            Slice slice;
+            slice.firstRow = first;
+            slice.rows = std::min<size_t>(rows, height - first);
+            Jpeg::JpegSettings sliceSettings = settings;
+            sliceSettings.size.second = slice.rows;
+            slice.jpeg = std::make_unique<Jpeg::Jpeg>(sliceSettings);
+            slices.push_back(std::move(slice));
+        }
+        /* The last slice runs on the calling thread */
+        for (size_t i = 0; i + 1 < slices.size(); i++) {
+            slices[i].worker = std::make_unique<SerialWorker>();
+        }
+    }
+    
+    void SlicedJpegEncoder::setSettings(const Jpeg::JpegSettings& settings)
+    {
+        this->settings = settings;
+        for (auto it = slices.begin(); it != slices.end(); it++) {
+            Jpeg::JpegSettings sliceSettings = settings;
+            sliceSettings.size.second = it->rows;
+            it->jpeg = std::make_unique<Jpeg::Jpeg>(sliceSettings);
+            it->cached.clear();
+        }
+    }
+    
+    void SlicedJpegEncoder::setQuality(int quality)
+    {
+        if (quality == settings.quality) {
+            return;
+        }
+        for (auto it = slices.begin(); it != slices.end(); it++) {
+            it->cached[settings.quality] = std::move(it->jpeg);
+            std::unique_ptr<Jpeg::Jpeg>& cached = it->cached[quality];
+            if (!cached) {
+                Jpeg::JpegSettings sliceSettings = settings;
+                sliceSettings.size.second = it->rows;
+                sliceSettings.quality = quality;
+                cached = std::make_unique<Jpeg::Jpeg>(sliceSettings);
+            }
+            it->jpeg = std::move(cached);
+        }
+        settings.quality = quality;
+    }
+    
+    void SlicedJpegEncoder::encodeSlice(Slice& slice, const std::uint8_t *rgb)
+    {
+        std::stringstream sstr;
+        slice.jpeg->encodeRGB(rgb + slice.firstRow * width * 3);
+        slice.jpeg->write(sstr);
+        slice.out = sstr.str();
+    }
+    
+    bool SlicedJpegEncoder::encode(const std::uint8_t *rgb, std::string& out)
+    {
+        std::vector<std::future<void>> encoded;
+        for (size_t i = 0; i + 1 < slices.size(); i++) {
+            Slice *slice = &slices[i];
+            encoded.push_back(slice->worker->post([this, slice, rgb] {
+                encodeSlice(*slice, rgb);
+            }));
+        }
+        /* Every slice has to be done with rgb before anything returns or throws */
+        std::exception_ptr error;
+        try {
+            encodeSlice(slices.back(), rgb);
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        for (auto it = encoded.begin(); it != encoded.end(); it++) {
+            try {
+                it->get();
+            }
+            catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    
+        std::vector<JpegLayout> layouts(slices.size());
+        for (size_t i = 0; i < slices.size(); i++) {
+            if (!parseJpeg(slices[i].out, layouts[i]) ||
+                !sameTables(slices[0].out, layouts[0], slices[i].out, layouts[i])) {
+                return false;
+            }
+        }
+        const std::string& first = slices[0].out;
+        const JpegLayout& layout = layouts[0];
+        size_t mcusPerRow = (width + layout.mcuWidth - 1) / layout.mcuWidth;
+        size_t interval = slices[0].rows / layout.mcuHeight * mcusPerRow;
+        if (slices[0].rows % layout.mcuHeight != 0 || interval > MAX_RESTART_INTERVAL) {
+            return false;
+        }
+    
+        size_t size = layout.scanStart + 6 + 2 * slices.size();
+        for (size_t i = 0; i < slices.size(); i++) {
+            size += layouts[i].scanEnd - layouts[i].scanStart;
+        }
+        out.clear();
+        out.reserve(size);
+        out.append(first, 0, layout.sos);
+        out[layout.sof + SOF_HEIGHT] = (char)(height >> 8);
+        out[layout.sof + SOF_HEIGHT + 1] = (char)height;
+        const char dri[] = {
+            (char)MARKER, (char)DRI, 0, 4, (char)(interval >> 8), (char)interval
+        };
+        out.append(dri, sizeof(dri));
+        out.append(first, layout.sos, layout.scanStart - layout.sos);
+        for (size_t i = 0; i < slices.size(); i++) {
+            if (i != 0) {
+                out.push_back((char)MARKER);
+                out.push_back((char)(RST0 + (i - 1) % 8));
+            }
+            out.append(slices[i].out, layouts[i].scanStart, layouts[i].scanEnd - layouts[i].scanStart);
+        }
+        out.push_back((char)MARKER);
+        out.push_back((char)EOI);
+        return true;
+    }
+    
+}
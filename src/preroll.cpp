@@ -0,0 +1,295 @@
+/*
+preroll.cpp
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    PrerollBuffer::PrerollBuffer(size_t bytes, size_t maxChunks) :
+        slab(bytes),
+        records(std::max<size_t>(maxChunks, 1)),
+        head {0},
+        count {0},
+        writePos {0} {}
+    
+    bool PrerollBuffer::place(size_t size, size_t& start) const
+    {
+        if (count == records.size()) {
+            return false;
+        }
+        if (count == 0) {
+            start = 0;
+            return size <= slab.size();
+        }
+        size_t oldest = records[head].start;
+        if (writePos > oldest) {
+            /* Used bytes are [oldest, writePos), try after them, then wrap to the front */
+            if (writePos + size <= slab.size()) {
+                start = writePos;
+                return true;
+            }
+            start = 0;
+            return size <= oldest;
+        }
+        /* Used bytes wrap around, the only free space is [writePos, oldest) */
+        start = writePos;
+        return writePos + size <= oldest;
+    }
+    
+    bool PrerollBuffer::canPush(size_t size) const
+    {
+        size_t start;
+        return place(size, start);
+    }
+    
+    bool PrerollBuffer::push(
+        size_t streamNo, const MediaTime& time, std::uint32_t flags,
+        const std::uint8_t *data, size_t size, bool evict)
+    {
+        if (size > slab.size()) {
+            return false;
+        }
+        size_t start;
+        while (!place(size, start)) {
+            if (!evict) {
+                return false;
+            }
+            pop();
+        }
+        if (size != 0) {
+            std::memcpy(slab.data() + start, data, size);
+        }
+        Record& record = records[(head + count) % records.size()];
+        record.streamNo = streamNo;
+        record.time = time;
+        record.flags = flags;
+        record.start = start;
+        record.size = size;
+        count++;
+        writePos = start + size;
+        return true;
+    }
+    
+    bool PrerollBuffer::oldestPlaysAt(double time) const
+    {
+        size_t streamNo = records[head].streamNo;
+        for (size_t i = 1; i < count; i++) {
+            const Record& record = records[(head + i) % records.size()];
+            if (record.streamNo == streamNo) {
+                return record.time.seconds() > time;
+            }
+        }
+        return true;
+    }
+    
+    void PrerollBuffer::expire(double window)
+    {
+        if (count == 0) {
+            return;
+        }
+        double cutoff = records[(head + count - 1) % records.size()].time.seconds() - window;
+        while (count > 1 && records[head].time.seconds() < cutoff && !oldestPlaysAt(cutoff)) {
+            pop();
+        }
+    }
+    
+    void PrerollBuffer::pop()
+    {
+        head = (head + 1) % records.size();
+        count--;
+        if (count == 0) {
+            head = 0;
+            writePos = 0;
+        }
+    }
+    
+    PrerollAvi::PrerollAvi(
+            double seconds, size_t bytes, size_t maxChunks,
+            int width, int height, FrameRate fps,
+            int bitsPerSample, float sampleRate, int numChannels,
+            EncodingMode mode, int jpegQuality) :
+        FlacMjpegAvi(width, height, fps, bitsPerSample, sampleRate, numChannels, mode, jpegQuality),
+        buffer(bytes, maxChunks),
+        window {seconds},
+        out {nullptr},
+        triggered {false},
+        stopping {false},
+        dropped {0},
+        oversize {0},
+        discard(nullptr) {}
+    
+    PrerollAvi::PrerollAvi(
+            double seconds, size_t bytes, size_t maxChunks,
+            const Jpeg::JpegSettings& jpegSettings,
+            const Flac::FlacEncodeOptions& flacSettings,
+            FrameRate fps) :
+        FlacMjpegAvi(jpegSettings, flacSettings, fps),
+        buffer(bytes, maxChunks),
+        window {seconds},
+        out {nullptr},
+        triggered {false},
+        stopping {false},
+        dropped {0},
+        oversize {0},
+        discard(nullptr) {}
+    
+    PrerollAvi::~PrerollAvi()
+    {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            writer.join();
+        }
+    }
+    
+    void PrerollAvi::writeFrame(
+        std::ostream& /* stream */,
+        size_t streamNo, const MediaTime& time, std::uint32_t flags, const std::uint8_t *data, size_t size)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        bool tooBig = size > buffer.capacity();
+        oversize += tooBig;
+        if (!triggered) {
+            if (!buffer.push(streamNo, time, flags, data, size)) {
+                buffer.push(streamNo, time, 0, nullptr, 0);
+            }
+            buffer.expire(window);
+            return;
+        }
+        if (!buffer.push(streamNo, time, flags, data, size, false)) {
+            /* An empty chunk still takes the frame's slot in the stream */
+            dropped += !tooBig;
+            buffer.push(streamNo, time, 0, nullptr, 0, false);
+        }
+        lock.unlock();
+        cv.notify_all();
+    }
+    
+    void PrerollAvi::trigger(std::ostream& stream)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (triggered) {
+            return;
+        }
+        out = &stream;
+        triggered = true;
+        started = true;
+        writer = std::thread(&PrerollAvi::writeLoop, this);
+    }
+    
+    void PrerollAvi::writeLoop()
+    {
+        writeBeforeFrames(*out);
+        size_t numStreams = streamCount();
+        bool atKeyframe = false;
+        MediaTime keyTime;
+        /*
+        The last chunk of each stream skipped before the keyframe, kept in case
+        it's the one still playing at the keyframe
+        */
+        std::vector<PrerollBuffer::Record> held(numStreams);
+        std::vector<std::vector<std::uint8_t>> heldData(numStreams);
+        std::vector<char> holding(numStreams, false), written(numStreams, false);
+        std::vector<double> firstTimes(numStreams, 0);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] {return stopping || !buffer.empty();});
+            if (buffer.empty()) {
+                break;
+            }
+            PrerollBuffer::Record record = buffer.front();
+            lock.unlock();
+            /* The producer only appends once triggered, so the front record stays put */
+            size_t s = record.streamNo;
+            if (!atKeyframe && operator[](s).type == VIDEO && (record.flags & AVIIF_KEYFRAME) != 0) {
+                atKeyframe = true;
+                keyTime = record.time;
+            }
+            if (!atKeyframe) {
+                const std::uint8_t *data = buffer.data(record);
+                held[s] = record;
+                heldData[s].assign(data, data + record.size);
+                holding[s] = true;
+            }
+            else {
+                if (!written[s] && holding[s] && keyTime < record.time) {
+                    Avi::writeFrame(
+                        *out, s, held[s].time, held[s].flags, heldData[s].data(), heldData[s].size());
+                    firstTimes[s] = held[s].time.seconds();
+                    written[s] = true;
+                }
+                if (!written[s]) {
+                    firstTimes[s] = record.time.seconds();
+                    written[s] = true;
+                }
+                Avi::writeFrame(
+                    *out, s, record.time, record.flags,
+                    buffer.data(record), record.size);
+            }
+            lock.lock();
+            buffer.pop();
+            cv.notify_all();
+        }
+        lock.unlock();
+        
+        /* Every stream plays from the file's start, so delay those that begin later than the earliest */
+        double origin = 0;
+        bool any = false;
+        for (size_t s = 0; s < numStreams; s++) {
+            if (written[s] && (!any || firstTimes[s] < origin)) {
+                origin = firstTimes[s];
+                any = true;
+            }
+        }
+        for (size_t s = 0; s < numStreams; s++) {
+            AviStream& as = operator[](s);
+            FrameRate fps = as.getRate();
+            if (written[s] && firstTimes[s] > origin && fps.scale != 0) {
+                as.setStart((std::uint32_t)std::llround((firstTimes[s] - origin) * fps.rate / fps.scale));
+            }
+        }
+    }
+    
+    void PrerollAvi::writeVideoFrame(const std::uint8_t *rgb)
+    {
+        FlacMjpegAvi::writeVideoFrame(discard, rgb);
+    }
+    
+    bool PrerollAvi::writeVideoFrame(const std::uint8_t *rgb, std::uint64_t pts)
+    {
+        return FlacMjpegAvi::writeVideoFrame(discard, rgb, pts);
+    }
+    
+    void PrerollAvi::finish()
+    {
+        flac->finalize();
+        FlacMjpegAvi::writeSamples(discard);
+        /* The blocks gathered for a partial chunk have to reach the buffer before the writer stops */
+        writeAudioChunk(discard);
+        if (!writer.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        writer.join();
+        writeAfterFrames(*out);
+#ifdef AVIUTIL_PROFILE
+        Profiler::global().fileFinished();
+#endif
+    }
+    
+}
@@ -0,0 +1,296 @@
+/*
+profiler.cpp
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    constexpr static const char *SECTION_NAMES[Profiler::SECTIONS] = {
+        "writeVideoFrame",
+        "writeSamples",
+        "writeFrame",
+        "header rewrite",
+        "finalize"
+    };
+    
+    static thread_local std::uint64_t threadAllocations = 0;
+    static thread_local std::uint64_t threadBytes = 0;
+#ifdef AVIUTIL_PROFILE
+    /* Open scopes of each section on this thread, so nested ones aren't counted twice */
+    static thread_local unsigned int threadDepth[Profiler::SECTIONS] = {};
+#endif
+    
+    static void atomicMax(std::atomic<std::uint64_t>& max, std::uint64_t value)
+    {
+        std::uint64_t current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+    
+    /*
+    Both measure nothing unless the library is built with AVIUTIL_PROFILE,
+    whichever way the code creating the scope was built
+    */
+    Profiler::Scope::Scope(Section section, bool enabled) :
+        section {section},
+        enabled {enabled},
+        outer {false},
+        allocations {0},
+        bytes {0}
+    {
+#ifdef AVIUTIL_PROFILE
+        if (enabled) {
+            outer = threadDepth[section]++ == 0;
+            start = std::chrono::steady_clock::now();
+            allocations = threadAllocations;
+            bytes = threadBytes;
+        }
+#endif
+    }
+    
+    Profiler::Scope::~Scope()
+    {
+#ifdef AVIUTIL_PROFILE
+        if (!enabled) {
+            return;
+        }
+        threadDepth[section]--;
+        if (outer) {
+            std::uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            global().record(section, nanos, threadAllocations - allocations, threadBytes - bytes);
+        }
+#endif
+    }
+    
+    Profiler::Profiler() :
+        reportStream {nullptr}
+    {
+        reset();
+    }
+    
+    Profiler& Profiler::global()
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+    
+    void Profiler::countAllocation(size_t bytes)
+    {
+        threadAllocations++;
+        threadBytes += bytes;
+    }
+    
+    size_t Profiler::bucketOf(std::uint64_t nanos)
+    {
+        if (nanos < SUB_BUCKETS) {
+            return nanos;
+        }
+        size_t exponent = 63 - __builtin_clzll(nanos);
+        size_t sub = (nanos >> (exponent - 4)) & (SUB_BUCKETS - 1);
+        return (exponent - 3) * SUB_BUCKETS + sub;
+    }
+    
+    std::uint64_t Profiler::bucketLimit(size_t bucket)
+    {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        size_t exponent = bucket / SUB_BUCKETS + 3;
+        std::uint64_t low = (SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 4);
+        return low + ((std::uint64_t)1 << (exponent - 4)) - 1;
+    }
+    
+    void Profiler::record(Section section, std::uint64_t nanos, std::uint64_t allocations, std::uint64_t bytes)
+    {
+        Histogram& histogram = histograms[section];
+        histogram.buckets[bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+        histogram.calls.fetch_add(1, std::memory_order_relaxed);
+        histogram.allocations.fetch_add(allocations, std::memory_order_relaxed);
+        histogram.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        atomicMax(histogram.maxNanos, nanos);
+        atomicMax(histogram.maxAllocations, allocations);
+    }
+    
+    std::uint64_t Profiler::percentile(Section section, double fraction) const
+    {
+        const Histogram& histogram = histograms[section];
+        std::uint64_t calls = histogram.calls.load(std::memory_order_relaxed);
+        if (calls == 0) {
+            return 0;
+        }
+        std::uint64_t rank = std::max<std::uint64_t>((std::uint64_t)(fraction * calls + 0.999999), 1);
+        std::uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += histogram.buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(bucketLimit(i), histogram.maxNanos.load(std::memory_order_relaxed));
+            }
+        }
+        return histogram.maxNanos.load(std::memory_order_relaxed);
+    }
+    
+    void Profiler::report(std::ostream& stream) const
+    {
+        std::ios_base::fmtflags flags = stream.flags();
+        std::streamsize precision = stream.precision();
+        stream << std::left << std::setw(16) << "section" << std::right
+            << std::setw(10) << "calls"
+            << std::setw(12) << "p50 us" << std::setw(12) << "p99 us"
+            << std::setw(12) << "p99.9 us" << std::setw(12) << "max us"
+            << std::setw(12) << "allocs/call" << std::setw(12) << "bytes/call"
+            << std::setw(12) << "max allocs" << std::endl;
+        stream << std::fixed << std::setprecision(1);
+        for (size_t i = 0; i < SECTIONS; i++) {
+            const Histogram& histogram = histograms[i];
+            std::uint64_t calls = histogram.calls.load(std::memory_order_relaxed);
+            if (calls == 0) {
+                continue;
+            }
+            Section section = static_cast<Section>(i);
+            stream << std::left << std::setw(16) << SECTION_NAMES[i] << std::right
+                << std::setw(10) << calls
+                << std::setw(12) << percentile(section, 0.5) / 1000.0
+                << std::setw(12) << percentile(section, 0.99) / 1000.0
+                << std::setw(12) << percentile(section, 0.999) / 1000.0
+                << std::setw(12) << histogram.maxNanos.load(std::memory_order_relaxed) / 1000.0
+                << std::setw(12) << (double)histogram.allocations.load(std::memory_order_relaxed) / calls
+                << std::setw(12) << (double)histogram.bytes.load(std::memory_order_relaxed) / calls
+                << std::setw(12) << histogram.maxAllocations.load(std::memory_order_relaxed) << std::endl;
+        }
+        stream.flags(flags);
+        stream.precision(precision);
+    }
+    
+    void Profiler::reset()
+    {
+        for (size_t i = 0; i < SECTIONS; i++) {
+            Histogram& histogram = histograms[i];
+            for (size_t j = 0; j < BUCKETS; j++) {
+                histogram.buckets[j].store(0, std::memory_order_relaxed);
+            }
+            histogram.calls.store(0, std::memory_order_relaxed);
+            histogram.maxNanos.store(0, std::memory_order_relaxed);
+            histogram.allocations.store(0, std::memory_order_relaxed);
+            histogram.bytes.store(0, std::memory_order_relaxed);
+            histogram.maxAllocations.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    void Profiler::fileFinished()
+    {
+        std::ostream *stream = reportStream;
+        if (stream != nullptr) {
+            report(*stream);
+        }
+        reset();
+    }
+    
+}
+
+#if defined(AVIUTIL_PROFILE) && !defined(AVIUTIL_PROFILE_NO_NEW)
+
+void *operator new(size_t size)
+{
+    Avi::Profiler::countAllocation(size);
+    void *memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    Avi::Profiler::countAllocation(size);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+/* aligned_alloc wants a multiple of the alignment, and these are freed with free as well */
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    Avi::Profiler::countAllocation(size);
+    size_t align = static_cast<size_t>(alignment);
+    void *memory = std::aligned_alloc(align, size == 0 ? align : (size + align - 1) / align * align);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    Avi::Profiler::countAllocation(size);
+    size_t align = static_cast<size_t>(alignment);
+    return std::aligned_alloc(align, size == 0 ? align : (size + align - 1) / align * align);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, alignment, tag);
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, size_t, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void *memory, size_t, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+#endif
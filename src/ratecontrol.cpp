@@ -0,0 +1,69 @@
+/*
+ratecontrol.cpp
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    /*
+    Frame size is modelled as complexity / (scale + SCALE_OFFSET) ^ SIZE_EXPONENT,
+    where scale is the percentage the quality scales the quantization tables by
+    */
+    constexpr static double SCALE_OFFSET = 10;
+    constexpr static double SIZE_EXPONENT = 0.8;
+    /* Weight of the newest frame in the complexity estimate */
+    constexpr static double COMPLEXITY_WEIGHT = 0.5;
+    /* Never plan a frame smaller than this share of the per-frame budget */
+    constexpr static double MIN_BUDGET = 0.1;
+    /* Smaller changes are ignored so size noise doesn't make the quality flicker between frames */
+    constexpr static int MIN_STEP = 2;
+    
+    static double qualityScale(int quality)
+    {
+        quality = std::min(std::max(quality, 1), 100);
+        return quality < 50 ? 5000.0 / quality : 200.0 - 2 * quality;
+    }
+    
+    static int scaleQuality(double scale)
+    {
+        if (scale <= 100) {
+            return (int)std::lround((200 - std::max(scale, 0.0)) / 2);
+        }
+        return (int)std::lround(5000 / scale);
+    }
+    
+    RateControl::RateControl(
+            double bytesPerSecond, FrameRate fps, double window,
+            int minQuality, int maxQuality, int quality) :
+        frameBudget {bytesPerSecond / fps.toDouble()},
+        bufferSize {bytesPerSecond * window},
+        fullness {0},
+        complexity {0},
+        minQuality {std::max(minQuality, 1)},
+        maxQuality {std::max(std::min(maxQuality, 100), minQuality)},
+        quality {quality != 0 ? quality : (minQuality + maxQuality) / 2}
+    {
+        this->quality = std::min(std::max(this->quality, this->minQuality), this->maxQuality);
+    }
+    
+    void RateControl::update(size_t frameSize)
+    {
+        fullness = std::max(fullness + frameSize - frameBudget, 0.0);
+        double observed = frameSize * std::pow(qualityScale(quality) + SCALE_OFFSET, SIZE_EXPONENT);
+        complexity = complexity == 0 ? observed :
+            (1 - COMPLEXITY_WEIGHT) * complexity + COMPLEXITY_WEIGHT * observed;
+        
+        /* Spread paying back the excess over the window */
+        double budget = frameBudget * std::max(1 - fullness / bufferSize, MIN_BUDGET);
+        double scale = std::pow(complexity / budget, 1 / SIZE_EXPONENT) - SCALE_OFFSET;
+        int next = std::min(std::max(scaleQuality(scale), minQuality), maxQuality);
+        if (std::abs(next - quality) >= MIN_STEP || next == minQuality || next == maxQuality) {
+            quality = next;
+        }
+    }
+    
+}
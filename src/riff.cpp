@@ -26,11 +26,8 @@ void Riff::RiffChunk::writeTo(std::ostream& stream)
 {
     wordAlgin(stream);
     markOffset(stream);
-    stream.write(fourCC, FOURCC_SIZE);
-    stream.put((std::uint8_t)(dataSize >> 0));
-    stream.put((std::uint8_t)(dataSize >> 8));
-    stream.put((std::uint8_t)(dataSize >> 16));
-    stream.put((std::uint8_t)(dataSize >> 24));
+    Avi::Raw::ChunkHeader header {fourCC, (std::uint32_t)dataSize};
+    Avi::Raw::write(stream, header);
 }
 
 void Riff::RiffChunk::rewriteLength(std::ostream& stream)
@@ -42,10 +39,7 @@ void Riff::RiffChunk::rewriteLength(std::ostream& stream)
     stream.flush();
     stream.seekp(offset);
     stream.seekp(SIZE_OFFSET, std::ios_base::cur);
-    stream.put((std::uint8_t)(dataSize >> 0));
-    stream.put((std::uint8_t)(dataSize >> 8));
-    stream.put((std::uint8_t)(dataSize >> 16));
-    stream.put((std::uint8_t)(dataSize >> 24));
+    Avi::Raw::write(stream, Avi::Raw::LE32((std::uint32_t)dataSize));
     stream.flush();
     stream.seekp(store);
 }
@@ -92,6 +86,27 @@ void Riff::RiffConstList::add(const RiffChunk& subChunk)
     dataSize += subChunk.getSize();
 }
 
+void Riff::RiffJunk::writeTo(std::ostream& stream)
+{
+    static const char zeros[1024] = {0};
+    RiffChunk::writeTo(stream);
+    for (size_t left = dataSize; left > 0; left -= std::min(left, sizeof(zeros))) {
+        stream.write(zeros, std::min(left, sizeof(zeros)));
+    }
+}
+
+size_t Riff::RiffJunk::padding(std::uint64_t position, size_t alignment)
+{
+    if (alignment == 0 || position % alignment == 0) {
+        return 0;
+    }
+    size_t size = alignment - position % alignment;
+    while (size < FOURCC_SIZE + LENGTH_SIZE) {
+        size += alignment;
+    }
+    return size;
+}
+
 void Riff::RiffData::writeTo(std::ostream& stream)
 {
     RiffChunk::writeTo(stream);
@@ -0,0 +1,183 @@
+/*
+scheduler.cpp
+*/
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "aviutil.hpp"
+
+namespace Avi {
+    
+    /* Which pool the current thread belongs to, and its queue */
+    static thread_local Scheduler *currentScheduler = nullptr;
+    static thread_local size_t currentIndex = 0;
+    
+    Scheduler::Scheduler(size_t numThreads) :
+        queued {0},
+        pending {},
+        executed {0},
+        steals {0},
+        nextQueue {0},
+        stopping {false}
+    {
+        if (numThreads == 0) {
+            numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        for (size_t i = 0; i < numThreads; i++) {
+            queues.push_back(std::make_unique<WorkerQueues>());
+        }
+        for (size_t i = 0; i < numThreads; i++) {
+            threads.emplace_back(&Scheduler::run, this, i);
+        }
+    }
+    
+    Scheduler::~Scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        sleepCv.notify_all();
+        for (auto it = threads.begin(); it != threads.end(); it++) {
+            it->join();
+        }
+    }
+    
+    Scheduler& Scheduler::shared()
+    {
+        static Scheduler scheduler;
+        return scheduler;
+    }
+    
+    void Scheduler::post(std::function<void()> job, Priority priority)
+    {
+        size_t index = currentScheduler == this ? currentIndex : nextQueue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->jobs[priority].push_back(std::move(job));
+            queues[index]->sizes[priority]++;
+            pending[priority]++;
+            queued++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        sleepCv.notify_one();
+    }
+    
+    bool Scheduler::take(size_t index, std::function<void()>& job)
+    {
+        for (size_t p = 0; p < PRIORITIES; p++) {
+            if (pending[p] == 0) {
+                continue;
+            }
+            /* Oldest first, from this thread's queue and then from the others' */
+            for (size_t i = 0; i < queues.size(); i++) {
+                WorkerQueues& q = *queues[(index + i) % queues.size()];
+                if (q.sizes[p] == 0) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if (q.jobs[p].empty()) {
+                    continue;
+                }
+                job = std::move(q.jobs[p].front());
+                q.jobs[p].pop_front();
+                q.sizes[p]--;
+                pending[p]--;
+                if (i != 0) {
+                    steals++;
+                }
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void Scheduler::run(size_t index)
+    {
+        currentScheduler = this;
+        currentIndex = index;
+        std::function<void()> job;
+        while (true) {
+            if (take(index, job)) {
+                job();
+                job = nullptr;
+                executed++;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepCv.wait(lock, [this] {return stopping || queued > 0;});
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+    
+    Scheduler::Queue::Queue(Scheduler& scheduler, Priority priority, size_t maxInFlight) :
+        scheduler (scheduler),
+        maxInFlight {std::max<size_t>(maxInFlight, 1)},
+        inFlight {0},
+        priority {priority},
+        completed {0},
+        peakDepth {0} {}
+    
+    Scheduler::Queue::~Queue()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] {return inFlight == 0;});
+    }
+    
+    void Scheduler::Queue::post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            peakDepth = std::max(peakDepth, backlog.size() + inFlight + 1);
+            if (inFlight == maxInFlight) {
+                backlog.push_back(std::move(job));
+                return;
+            }
+            inFlight++;
+        }
+        dispatch(std::move(job));
+    }
+    
+    void Scheduler::Queue::dispatch(std::function<void()> job)
+    {
+        scheduler.post([this, job] {
+            job();
+            completed++;
+            std::function<void()> next;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (backlog.empty()) {
+                    /* The queue may be destroyed as soon as the lock is released */
+                    inFlight--;
+                    cv.notify_all();
+                    return;
+                }
+                next = std::move(backlog.front());
+                backlog.pop_front();
+            }
+            dispatch(std::move(next));
+        }, (Priority)priority.load());
+    }
+    
+    size_t Scheduler::Queue::depth()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return backlog.size() + inFlight;
+    }
+    
+    size_t Scheduler::Queue::getPeakDepth()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return peakDepth;
+    }
+    
+}
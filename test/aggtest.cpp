@@ -0,0 +1,113 @@
+/*
+aggtest.cpp
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+constexpr static int WIDTH = 32;
+constexpr static int HEIGHT = 32;
+constexpr static int FRAMES = 10;
+/* Not a whole number of 4 block chunks */
+constexpr static size_t SAMPLES = 4410;
+
+static std::uint32_t strhScale(const Avi::AviLayout& layout, size_t streamNo)
+{
+    return readLE32(layout.streams[streamNo].strh.data() + offsetof(Avi::Raw::AviStreamHeader, scale));
+}
+
+static void audioOf(const char *path, size_t& chunks, size_t& bytes, std::uint32_t& scale)
+{
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    chunks = bytes = 0;
+    for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+        if (it->streamNo == 1) {
+            chunks++;
+            bytes += it->size;
+        }
+    }
+    scale = layout.streams.size() > 1 ? strhScale(layout, 1) : 0;
+}
+
+static void testFlacMjpegAvi(const char *path, size_t& bytes)
+{
+    Avi::FlacMjpegAvi avi(WIDTH, HEIGHT, 10);
+    CHECK(avi.setAudioChunking(4));
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    avi.prepare(out);
+    CHECK(!avi.setAudioChunking(2));
+    CHECK(!avi.setAudioChunkingToVideo(5));
+    std::vector<std::uint8_t> rgb(WIDTH * HEIGHT * 3);
+    std::vector<std::int16_t> samples(SAMPLES);
+    for (int frame = 0; frame < FRAMES; frame++) {
+        for (size_t i = 0; i < samples.size(); i++) {
+            samples[i] = (std::int16_t)((frame * 131 + i * 17) % 4000);
+        }
+        avi.writeVideoFrame(out, rgb);
+        avi.writeSamples(out, samples);
+    }
+    avi.finish(out);
+    out.close();
+    
+    size_t chunks;
+    std::uint32_t scale;
+    audioOf(path, chunks, bytes, scale);
+    size_t blocks = (FRAMES * SAMPLES + Flac::FLAC_DEFAULT_BLOCKSIZE - 1) / Flac::FLAC_DEFAULT_BLOCKSIZE;
+    CHECK(chunks == (blocks + 3) / 4);
+    CHECK(scale == 4 * Flac::FLAC_DEFAULT_BLOCKSIZE);
+}
+
+static void testAfterFirstBlock()
+{
+    Avi::FlacMjpegAvi avi(WIDTH, HEIGHT, 10);
+    CHECK(avi.setAudioChunking(8));
+    std::stringstream out;
+    avi.writeSamples(out, std::vector<std::int16_t>(4 * Flac::FLAC_DEFAULT_BLOCKSIZE));
+    CHECK(!avi.setAudioChunking(2));
+}
+
+/*
+The partial last chunk has to reach the file through the preroll buffer too
+*/
+static void testPreroll(const char *path, size_t expected)
+{
+    Avi::PrerollAvi avi(10.0, 1 << 20, 1024, WIDTH, HEIGHT, 10, 16, 44100, 1);
+    CHECK(avi.setAudioChunking(4));
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    avi.trigger(out);
+    CHECK(!avi.setAudioChunking(2));
+    std::vector<std::uint8_t> rgb(WIDTH * HEIGHT * 3);
+    std::vector<std::int16_t> samples(SAMPLES);
+    for (int frame = 0; frame < FRAMES; frame++) {
+        for (size_t i = 0; i < samples.size(); i++) {
+            samples[i] = (std::int16_t)((frame * 131 + i * 17) % 4000);
+        }
+        avi.writeVideoFrame(rgb);
+        avi.writeSamples(samples);
+    }
+    avi.finish();
+    out.close();
+    
+    size_t chunks, bytes;
+    std::uint32_t scale;
+    audioOf(path, chunks, bytes, scale);
+    CHECK(bytes == expected);
+    CHECK(scale == 4 * Flac::FLAC_DEFAULT_BLOCKSIZE);
+}
+
+int main()
+{
+    const char *path = "aggtest.avi";
+    size_t bytes = 0;
+    testFlacMjpegAvi(path, bytes);
+    testAfterFirstBlock();
+    testPreroll(path, bytes);
+    std::remove(path);
+    return report("aggtest");
+}
@@ -0,0 +1,86 @@
+/*
+aligntest.cpp
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+constexpr static size_t ALIGNMENT = 4096;
+
+static void writeClip(std::ostream& out)
+{
+    int width = 64, height = 48;
+    Jpeg::JpegSettings jpegSettings(
+        std::pair<int, int>(width, height), nullptr, Jpeg::RELATIVE,
+        std::pair<int, int>(1, 1), 50, Jpeg::flagHuffmanDefault);
+    Flac::FlacEncodeOptions flacOptions(
+        1, 16, 44100, Flac::FLAC_DEFAULT_BLOCKSIZE, Flac::FLAC_DEFAULT_LPCBITS,
+        Flac::FLAC_DEFAULT_MINPRED, Flac::FLAC_DEFAULT_MAXPRED,
+        Flac::FLAC_DEFAULT_MINPART, Flac::FLAC_DEFAULT_MAXPART, 14, 0);
+    Avi::MuxAvi mux(width, height, 10);
+    mux.setAlignment(ALIGNMENT, true);
+    size_t video = mux.addMjpegStream(jpegSettings, 10);
+    size_t audio = mux.addFlacStream(flacOptions);
+    mux.prepare(out);
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    std::vector<std::int16_t> samples(4410);
+    for (int frame = 0; frame < 40; frame++) {
+        for (size_t i = 0; i < rgb.size(); i++) {
+            rgb[i] = (std::uint8_t)(frame * 3 + i % 7);
+        }
+        for (size_t i = 0; i < samples.size(); i++) {
+            samples[i] = (std::int16_t)((frame * 37 + i * 11) % 3000);
+        }
+        mux.writeVideoFrame(video, rgb);
+        mux.writeSamples(audio, samples);
+    }
+    mux.finish();
+}
+
+static void checkLayout(const char *path)
+{
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    std::vector<std::uint8_t> data = readFile(path);
+    CHECK(layout.moviOffset % ALIGNMENT == 0);
+    size_t video = 0;
+    for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+        /* Every idx1 offset lands on its chunk's header despite the JUNK */
+        CHECK(it->offset + 8 + it->size <= data.size());
+        CHECK(std::memcmp(data.data() + it->offset, it->fourCC, Riff::FOURCC_SIZE) == 0);
+        if (it->streamNo == 0) {
+            CHECK(it->offset % ALIGNMENT == 0);
+            video++;
+        }
+    }
+    CHECK(video == 40);
+    CHECK(layout.index.size() > 40);
+}
+
+int main()
+{
+    const char *path = "aligntest.avi";
+    const char *directPath = "aligntest-direct.avi";
+    {
+        std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+        writeClip(out);
+    }
+    {
+        Avi::DirectFileStream out(directPath, ALIGNMENT, 64 * 1024);
+        CHECK(out.good());
+        writeClip(out);
+        out.close();
+        CHECK(out.good());
+    }
+    checkLayout(path);
+    /* Same bytes whether or not the page cache is bypassed */
+    CHECK(readFile(path) == readFile(directPath));
+    std::remove(path);
+    std::remove(directPath);
+    return report("aligntest");
+}
@@ -0,0 +1,177 @@
+/*
+asynctest.cpp
+*/
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+/*
+Exposes submit to queue encodes that throw or wait
+*/
+class TestMux : public Avi::MuxAvi {
+    public:
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool open = false;
+        TestMux(unsigned int width, unsigned int height, ::Avi::FrameRate fps, size_t maxPending) :
+            MuxAvi(width, height, fps, maxPending) {}
+        std::future<void> writeFailingFrame(size_t streamNo)
+        {
+            return submit(streamNo, ::Avi::AVIIF_KEYFRAME, [](ChunkList&) {
+                throw std::runtime_error("encoder failed");
+            }, false, 0, true);
+        }
+        /*
+        Its encode waits for openGate
+        */
+        std::future<void> writeGatedFrame(size_t streamNo, size_t size)
+        {
+            return submit(streamNo, ::Avi::AVIIF_KEYFRAME, [this, size](ChunkList& chunks) {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] {return open;});
+                chunks.emplace_back(size);
+            }, false, 0, true);
+        }
+        void openGate()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            open = true;
+            cv.notify_all();
+        }
+};
+
+static bool ready(std::future<void>& future)
+{
+    return future.wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+}
+
+static void testFailedEncode(const char *path)
+{
+    int width = 16, height = 16;
+    TestMux mux(width, height, 10, 8);
+    size_t video = mux.addRawVideoStream(width, height, 10);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    mux.prepare(out);
+    std::vector<std::uint8_t> dib(width * height * 3);
+    std::future<void> before = mux.writeVideoFrameAsync(video, dib);
+    std::future<void> failed = mux.writeFailingFrame(video);
+    std::future<void> after = mux.writeVideoFrameAsync(video, dib);
+    std::future<void> finished = mux.finishAsync();
+    CHECK(ready(finished));
+    bool threw = false;
+    try {
+        failed.get();
+    }
+    catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    before.get();
+    after.get();
+    threw = false;
+    try {
+        finished.get();
+    }
+    catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    CHECK(layout.index.size() == 2);
+}
+
+static void testQueueFull(const char *path)
+{
+    int width = 16, height = 16;
+    TestMux mux(width, height, 10, 2);
+    size_t video = mux.addRawVideoStream(width, height, 10);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    mux.prepare(out);
+    std::vector<std::uint8_t> dib(width * height * 3);
+    std::vector<std::future<void>> futures;
+    futures.push_back(mux.writeGatedFrame(video, dib.size()));
+    futures.push_back(mux.writeGatedFrame(video, dib.size()));
+    /* Refused at once instead of queueing a third job */
+    std::future<void> refused = mux.writeVideoFrameAsync(video, dib);
+    CHECK(refused.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    bool threw = false;
+    try {
+        refused.get();
+    }
+    catch (const std::length_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(mux.pendingJobs() == 2);
+    mux.openGate();
+    for (auto it = futures.begin(); it != futures.end(); it++) {
+        CHECK(ready(*it));
+        it->get();
+    }
+    /* Room again */
+    std::future<void> retried = mux.writeVideoFrameAsync(video, dib);
+    CHECK(ready(retried));
+    retried.get();
+    mux.finish();
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    CHECK(layout.index.size() == 3);
+}
+
+/*
+A callback that queues the next frame, as an event loop would
+*/
+static void testChainedCallbacks(const char *path)
+{
+    int width = 16, height = 16;
+    Avi::MuxAvi mux(width, height, 10, 4);
+    size_t video = mux.addRawVideoStream(width, height, 10);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    mux.prepare(out);
+    std::vector<std::uint8_t> dib(width * height * 3);
+    std::promise<void> done;
+    std::vector<std::future<void>> futures;
+    std::function<void()> next;
+    int remaining = 20;
+    next = [&] {
+        if (--remaining == 0) {
+            done.set_value();
+            return;
+        }
+        futures.push_back(mux.writeVideoFrameAsync(video, dib, next));
+    };
+    futures.push_back(mux.writeVideoFrameAsync(video, dib, next));
+    std::future<void> chain = done.get_future();
+    CHECK(ready(chain));
+    std::future<void> finished = mux.finishAsync();
+    CHECK(ready(finished));
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    CHECK(layout.index.size() == 20);
+}
+
+int main()
+{
+    const char *path = "asynctest.avi";
+    testFailedEncode(path);
+    testQueueFull(path);
+    testChainedCallbacks(path);
+    std::remove(path);
+    return report("asynctest");
+}
@@ -0,0 +1,152 @@
+/*
+checksumtest.cpp
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+/*
+One bit at a time, to check whichever way crc32c picks on this CPU
+*/
+static std::uint32_t crc32cBitwise(const std::uint8_t *data, size_t size)
+{
+    std::uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static void testCrc32c()
+{
+    CHECK(Avi::crc32c("123456789", 9) == 0xE3069283);
+    CHECK(Avi::crc32c(nullptr, 0) == 0);
+
+    std::vector<std::uint8_t> data(40000);
+    std::uint32_t seed = 1;
+    for (size_t i = 0; i < data.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (std::uint8_t)(seed >> 16);
+    }
+    const size_t sizes[] = {1, 7, 8, 9, 63, 1024, 3071, 3072, 3073, 3079, 6144, 10000, 39990};
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t size : sizes) {
+            const std::uint8_t *start = data.data() + offset;
+            std::uint32_t expected = crc32cBitwise(start, size);
+            CHECK(Avi::crc32c(start, size) == expected);
+            /* Continuing from the CRC of a prefix */
+            size_t split = size / 3;
+            CHECK(Avi::crc32c(start + split, size - split, Avi::crc32c(start, split)) == expected);
+        }
+    }
+}
+
+static void writeRecording(const std::string& path, bool checksums)
+{
+    int width = 32, height = 32, sampleRate = 44100;
+    float fps = 10;
+    Avi::FlacMjpegAvi avi(width, height, fps, 16, sampleRate, 1, Avi::NORMAL);
+    avi.setChecksums(checksums);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    avi.prepare(out);
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    std::vector<std::int16_t> samples(sampleRate / fps);
+    for (int i = 0; i < 20; i++) {
+        for (size_t j = 0; j < rgb.size(); j++) {
+            rgb[j] = (std::uint8_t)(i * 8 + j);
+        }
+        for (size_t j = 0; j < samples.size(); j++) {
+            samples[j] = (std::int16_t)((i * 131 + j * 17) % 4000);
+        }
+        avi.writeVideoFrame(out, rgb);
+        avi.writeSamples(out, samples);
+    }
+    avi.finish(out);
+}
+
+static bool intact(const std::string& path, size_t& checked)
+{
+    Avi::ChecksumReport report;
+    checked = 0;
+    if (!Avi::verifyChecksums(path, report, 2)) {
+        return false;
+    }
+    checked = report.checked;
+    return report.indexIntact && report.corrupt.empty();
+}
+
+static void testFlippedByte(const std::string& path)
+{
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    size_t checked;
+    CHECK(intact(path, checked));
+    CHECK(checked == layout.index.size());
+    if (layout.index.size() < 4) {
+        return;
+    }
+
+    size_t target = layout.index.size() / 2;
+    std::uint64_t position = layout.index[target].offset + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE +
+        layout.index[target].size / 2;
+    std::FILE *file = std::fopen(path.c_str(), "r+b");
+    CHECK(file != nullptr);
+    if (file == nullptr) {
+        return;
+    }
+    std::fseek(file, position, SEEK_SET);
+    int byte = std::fgetc(file);
+    std::fseek(file, position, SEEK_SET);
+    std::fputc(byte ^ 0x10, file);
+    std::fclose(file);
+
+    for (size_t numThreads = 1; numThreads <= 3; numThreads++) {
+        Avi::ChecksumReport report;
+        CHECK(Avi::verifyChecksums(path, report, numThreads));
+        CHECK(report.indexIntact);
+        CHECK(report.corrupt.size() == 1);
+        CHECK(!report.corrupt.empty() && report.corrupt[0] == target);
+    }
+}
+
+static void testEdits(const std::string& input, const std::string& plain, const std::string& output)
+{
+    Avi::AviLayout trimmed, joined;
+    size_t checked;
+    CHECK(Avi::trim(input, output, 0.55, 1.5));
+    CHECK(readLayout(output, trimmed));
+    CHECK(intact(output, checked));
+    CHECK(checked == trimmed.index.size());
+
+    CHECK(Avi::concatenate({input, input}, output));
+    CHECK(readLayout(output, joined));
+    CHECK(intact(output, checked));
+    CHECK(checked == joined.index.size());
+
+    /* Without checksums in every input the output has none */
+    CHECK(Avi::concatenate({input, plain}, output));
+    Avi::ChecksumReport report;
+    CHECK(!Avi::verifyChecksums(output, report));
+}
+
+int main()
+{
+    testCrc32c();
+    std::string input = "checksumtest.avi", plain = "checksumtest-plain.avi", output = "checksumtest-out.avi";
+    writeRecording(input, true);
+    writeRecording(plain, false);
+    testEdits(input, plain, output);
+    testFlippedByte(input);
+    std::remove(input.c_str());
+    std::remove(plain.c_str());
+    std::remove(output.c_str());
+    return report("checksumtest");
+}
@@ -0,0 +1,114 @@
+/*
+edittest.cpp
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+static void writeRecording(const std::string& path, double seconds, bool proxy = false)
+{
+    int width = 32, height = 32, sampleRate = 44100;
+    float fps = 10;
+    Avi::FlacMjpegAvi avi(width, height, fps, 16, sampleRate, 1, Avi::NORMAL);
+    if (proxy) {
+        CHECK(avi.addProxyStream(2));
+    }
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    avi.prepare(out);
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    std::vector<std::int16_t> samples(sampleRate / fps);
+    for (int i = 0; i < seconds * fps; i++) {
+        for (size_t j = 0; j < rgb.size(); j++) {
+            rgb[j] = (std::uint8_t)(i * 8 + j);
+        }
+        for (size_t j = 0; j < samples.size(); j++) {
+            samples[j] = (std::int16_t)(1000 * std::sin((i * samples.size() + j) * 0.05));
+        }
+        avi.writeVideoFrame(out, rgb);
+        avi.writeSamples(out, samples);
+    }
+    avi.finish(out);
+}
+
+static size_t countStream(const Avi::AviLayout& layout, size_t streamNo)
+{
+    size_t count = 0;
+    for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+        count += it->streamNo == streamNo;
+    }
+    return count;
+}
+
+static void testTrimStart(const std::string& input, const std::string& output)
+{
+    CHECK(Avi::trim(input, output, 1.05, 2));
+    Avi::AviLayout layout;
+    CHECK(readLayout(output, layout));
+    CHECK(layout.streams.size() == 2);
+    if (layout.streams.size() != 2) {
+        return;
+    }
+    /* Frames 1.0 to 1.9 s, as 1.0 is the keyframe before the start */
+    CHECK(countStream(layout, 0) == 10);
+    CHECK(totalFrames(layout) == 10);
+    
+    /* The audio block playing at 1.0 s starts before it, so the video is delayed by the difference */
+    const Avi::AviLayout::Stream& video = layout.streams[0];
+    const Avi::AviLayout::Stream& audio = layout.streams[1];
+    double audioTick = (double)audio.scale / audio.rate;
+    double videoTick = (double)video.scale / video.rate;
+    double audioFirst = std::floor(1.0 / audioTick) * audioTick;
+    CHECK(audio.start == 0);
+    CHECK(video.start > 0);
+    CHECK(std::fabs(video.start * videoTick - (1.0 - audioFirst)) <= videoTick / 2);
+}
+
+static void testConcatenate(const std::string& input, const std::string& output)
+{
+    CHECK(Avi::concatenate({input, input}, output));
+    Avi::AviLayout original, joined;
+    CHECK(readLayout(input, original));
+    CHECK(readLayout(output, joined));
+    CHECK(joined.index.size() == 2 * original.index.size());
+    CHECK(totalFrames(joined) == 2 * totalFrames(original));
+}
+
+/*
+Only the first video stream's frames count in avih, not the proxy's as well
+*/
+static void testTwoVideoStreams(const std::string& input, const std::string& output)
+{
+    Avi::AviLayout original, trimmed, joined;
+    CHECK(readLayout(input, original));
+    CHECK(original.streams.size() == 3);
+    CHECK(countStream(original, 2) == 30);
+    CHECK(totalFrames(original) == 30);
+    
+    CHECK(Avi::trim(input, output, 1.05, 2));
+    CHECK(readLayout(output, trimmed));
+    CHECK(countStream(trimmed, 2) == 10);
+    CHECK(totalFrames(trimmed) == 10);
+    
+    CHECK(Avi::concatenate({input, input}, output));
+    CHECK(readLayout(output, joined));
+    CHECK(totalFrames(joined) == 60);
+}
+
+int main()
+{
+    std::string input = "edittest.avi", output = "edittest-out.avi";
+    writeRecording(input, 3);
+    testTrimStart(input, output);
+    testConcatenate(input, output);
+    writeRecording(input, 3, true);
+    testTwoVideoStreams(input, output);
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+    return report("edittest");
+}
@@ -0,0 +1,74 @@
+/*
+headertest.cpp
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+static_assert(Avi::Raw::LE32(0x12345678).bytes[0] == 0x78, "LE32 must be little-endian at compile time");
+static_assert(sizeof(Avi::Raw::Chunk<Avi::Raw::BitmapInfoHeader>) == 48, "strf chunk must have no padding");
+
+int main()
+{
+    const char *path = "headertest.avi";
+    unsigned int width = 40, height = 30;
+    Jpeg::JpegSettings jpegSettings(
+        std::pair<int, int>(width, height), nullptr, Jpeg::RELATIVE,
+        std::pair<int, int>(1, 1), 75, Jpeg::flagHuffmanDefault);
+    Flac::FlacEncodeOptions flacOptions(
+        2, 16, 48000, Flac::FLAC_DEFAULT_BLOCKSIZE, Flac::FLAC_DEFAULT_LPCBITS,
+        Flac::FLAC_DEFAULT_MINPRED, Flac::FLAC_DEFAULT_MAXPRED,
+        Flac::FLAC_DEFAULT_MINPART, Flac::FLAC_DEFAULT_MAXPART, 14, 0);
+    Avi::MuxAvi mux(width, height, Avi::FrameRate(30000, 1001));
+    size_t video = mux.addMjpegStream(jpegSettings, Avi::FrameRate(30000, 1001));
+    size_t audio = mux.addFlacStream(flacOptions);
+    size_t raw = mux.addRawVideoStream(width, height, 15);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    mux.prepare(out);
+    std::vector<std::uint8_t> frame(width * height * 3, 60);
+    std::vector<std::int16_t> samples(2 * 4800);
+    for (int i = 0; i < 7; i++) {
+        mux.writeVideoFrame(video, frame);
+        mux.writeVideoFrame(raw, frame);
+        mux.writeSamples(audio, samples);
+    }
+    mux.finish();
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    CHECK(layout.streams.size() == 3);
+    if (layout.streams.size() == 3) {
+        for (size_t i = 0; i < 3; i++) {
+            CHECK(layout.streams[i].strh.size() == sizeof(Avi::Raw::AviStreamHeader));
+        }
+        CHECK(layout.streams[0].scale == 1001 && layout.streams[0].rate == 30000);
+        CHECK(layout.streams[1].scale == 4096 && layout.streams[1].rate == 48000);
+        CHECK(layout.streams[2].scale == 1 && layout.streams[2].rate == 15);
+        
+        /* The rewrite at finish leaves the final lengths */
+        const std::uint8_t *strh = layout.streams[0].strh.data();
+        CHECK(readLE32(strh + offsetof(Avi::Raw::AviStreamHeader, length)) == 7);
+        CHECK(readLE32(strh + offsetof(Avi::Raw::AviStreamHeader, handler)) == readLE32((const std::uint8_t*)"MJPG"));
+        
+        const std::vector<std::uint8_t>& bitmap = layout.streams[2].strf;
+        CHECK(bitmap.size() == sizeof(Avi::Raw::BitmapInfoHeader));
+        CHECK(readLE32(bitmap.data() + offsetof(Avi::Raw::BitmapInfoHeader, width)) == width);
+        CHECK(readLE32(bitmap.data() + offsetof(Avi::Raw::BitmapInfoHeader, sizeImage)) == ((width * 3 + 3) & ~3u) * height);
+        
+        /* WAVEFORMATEX followed by the FLAC STREAMINFO */
+        const std::vector<std::uint8_t>& wave = layout.streams[1].strf;
+        CHECK(wave.size() > sizeof(Avi::Raw::WaveFormatEx));
+        CHECK((readLE32(wave.data() + offsetof(Avi::Raw::WaveFormatEx, channels)) & 0xFFFF) == 2);
+        CHECK(readLE32(wave.data() + offsetof(Avi::Raw::WaveFormatEx, samplesPerSec)) == 48000);
+        CHECK((readLE32(wave.data() + offsetof(Avi::Raw::WaveFormatEx, extraSize)) & 0xFFFF) ==
+            wave.size() - sizeof(Avi::Raw::WaveFormatEx));
+    }
+    CHECK(totalFrames(layout) == 7);
+    std::remove(path);
+    return report("headertest");
+}
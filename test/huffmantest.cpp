@@ -0,0 +1,90 @@
+/*
+huffmantest.cpp
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+#include "jpegdecode.hpp"
+#include "testutil.hpp"
+
+static std::string encode(Jpeg::Jpeg& jpeg, const std::vector<std::uint8_t>& rgb)
+{
+    std::stringstream sstr;
+    jpeg.encodeRGB(rgb.data());
+    jpeg.write(sstr);
+    return sstr.str();
+}
+
+/*
+Smooth gradients for the first scene, noise for the second
+*/
+static void drawFrame(std::vector<std::uint8_t>& rgb, int width, int height, int frame, bool noisy)
+{
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            std::uint8_t *pixel = rgb.data() + 3 * (y * width + x);
+            double value = noisy ? (x * 7 + y * 13 + frame * 31) % 97 * 2.5 :
+                128 + 100 * std::sin((x + frame) * 0.05) * std::cos(y * 0.07);
+            pixel[0] = (std::uint8_t)value;
+            pixel[1] = (std::uint8_t)(255 - value);
+            pixel[2] = (std::uint8_t)(x * y + frame);
+        }
+    }
+}
+
+static bool sameCoefficients(const std::string& a, const std::string& b)
+{
+    JpegCoefficients first, second;
+    return decodeJpeg(a, first) && decodeJpeg(b, second) &&
+        first.width == second.width && first.height == second.height &&
+        first.quantTables == second.quantTables && first.components == second.components;
+}
+
+static void testRoundTrip()
+{
+    int width = 160, height = 120;
+    Jpeg::Jpeg jpeg(Jpeg::JpegSettings(
+        std::pair<int, int>(width, height), nullptr, Jpeg::RELATIVE,
+        std::pair<int, int>(1, 1), 75, Jpeg::flagHuffmanDefault));
+    Avi::AmortizedHuffman huffman(0.01, 2, 4);
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    size_t before = 0, after = 0;
+    for (int frame = 0; frame < 24; frame++) {
+        drawFrame(rgb, width, height, frame, frame >= 12);
+        std::string original = encode(jpeg, rgb);
+        std::string recoded = original;
+        CHECK(huffman.recode(recoded));
+        CHECK(sameCoefficients(original, recoded));
+        before += original.size();
+        after += recoded.size();
+        /* Only checked every 4 frames once the 2 sampled frames are in */
+        if (frame == 4) {
+            CHECK(huffman.getEfficiency() == 1);
+        }
+        if (frame == 5) {
+            CHECK(huffman.getEfficiency() < 1);
+        }
+    }
+    CHECK(after < before);
+    /* The change of scene no longer fits the first tables */
+    CHECK(huffman.getRebuilds() >= 1);
+}
+
+static void testRejects()
+{
+    Avi::AmortizedHuffman huffman;
+    std::string notJpeg = "not a jpeg";
+    CHECK(!huffman.recode(notJpeg));
+    CHECK(notJpeg == "not a jpeg");
+}
+
+int main()
+{
+    testRoundTrip();
+    testRejects();
+    return report("huffmantest");
+}
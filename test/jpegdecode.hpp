@@ -0,0 +1,272 @@
+/*
+jpegdecode.hpp
+Decodes a baseline JPEG to its quantized DCT coefficients, for the tests to
+compare encodings exactly. Two JPEGs with the same quantization tables and
+coefficients decode to the same pixels, whatever their Huffman tables or
+restart markers.
+*/
+
+#ifndef _AVIUTIL_JPEGDECODE_HPP
+#define _AVIUTIL_JPEGDECODE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct JpegCoefficients {
+    unsigned int width;
+    unsigned int height;
+    unsigned int restartInterval;
+    /* Every DQT segment's contents, in order */
+    std::string quantTables;
+    /* Each component's blocks in raster order, 64 coefficients each in zigzag order */
+    std::vector<std::vector<std::int16_t>> components;
+};
+
+namespace JpegDecode {
+    
+    struct Table {
+        bool defined = false;
+        std::uint8_t values[256];
+        std::int32_t maxCode[18];
+        std::int32_t valuePtr[17];
+        std::int32_t minCode[17];
+    };
+    
+    class Bits {
+        private:
+            const std::string& data;
+            size_t pos;
+            std::uint32_t acc;
+            int numBits;
+        public:
+            bool overrun;
+            Bits(const std::string& data, size_t pos) : data {data}, pos {pos}, acc {0}, numBits {0}, overrun {false} {}
+            int bit()
+            {
+                if (numBits == 0) {
+                    std::uint8_t byte = 0;
+                    if (pos < data.size() && (std::uint8_t)data[pos] != 0xFF) {
+                        byte = data[pos++];
+                    }
+                    else if (pos + 1 < data.size() && (std::uint8_t)data[pos + 1] == 0) {
+                        byte = 0xFF;
+                        pos += 2;
+                    }
+                    else {
+                        overrun = true;
+                    }
+                    acc = byte;
+                    numBits = 8;
+                }
+                numBits--;
+                return (acc >> numBits) & 1;
+            }
+            int receive(int size)
+            {
+                int value = 0;
+                for (int i = 0; i < size; i++) {
+                    value = (value << 1) | bit();
+                }
+                return value;
+            }
+            int decode(const Table& table)
+            {
+                std::int32_t code = bit();
+                for (int length = 1; length <= 16; length++) {
+                    if (code <= table.maxCode[length]) {
+                        return table.values[table.valuePtr[length] + code - table.minCode[length]];
+                    }
+                    code = (code << 1) | bit();
+                }
+                return -1;
+            }
+            /*
+            Drops the padding bits and reads the marker that has to follow them
+            */
+            int marker()
+            {
+                numBits = 0;
+                if (pos + 1 >= data.size() || (std::uint8_t)data[pos] != 0xFF) {
+                    return -1;
+                }
+                pos += 2;
+                return (std::uint8_t)data[pos - 1];
+            }
+            size_t position() const
+            {
+                return pos;
+            }
+    };
+    
+    static inline unsigned int be16(const std::string& data, size_t pos)
+    {
+        return ((std::uint8_t)data[pos] << 8) | (std::uint8_t)data[pos + 1];
+    }
+    
+    static inline int extend(int value, int size)
+    {
+        return size != 0 && value < (1 << (size - 1)) ? value - (1 << size) + 1 : value;
+    }
+    
+}
+
+/*
+Fails for anything but one baseline or extended sequential Huffman scan,
+and for restart markers that are missing or out of sequence
+*/
+static inline bool decodeJpeg(const std::string& jpeg, JpegCoefficients& out)
+{
+    using namespace JpegDecode;
+    if (jpeg.size() < 4 || (std::uint8_t)jpeg[0] != 0xFF || (std::uint8_t)jpeg[1] != 0xD8) {
+        return false;
+    }
+    Table tables[8];
+    struct Component {
+        unsigned int id, h, v, blocksX, blocksY, dc, ac;
+        int pred;
+    };
+    std::vector<Component> components;
+    out.width = out.height = out.restartInterval = 0;
+    out.quantTables.clear();
+    unsigned int maxH = 1, maxV = 1;
+    size_t pos = 2;
+    while (true) {
+        if (pos + 4 > jpeg.size() || (std::uint8_t)jpeg[pos] != 0xFF) {
+            return false;
+        }
+        std::uint8_t marker = jpeg[pos + 1];
+        size_t length = be16(jpeg, pos + 2);
+        if (pos + 2 + length > jpeg.size()) {
+            return false;
+        }
+        const std::uint8_t *segment = reinterpret_cast<const std::uint8_t*>(jpeg.data()) + pos + 4;
+        if (marker == 0xC0 || marker == 0xC1) {
+            out.height = be16(jpeg, pos + 5);
+            out.width = be16(jpeg, pos + 7);
+            for (size_t i = 0; i < segment[5]; i++) {
+                Component c {segment[6 + 3 * i], (unsigned int)segment[7 + 3 * i] >> 4,
+                    (unsigned int)segment[7 + 3 * i] & 0xF, 0, 0, 0, 0, 0};
+                maxH = std::max(maxH, c.h);
+                maxV = std::max(maxV, c.v);
+                components.push_back(c);
+            }
+        }
+        else if ((marker & 0xF0) == 0xC0 && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            return false;
+        }
+        else if (marker == 0xDB) {
+            out.quantTables.append(jpeg, pos + 4, length - 2);
+        }
+        else if (marker == 0xC4) {
+            for (size_t i = 0; i + 17 <= length - 2;) {
+                Table& table = tables[(segment[i] >> 4) * 4 + (segment[i] & 3)];
+                size_t numValues = 0;
+                std::int32_t code = 0;
+                for (int bits = 1; bits <= 16; bits++) {
+                    table.valuePtr[bits] = numValues;
+                    table.minCode[bits] = code;
+                    code += segment[i + bits];
+                    numValues += segment[i + bits];
+                    table.maxCode[bits] = segment[i + bits] != 0 ? code - 1 : -1;
+                    code <<= 1;
+                }
+                if (numValues > 256 || i + 17 + numValues > length - 2) {
+                    return false;
+                }
+                std::copy(segment + i + 17, segment + i + 17 + numValues, table.values);
+                table.defined = true;
+                i += 17 + numValues;
+            }
+        }
+        else if (marker == 0xDD) {
+            out.restartInterval = be16(jpeg, pos + 4);
+        }
+        else if (marker == 0xDA) {
+            if (segment[0] != components.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < components.size(); i++) {
+                if (segment[1 + 2 * i] != components[i].id) {
+                    return false;
+                }
+                components[i].dc = segment[2 + 2 * i] >> 4;
+                components[i].ac = 4 + (segment[2 + 2 * i] & 3);
+                if (!tables[components[i].dc].defined || !tables[components[i].ac].defined) {
+                    return false;
+                }
+            }
+            pos += 2 + length;
+            break;
+        }
+        pos += 2 + length;
+    }
+    if (components.empty() || out.width == 0 || out.height == 0) {
+        return false;
+    }
+    
+    size_t mcusX, mcusY;
+    if (components.size() == 1) {
+        components[0].h = components[0].v = 1;
+        mcusX = (out.width + 7) / 8;
+        mcusY = (out.height + 7) / 8;
+    }
+    else {
+        mcusX = (out.width + 8 * maxH - 1) / (8 * maxH);
+        mcusY = (out.height + 8 * maxV - 1) / (8 * maxV);
+    }
+    out.components.assign(components.size(), std::vector<std::int16_t>());
+    for (size_t i = 0; i < components.size(); i++) {
+        components[i].blocksX = mcusX * components[i].h;
+        components[i].blocksY = mcusY * components[i].v;
+        out.components[i].assign(components[i].blocksX * components[i].blocksY * 64, 0);
+    }
+    Bits bits(jpeg, pos);
+    int nextRestart = 0;
+    for (size_t mcu = 0; mcu < mcusX * mcusY; mcu++) {
+        if (out.restartInterval != 0 && mcu != 0 && mcu % out.restartInterval == 0) {
+            if (bits.marker() != 0xD0 + nextRestart) {
+                return false;
+            }
+            nextRestart = (nextRestart + 1) % 8;
+            for (size_t i = 0; i < components.size(); i++) {
+                components[i].pred = 0;
+            }
+        }
+        size_t mcuX = mcu % mcusX, mcuY = mcu / mcusX;
+        for (size_t i = 0; i < components.size(); i++) {
+            Component& c = components[i];
+            for (size_t by = 0; by < c.v; by++) {
+                for (size_t bx = 0; bx < c.h; bx++) {
+                    size_t block = (mcuY * c.v + by) * c.blocksX + mcuX * c.h + bx;
+                    std::int16_t *coefficients = out.components[i].data() + 64 * block;
+                    int size = bits.decode(tables[c.dc]);
+                    if (size < 0 || size > 11) {
+                        return false;
+                    }
+                    c.pred += extend(bits.receive(size), size);
+                    coefficients[0] = c.pred;
+                    for (int k = 1; k < 64; k++) {
+                        int rs = bits.decode(tables[c.ac]);
+                        if (rs < 0) {
+                            return false;
+                        }
+                        if (rs == 0) {
+                            break;
+                        }
+                        k += rs >> 4;
+                        if (k >= 64) {
+                            return false;
+                        }
+                        coefficients[k] = extend(bits.receive(rs & 0xF), rs & 0xF);
+                    }
+                }
+            }
+        }
+    }
+    /* Nothing but padding and EOI after the last MCU */
+    return !bits.overrun && bits.marker() == 0xD9 && bits.position() == jpeg.size();
+}
+
+#endif
@@ -0,0 +1,165 @@
+/*
+muxtest.cpp
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+/*
+Exposes submit to queue an encode that throws
+*/
+class FailingMux : public Avi::MuxAvi {
+    public:
+        FailingMux(unsigned int width, unsigned int height, ::Avi::FrameRate fps) :
+            MuxAvi(width, height, fps) {}
+        void writeFailingFrame(size_t streamNo)
+        {
+            submit(streamNo, ::Avi::AVIIF_KEYFRAME, [](ChunkList&) {
+                throw std::runtime_error("encoder failed");
+            });
+        }
+};
+
+static void testStreamLimit()
+{
+    Avi::MuxAvi mux(16, 16, 10);
+    for (size_t i = 0; i < Avi::MuxAvi::MAX_STREAMS; i++) {
+        CHECK(mux.addRawVideoStream(16, 16, 10) == i);
+    }
+    CHECK(mux.addRawVideoStream(16, 16, 10) == Avi::MuxAvi::NO_STREAM);
+    Flac::FlacEncodeOptions flacOptions(
+        1, 16, 44100, Flac::FLAC_DEFAULT_BLOCKSIZE, Flac::FLAC_DEFAULT_LPCBITS,
+        Flac::FLAC_DEFAULT_MINPRED, Flac::FLAC_DEFAULT_MAXPRED,
+        Flac::FLAC_DEFAULT_MINPART, Flac::FLAC_DEFAULT_MAXPART, 14, 0);
+    CHECK(mux.addFlacStream(flacOptions) == Avi::MuxAvi::NO_STREAM);
+}
+
+static void testPrepareOrder(const char *path)
+{
+    int width = 16, height = 16;
+    Avi::MuxAvi mux(width, height, 10);
+    size_t video = mux.addRawVideoStream(width, height, 10);
+    std::vector<std::uint8_t> dib(width * height * 3);
+    std::vector<std::int16_t> samples(4410);
+    /* Nothing to write to yet */
+    CHECK(!mux.writeVideoFrame(video, dib));
+    CHECK(!mux.writeSamples(video, samples));
+    bool threw = false;
+    try {
+        mux.writeVideoFrameAsync(video, dib).get();
+    }
+    catch (const std::logic_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    threw = false;
+    try {
+        mux.finish();
+    }
+    catch (const std::logic_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    mux.prepare(out);
+    /* The headers are written, so the stream list is fixed */
+    CHECK(mux.addRawVideoStream(width, height, 10) == Avi::MuxAvi::NO_STREAM);
+    for (int i = 0; i < 3; i++) {
+        CHECK(mux.writeVideoFrame(video, dib));
+    }
+    mux.finish();
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    CHECK(layout.index.size() == 3);
+    CHECK(totalFrames(layout) == 3);
+}
+
+static void testWrongStreams(const char *path)
+{
+    int width = 32, height = 16;
+    Jpeg::JpegSettings jpegSettings(
+        std::pair<int, int>(width, height), nullptr, Jpeg::RELATIVE,
+        std::pair<int, int>(1, 1), 75, Jpeg::flagHuffmanDefault);
+    Flac::FlacEncodeOptions flacOptions(
+        1, 16, 44100, Flac::FLAC_DEFAULT_BLOCKSIZE, Flac::FLAC_DEFAULT_LPCBITS,
+        Flac::FLAC_DEFAULT_MINPRED, Flac::FLAC_DEFAULT_MAXPRED,
+        Flac::FLAC_DEFAULT_MINPART, Flac::FLAC_DEFAULT_MAXPART, 14, 0);
+    Avi::MuxAvi mux(width, height, 10);
+    size_t video = mux.addMjpegStream(jpegSettings, 10);
+    size_t second = mux.addMjpegStream(jpegSettings, 10);
+    size_t audio = mux.addFlacStream(flacOptions);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    mux.prepare(out);
+    std::vector<std::uint8_t> rgb(width * height * 3, 128);
+    std::vector<std::int16_t> samples(4410);
+    CHECK(!mux.writeVideoFrame(audio, rgb));
+    CHECK(!mux.writeVideoFrame(7, rgb));
+    CHECK(!mux.writeSamples(video, samples));
+    CHECK(!mux.writeSamples(7, samples));
+    bool threw = false;
+    try {
+        mux.writeSamplesAsync(second, samples).get();
+    }
+    catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    CHECK(threw);
+    for (int i = 0; i < 5; i++) {
+        CHECK(mux.writeVideoFrame(video, rgb));
+        CHECK(mux.writeVideoFrame(second, rgb));
+        CHECK(mux.writeSamples(audio, samples));
+    }
+    mux.finish();
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    /* Only the first video stream counts as frames */
+    CHECK(totalFrames(layout) == 5);
+}
+
+static void testFailedEncode(const char *path)
+{
+    int width = 16, height = 16;
+    FailingMux mux(width, height, 10);
+    size_t video = mux.addRawVideoStream(width, height, 10);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    mux.prepare(out);
+    std::vector<std::uint8_t> dib(width * height * 3);
+    mux.writeVideoFrame(video, dib);
+    mux.writeFailingFrame(video);
+    mux.writeVideoFrame(video, dib);
+    bool threw = false;
+    try {
+        mux.finish();
+    }
+    catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    out.close();
+    
+    /* Finalized anyway, without the failed frame */
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    CHECK(layout.index.size() == 2);
+}
+
+int main()
+{
+    const char *path = "muxtest.avi";
+    testStreamLimit();
+    testPrepareOrder(path);
+    testWrongStreams(path);
+    testFailedEncode(path);
+    std::remove(path);
+    return report("muxtest");
+}
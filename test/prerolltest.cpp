@@ -0,0 +1,181 @@
+/*
+prerolltest.cpp
+*/
+
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+/*
+Holds every write until opened, as a disk that has stalled would
+*/
+class GatedBuf : public std::stringbuf {
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool open;
+        void waitOpen()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] {return open;});
+        }
+    protected:
+        virtual std::streamsize xsputn(const char *data, std::streamsize size)
+        {
+            waitOpen();
+            return std::stringbuf::xsputn(data, size);
+        }
+        virtual int_type overflow(int_type c)
+        {
+            waitOpen();
+            return std::stringbuf::overflow(c);
+        }
+    public:
+        GatedBuf() : std::stringbuf(std::ios_base::out), open {false} {}
+        void release()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                open = true;
+            }
+            cv.notify_all();
+        }
+};
+
+static void testStalledWriter()
+{
+    int width = 32, height = 32;
+    float fps = 10;
+    /* Room for a few frames only */
+    Avi::PrerollAvi avi(1.0, 8192, 256, width, height, fps, 16, 44100, 1);
+    GatedBuf gated;
+    std::ostream out(&gated);
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    int frames = 60, triggerAt = 10;
+    for (int i = 0; i < frames; i++) {
+        for (size_t j = 0; j < rgb.size(); j++) {
+            rgb[j] = (std::uint8_t)(i * 5 + j * 3);
+        }
+        /* Would never return if the writer had to make room first */
+        avi.writeVideoFrame(rgb);
+        if (i == triggerAt) {
+            avi.trigger(out);
+        }
+    }
+    CHECK(avi.droppedChunks() > 0);
+    CHECK(avi.oversizeChunks() == 0);
+    gated.release();
+    avi.finish();
+    
+    std::string path = "prerolltest.avi";
+    std::string data = gated.str();
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    std::fwrite(data.data(), 1, data.size(), file);
+    std::fclose(file);
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    /* Every frame from the first buffered one keeps its slot, dropped ones as empty chunks */
+    size_t empty = 0;
+    for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+        empty += it->size == 0;
+    }
+    CHECK(empty >= avi.droppedChunks());
+    CHECK(layout.index.size() == totalFrames(layout));
+    CHECK(totalFrames(layout) >= (size_t)(frames - triggerAt));
+    std::remove(path.c_str());
+}
+
+static void testOversize()
+{
+    int width = 32, height = 32;
+    Avi::PrerollAvi avi(1.0, 16, 256, width, height, 10, 16, 44100, 1);
+    std::vector<std::uint8_t> rgb(width * height * 3, 100);
+    for (int i = 0; i < 5; i++) {
+        avi.writeVideoFrame(rgb);
+    }
+    CHECK(avi.oversizeChunks() == 5);
+    avi.finish();
+}
+
+/*
+Audio chunks span several frames, so the first frame kept after the trigger
+falls somewhere inside one and the streams' first chunks start at different times.
+With the samples written ahead of their frame, the chunk playing at that frame
+can be complete, and buffered, before it.
+*/
+static void testSync(int triggerAt, bool samplesFirst)
+{
+    int width = 32, height = 32, frames = 50;
+    size_t samplesPerFrame = 4410;
+    Avi::PrerollAvi avi(1.0, 1 << 20, 1024, width, height, 10, 16, 44100, 1);
+    CHECK(avi.setAudioChunking(4));
+    std::stringstream out;
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    std::vector<std::int16_t> samples(samplesPerFrame);
+    for (int i = 0; i < frames; i++) {
+        for (size_t j = 0; j < samples.size(); j++) {
+            samples[j] = (std::int16_t)((i * 131 + j * 17) % 4000);
+        }
+        if (samplesFirst) {
+            avi.writeSamples(samples);
+        }
+        avi.writeVideoFrame(rgb);
+        if (!samplesFirst) {
+            avi.writeSamples(samples);
+        }
+        if (i == triggerAt) {
+            avi.trigger(out);
+        }
+    }
+    avi.finish();
+    CHECK(avi.droppedChunks() == 0);
+    
+    std::string path = "prerolltest.avi";
+    std::string data = out.str();
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    std::fwrite(data.data(), 1, data.size(), file);
+    std::fclose(file);
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    std::remove(path.c_str());
+    CHECK(layout.streams.size() == 2);
+    if (layout.streams.size() != 2) {
+        return;
+    }
+    size_t videoChunks = 0, audioChunks = 0;
+    for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+        (it->streamNo == 0 ? videoChunks : audioChunks)++;
+    }
+    /* When the first kept chunk of each stream was recorded */
+    const Avi::AviLayout::Stream& video = layout.streams[0];
+    const Avi::AviLayout::Stream& audio = layout.streams[1];
+    double videoTick = (double)video.scale / video.rate;
+    double audioTick = (double)audio.scale / audio.rate;
+    size_t blocks = (frames * samplesPerFrame + Flac::FLAC_DEFAULT_BLOCKSIZE - 1) / Flac::FLAC_DEFAULT_BLOCKSIZE;
+    double videoFirst = (frames - videoChunks) * videoTick;
+    double audioFirst = ((blocks + 3) / 4 - audioChunks) * audioTick;
+    CHECK(videoChunks < (size_t)frames);
+    /* The audio chunk playing at the first frame is kept, so only the video needs delaying */
+    CHECK(audioFirst <= videoFirst);
+    CHECK(audio.start == 0);
+    CHECK(std::fabs(video.start * videoTick - (videoFirst - audioFirst)) <= videoTick / 2);
+}
+
+int main()
+{
+    testStalledWriter();
+    testOversize();
+    for (int triggerAt = 20; triggerAt < 30; triggerAt++) {
+        testSync(triggerAt, false);
+        testSync(triggerAt, true);
+    }
+    return report("prerolltest");
+}
@@ -0,0 +1,156 @@
+/*
+profiletest.cpp
+Meaningful when built with AVIUTIL_PROFILE (make PROFILE=1); otherwise checks that nothing is recorded
+*/
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+constexpr static int WIDTH = 32;
+constexpr static int HEIGHT = 32;
+constexpr static int FRAMES = 5;
+
+struct alignas(64) Block {
+    std::uint8_t data[64];
+};
+
+static void writeFlacMjpegAvi()
+{
+    Avi::FlacMjpegAvi avi(WIDTH, HEIGHT, 10);
+    std::stringstream out;
+    avi.prepare(out);
+#ifdef AVIUTIL_PROFILE
+    /* hdrl's length and each strl's, but not the first avih */
+    CHECK(Avi::Profiler::global().getCalls(Avi::Profiler::HEADER_REWRITE) == 3);
+#endif
+    std::vector<std::uint8_t> rgb(WIDTH * HEIGHT * 3);
+    std::vector<std::int16_t> samples(4410);
+    for (int frame = 0; frame < FRAMES; frame++) {
+        avi.writeVideoFrame(out, rgb);
+        avi.writeSamples(out, samples);
+    }
+    avi.finish(out);
+}
+
+static void writePrerollAvi()
+{
+    Avi::PrerollAvi avi(1.0, 1 << 20, 1024, WIDTH, HEIGHT, 10, 16, 44100, 1);
+    std::stringstream out;
+    avi.trigger(out);
+    std::vector<std::uint8_t> rgb(WIDTH * HEIGHT * 3);
+    std::vector<std::int16_t> samples(4410);
+    for (int frame = 0; frame < FRAMES; frame++) {
+        avi.writeVideoFrame(rgb);
+        avi.writeSamples(samples);
+    }
+    avi.finish();
+}
+
+#ifdef AVIUTIL_PROFILE
+
+/*
+The calls column of a section's line in the report, 0 if there's no line for it
+*/
+static std::uint64_t reportedCalls(const std::string& report, const std::string& section)
+{
+    size_t pos = report.rfind(section);
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    std::istringstream line(report.substr(pos + section.size()));
+    std::uint64_t calls = 0;
+    line >> calls;
+    return calls;
+}
+
+static void testReports()
+{
+    Avi::Profiler& profiler = Avi::Profiler::global();
+    profiler.reset();
+    std::stringstream report;
+    profiler.setReportStream(&report);
+    writeFlacMjpegAvi();
+    std::string first = report.str();
+    CHECK(reportedCalls(first, "writeSamples") == FRAMES);
+    /* The rewrites inside finalize's count once, with it */
+    CHECK(reportedCalls(first, "header rewrite") == 4);
+    CHECK(reportedCalls(first, "finalize") == 1);
+    /* Each file starts from nothing */
+    CHECK(profiler.getCalls(Avi::Profiler::WRITE_FRAME) == 0);
+    CHECK(profiler.getCalls(Avi::Profiler::FINALIZE) == 0);
+
+    writePrerollAvi();
+    std::string both = report.str();
+    CHECK(both.size() > first.size());
+    CHECK(reportedCalls(both, "finalize") == 1);
+    CHECK(profiler.getCalls(Avi::Profiler::FINALIZE) == 0);
+
+    profiler.setReportStream(nullptr);
+    writeFlacMjpegAvi();
+    CHECK(report.str() == both);
+}
+
+static void testScopes()
+{
+    Avi::Profiler& profiler = Avi::Profiler::global();
+    profiler.reset();
+    {
+        Avi::Profiler::Scope outer(Avi::Profiler::FINALIZE);
+        Avi::Profiler::Scope inner(Avi::Profiler::FINALIZE);
+        Avi::Profiler::Scope disabled(Avi::Profiler::WRITE_FRAME, false);
+    }
+    CHECK(profiler.getCalls(Avi::Profiler::FINALIZE) == 1);
+    CHECK(profiler.getCalls(Avi::Profiler::WRITE_FRAME) == 0);
+}
+
+static void testAlignedNew()
+{
+    Avi::Profiler& profiler = Avi::Profiler::global();
+    profiler.reset();
+#ifndef AVIUTIL_PROFILE_NO_NEW
+    {
+        Avi::Profiler::Scope scope(Avi::Profiler::WRITE_FRAME);
+        Block *block = new Block;
+        CHECK((reinterpret_cast<std::uintptr_t>(block) & 63) == 0);
+        delete block;
+        Block *blocks = new Block[3];
+        CHECK((reinterpret_cast<std::uintptr_t>(blocks) & 63) == 0);
+        delete[] blocks;
+    }
+    CHECK(profiler.getAllocations(Avi::Profiler::WRITE_FRAME) == 2);
+#endif
+}
+
+#else
+
+static void testNothingRecorded()
+{
+    Avi::Profiler& profiler = Avi::Profiler::global();
+    std::stringstream report;
+    profiler.setReportStream(&report);
+    writeFlacMjpegAvi();
+    writePrerollAvi();
+    profiler.setReportStream(nullptr);
+    CHECK(report.str().empty());
+    for (size_t i = 0; i < Avi::Profiler::SECTIONS; i++) {
+        CHECK(profiler.getCalls(static_cast<Avi::Profiler::Section>(i)) == 0);
+    }
+}
+
+#endif
+
+int main()
+{
+#ifdef AVIUTIL_PROFILE
+    testReports();
+    testScopes();
+    testAlignedNew();
+#else
+    testNothingRecorded();
+#endif
+    return report("profiletest");
+}
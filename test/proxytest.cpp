@@ -0,0 +1,158 @@
+/*
+proxytest.cpp
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+#include "jpegdecode.hpp"
+#include "testutil.hpp"
+
+/*
+Exposes the streams' JPEG settings
+*/
+class ProxyAvi : public Avi::FlacMjpegAvi {
+    public:
+        ProxyAvi(const Jpeg::JpegSettings& jpegSettings, const Flac::FlacEncodeOptions& flacSettings) :
+            FlacMjpegAvi(jpegSettings, flacSettings, 30) {}
+        const Jpeg::JpegSettings& settings(size_t streamNo)
+        {
+            return static_cast<const ::Avi::AviMjpegStream&>(operator[](streamNo)).getSettings();
+        }
+};
+
+static Flac::FlacEncodeOptions flacOptions()
+{
+    return Flac::FlacEncodeOptions(
+        1, 16, 44100, Flac::FLAC_DEFAULT_BLOCKSIZE, Flac::FLAC_DEFAULT_LPCBITS,
+        Flac::FLAC_DEFAULT_MINPRED, Flac::FLAC_DEFAULT_MAXPRED,
+        Flac::FLAC_DEFAULT_MINPART, Flac::FLAC_DEFAULT_MAXPART, 14, 0);
+}
+
+static void testProxy(const char *path)
+{
+    int width = 128, height = 96;
+    Jpeg::JpegSettings jpegSettings(
+        std::pair<int, int>(width, height), nullptr, Jpeg::RELATIVE,
+        std::pair<int, int>(2, 2), 85, Jpeg::flagHuffmanDefault);
+    ProxyAvi avi(jpegSettings, flacOptions());
+    CHECK(!avi.addProxyStream(0));
+    CHECK(avi.addProxyStream(4, 2, 40));
+    CHECK(!avi.addProxyStream(2));
+    /* The main stream's settings at the proxy's size and quality */
+    const Jpeg::JpegSettings& proxy = avi.settings(2);
+    CHECK((proxy.size == std::pair<int, int>(32, 24)));
+    CHECK(proxy.quality == 40);
+    CHECK(proxy.components == jpegSettings.components);
+    CHECK(proxy.bitDepth == jpegSettings.bitDepth);
+    
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    avi.prepare(out);
+    CHECK(!avi.addProxyStream(4));
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    for (int frame = 0; frame < 10; frame++) {
+        for (size_t i = 0; i < rgb.size(); i++) {
+            rgb[i] = (std::uint8_t)(frame * 5 + i % 13);
+        }
+        avi.writeVideoFrame(out, rgb);
+    }
+    avi.finish(out);
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    CHECK(layout.streams.size() == 3);
+    /* Proxy chunks are 02dc but only the full frames count */
+    CHECK(totalFrames(layout) == 10);
+    std::vector<std::uint8_t> data = readFile(path);
+    size_t proxies = 0;
+    for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+        if (it->streamNo != 2) {
+            continue;
+        }
+        proxies++;
+        std::string jpeg(data.begin() + it->offset + 8, data.begin() + it->offset + 8 + it->size);
+        JpegCoefficients coefficients;
+        CHECK(decodeJpeg(jpeg, coefficients));
+        CHECK(coefficients.width == 32 && coefficients.height == 24);
+    }
+    CHECK(proxies == 5);
+}
+
+static void testAfterFirstChunk()
+{
+    Avi::FlacMjpegAvi avi(64, 48);
+    std::stringstream out;
+    std::vector<std::uint8_t> rgb(64 * 48 * 3);
+    avi.writeVideoFrame(out, rgb);
+    CHECK(!avi.addProxyStream(2));
+}
+
+/*
+Fails the full frame's write while the proxy may still be reading the caller's frame
+*/
+class FailingAvi : public Avi::FlacMjpegAvi {
+    public:
+        bool fail;
+        FailingAvi() : FlacMjpegAvi(64, 48), fail {false} {}
+        using ::Avi::Avi::writeFrame;
+        virtual void writeFrame(
+            std::ostream& stream, size_t streamNo, const ::Avi::MediaTime& time, std::uint32_t flags,
+            const std::uint8_t *data, size_t size)
+        {
+            if (fail && streamNo == 0) {
+                throw std::runtime_error("write failed");
+            }
+            ::Avi::Avi::writeFrame(stream, streamNo, time, flags, data, size);
+        }
+};
+
+static void testFailedWrite()
+{
+    FailingAvi avi;
+    CHECK(avi.addProxyStream(2));
+    std::stringstream out;
+    avi.prepare(out);
+    avi.fail = true;
+    std::unique_ptr<std::vector<std::uint8_t>> rgb = std::make_unique<std::vector<std::uint8_t>>(64 * 48 * 3, 90);
+    bool thrown = false;
+    try {
+        avi.writeVideoFrame(out, *rgb);
+    }
+    catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    /* The proxy is done with the frame by the time the write has failed */
+    rgb.reset();
+    avi.fail = false;
+    std::vector<std::uint8_t> next(64 * 48 * 3, 30);
+    avi.writeVideoFrame(out, next);
+    avi.finish(out);
+    
+    std::string path = "proxytest-failed.avi";
+    std::string data = out.str();
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    std::fwrite(data.data(), 1, data.size(), file);
+    std::fclose(file);
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    std::remove(path.c_str());
+    CHECK(totalFrames(layout) == 1);
+}
+
+int main()
+{
+    const char *path = "proxytest.avi";
+    testProxy(path);
+    testAfterFirstChunk();
+    testFailedWrite();
+    std::remove(path);
+    return report("proxytest");
+}
@@ -0,0 +1,109 @@
+/*
+ratetest.cpp
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+/*
+Exposes the encoder switching
+*/
+class RateAvi : public Avi::FlacMjpegAvi {
+    public:
+        RateAvi(const Jpeg::JpegSettings& jpegSettings, const Flac::FlacEncodeOptions& flacSettings) :
+            FlacMjpegAvi(jpegSettings, flacSettings, 30) {}
+        using FlacMjpegAvi::settingsFor;
+        using FlacMjpegAvi::setQuality;
+        const Jpeg::Jpeg *encoder() const
+        {
+            return jpeg.get();
+        }
+};
+
+static Flac::FlacEncodeOptions flacOptions()
+{
+    return Flac::FlacEncodeOptions(
+        1, 16, 44100, Flac::FLAC_DEFAULT_BLOCKSIZE, Flac::FLAC_DEFAULT_LPCBITS,
+        Flac::FLAC_DEFAULT_MINPRED, Flac::FLAC_DEFAULT_MAXPRED,
+        Flac::FLAC_DEFAULT_MINPART, Flac::FLAC_DEFAULT_MAXPART, 14, 0);
+}
+
+static void testSettingsFor()
+{
+    Jpeg::JpegSettings settings(
+        std::pair<int, int>(64, 48), nullptr, Jpeg::RELATIVE,
+        std::pair<int, int>(2, 2), 80, Jpeg::flagHuffmanOptimal);
+    RateAvi avi(settings, flacOptions());
+    Jpeg::JpegSettings lower = avi.settingsFor(30);
+    CHECK(lower.quality == 30);
+    CHECK(lower.size == settings.size);
+    CHECK(lower.components == settings.components);
+    CHECK(lower.bitDepth == settings.bitDepth);
+}
+
+static void testEncoderCache()
+{
+    Jpeg::JpegSettings settings(
+        std::pair<int, int>(64, 48), nullptr, Jpeg::RELATIVE,
+        std::pair<int, int>(1, 1), 80, Jpeg::flagHuffmanDefault);
+    RateAvi avi(settings, flacOptions());
+    const Jpeg::Jpeg *base = avi.encoder();
+    avi.setQuality(40);
+    const Jpeg::Jpeg *low = avi.encoder();
+    CHECK(low != base);
+    avi.setQuality(80);
+    CHECK(avi.encoder() == base);
+    avi.setQuality(40);
+    CHECK(avi.encoder() == low);
+    /* Turning rate control off goes back to the stream's own quality */
+    avi.setRateControl(0);
+    CHECK(avi.encoder() == base);
+}
+
+static void testTargetRate(const char *path)
+{
+    int width = 160, height = 120;
+    Avi::FlacMjpegAvi avi(width, height, 30.0f, 16, 44100, 1, Avi::NORMAL, 95);
+    double target = 60000;
+    avi.setRateControl(target, 1.0, 5, 95);
+    avi.setSlices(2);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    avi.prepare(out);
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    int frames = 90;
+    for (int frame = 0; frame < frames; frame++) {
+        for (size_t i = 0; i < rgb.size(); i++) {
+            rgb[i] = (std::uint8_t)((i * 2654435761u + frame * 7919) >> 24);
+        }
+        avi.writeVideoFrame(out, rgb.data());
+    }
+    avi.finish(out);
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    double bytes = 0;
+    for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+        if (it->streamNo == 0) {
+            bytes += it->size;
+        }
+    }
+    /* Noise at quality 95 is several times the target */
+    double rate = bytes / frames * 30;
+    CHECK(rate < 1.5 * target);
+}
+
+int main()
+{
+    const char *path = "ratetest.avi";
+    testSettingsFor();
+    testEncoderCache();
+    testTargetRate(path);
+    std::remove(path);
+    return report("ratetest");
+}
@@ -0,0 +1,87 @@
+/*
+schedtest.cpp
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+/*
+One job holds a thread of a two thread pool and queues work behind itself,
+so the other thread has to steal all of it
+*/
+static void testStealOrder()
+{
+    Avi::Scheduler scheduler(2);
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool gateStarted = false, gateOpen = false, done = false;
+    std::vector<int> order;
+    auto record = [&](int n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        order.push_back(n);
+        cv.notify_all();
+    };
+    size_t stealsBefore = scheduler.getSteals();
+    scheduler.post([&] {
+        /* Keeps the other thread busy until every job below is queued */
+        scheduler.post([&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            gateStarted = true;
+            cv.notify_all();
+            cv.wait(lock, [&] {return gateOpen;});
+        });
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait_for(lock, std::chrono::seconds(10), [&] {return gateStarted;});
+        }
+        for (int i = 1; i <= 4; i++) {
+            scheduler.post([&, i] {record(i);}, Avi::Scheduler::LOW);
+        }
+        scheduler.post([&] {record(0);}, Avi::Scheduler::HIGH);
+        std::unique_lock<std::mutex> lock(mutex);
+        gateOpen = true;
+        cv.notify_all();
+        cv.wait_for(lock, std::chrono::seconds(10), [&] {return order.size() == 5;});
+        done = true;
+    });
+    while (scheduler.getExecuted() < 7) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK(done);
+    /* Higher priority first, then the oldest */
+    CHECK((order == std::vector<int> {0, 1, 2, 3, 4}));
+    CHECK(scheduler.getSteals() - stealsBefore >= 6);
+    CHECK(scheduler.getQueued() == 0);
+}
+
+static void testQueueOrder()
+{
+    Avi::Scheduler scheduler(4);
+    std::atomic<int> next {0};
+    std::atomic<bool> ordered {true};
+    {
+        Avi::Scheduler::Queue queue(scheduler, Avi::Scheduler::NORMAL, 1);
+        for (int i = 0; i < 1000; i++) {
+            queue.post([&, i] {
+                if (next++ != i) {
+                    ordered = false;
+                }
+            });
+        }
+    }
+    CHECK(next == 1000);
+    CHECK(ordered);
+}
+
+int main()
+{
+    testStealOrder();
+    testQueueOrder();
+    return report("schedtest");
+}
@@ -0,0 +1,101 @@
+/*
+slicetest.cpp
+*/
+
+#include <cstdint>
+#include <future>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+#include "jpegdecode.hpp"
+#include "testutil.hpp"
+
+static std::vector<std::uint8_t> pattern(int width, int height)
+{
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            std::uint8_t *pixel = rgb.data() + 3 * (y * width + x);
+            pixel[0] = (std::uint8_t)(x * 255 / width);
+            pixel[1] = (std::uint8_t)(y * 255 / height);
+            pixel[2] = (std::uint8_t)((x * 7 + y * 13) ^ (x * y));
+        }
+    }
+    return rgb;
+}
+
+/*
+The stitched frame has to decode to the same coefficients as the frame
+encoded whole: slices end on MCU rows, and each restart resets the DC
+prediction just as encoding a slice on its own starts it from zero
+*/
+static void testStitch(int width, int height, size_t numSlices)
+{
+    Jpeg::JpegSettings settings(
+        std::pair<int, int>(width, height), nullptr, Jpeg::RELATIVE,
+        std::pair<int, int>(1, 1), 80, Jpeg::flagHuffmanDefault);
+    std::vector<std::uint8_t> rgb = pattern(width, height);
+    
+    Jpeg::Jpeg whole(settings);
+    std::stringstream sstr;
+    whole.encodeRGB(rgb.data());
+    whole.write(sstr);
+    JpegCoefficients expected;
+    CHECK(decodeJpeg(sstr.str(), expected));
+    
+    Avi::SlicedJpegEncoder slicer(settings, numSlices);
+    std::string stitched;
+    CHECK(slicer.encode(rgb.data(), stitched));
+    JpegCoefficients actual;
+    /* Also fails on restart markers out of sequence, so this covers RST numbering */
+    CHECK(decodeJpeg(stitched, actual));
+    CHECK(actual.width == (unsigned int)width);
+    CHECK(actual.height == (unsigned int)height);
+    if (slicer.numSlices() > 1) {
+        unsigned int mcusPerRow = (width + 15) / 16;
+        unsigned int sliceRows = (height + slicer.numSlices() - 1) / slicer.numSlices();
+        sliceRows = (sliceRows + Avi::SlicedJpegEncoder::SLICE_ALIGN - 1) /
+            Avi::SlicedJpegEncoder::SLICE_ALIGN * Avi::SlicedJpegEncoder::SLICE_ALIGN;
+        CHECK(actual.restartInterval == sliceRows / 16 * mcusPerRow);
+    }
+    CHECK(actual.quantTables == expected.quantTables);
+    CHECK(actual.components == expected.components);
+}
+
+/*
+A throwing job fails its own future and the worker goes on to the next one
+*/
+static void testWorkerError()
+{
+    Avi::SerialWorker worker;
+    int ran = 0;
+    std::future<void> failed = worker.post([] {
+        throw std::runtime_error("encode failed");
+    });
+    std::future<void> next = worker.post([&ran] {
+        ran++;
+    });
+    bool thrown = false;
+    try {
+        failed.get();
+    }
+    catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    next.get();
+    CHECK(ran == 1);
+}
+
+int main()
+{
+    testWorkerError();
+    testStitch(64, 64, 4);
+    /* Partial MCUs at the right and in the last slice */
+    testStitch(100, 70, 3);
+    /* More than eight slices, so the RST numbers wrap */
+    testStitch(48, 160, 10);
+    return report("slicetest");
+}
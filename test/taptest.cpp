@@ -0,0 +1,143 @@
+/*
+taptest.cpp
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+/*
+Writes a clip through the tap, returning the chunks the file got in write order
+*/
+static std::vector<std::vector<std::uint8_t>> writeClip(const char *path, Avi::ChunkTap& tap)
+{
+    int width = 64, height = 48;
+    Avi::FlacMjpegAvi avi(width, height, 10);
+    avi.setTap(&tap);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    avi.prepare(out);
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    std::vector<std::int16_t> samples(4410);
+    for (int frame = 0; frame < 20; frame++) {
+        for (size_t i = 0; i < rgb.size(); i++) {
+            rgb[i] = (std::uint8_t)(frame * 9 + i % 11);
+        }
+        avi.writeVideoFrame(out, rgb);
+        avi.writeSamples(out, samples);
+    }
+    avi.finish(out);
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    std::vector<std::uint8_t> data = readFile(path);
+    std::vector<Avi::AviLayout::Entry> entries = layout.index;
+    std::sort(entries.begin(), entries.end(), [](const Avi::AviLayout::Entry& a, const Avi::AviLayout::Entry& b) {
+        return a.offset < b.offset;
+    });
+    std::vector<std::vector<std::uint8_t>> chunks;
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+        chunks.emplace_back(data.begin() + it->offset + 8, data.begin() + it->offset + 8 + it->size);
+    }
+    return chunks;
+}
+
+static void testInProcess(const char *path)
+{
+    Avi::ChunkTap tap(1 << 20, 256);
+    Avi::ChunkTap::Consumer reader = tap.subscribe();
+    std::vector<std::vector<std::uint8_t>> chunks = writeClip(path, tap);
+    CHECK(tap.getPublished() == chunks.size());
+    Avi::TapChunk chunk;
+    size_t read = 0;
+    while (reader.poll(chunk)) {
+        CHECK(read < chunks.size());
+        CHECK(chunk.sequence == read);
+        std::vector<std::uint8_t> payload(chunk.data, chunk.data + chunk.size);
+        CHECK(reader.valid(chunk));
+        CHECK(read < chunks.size() && payload == chunks[read]);
+        read++;
+    }
+    /* The ring holds all of this short clip */
+    CHECK(read == chunks.size());
+    CHECK(!reader.isDropped());
+    
+    /* Overtaken by more chunks than there are slots */
+    Avi::ChunkTap small(1 << 20, 8);
+    Avi::ChunkTap::Consumer behind = small.subscribe();
+    writeClip(path, small);
+    CHECK(!behind.poll(chunk));
+    CHECK(behind.isDropped());
+}
+
+/*
+A reader in a child process maps the segment by name and checks what it sees
+*/
+static void testSharedMemory(const char *path)
+{
+    std::string name = "/aviutil-taptest-" + std::to_string(getpid());
+    Avi::ChunkTap tap(name, 1 << 20, 256);
+    CHECK(tap.isOpen());
+    if (!tap.isOpen()) {
+        return;
+    }
+    int ready[2], done[2];
+    CHECK(pipe(ready) == 0 && pipe(done) == 0);
+    pid_t child = fork();
+    if (child == 0) {
+        Avi::ChunkTap mapped(name);
+        Avi::ChunkTap::Consumer reader = mapped.subscribe();
+        char byte = mapped.isOpen();
+        CHECK(write(ready[1], &byte, 1) == 1);
+        CHECK(read(done[0], &byte, 1) == 1);
+        std::vector<std::uint8_t> sizes;
+        Avi::TapChunk chunk;
+        std::uint32_t count = 0, checksum = 0;
+        while (reader.poll(chunk)) {
+            checksum = Avi::crc32c(chunk.data, chunk.size, checksum);
+            count += reader.valid(chunk);
+        }
+        std::uint32_t result[2] = {count, checksum};
+        CHECK(write(ready[1], result, sizeof(result)) == sizeof(result));
+        _exit(0);
+    }
+    char byte = 0;
+    CHECK(read(ready[0], &byte, 1) == 1);
+    CHECK(byte == 1);
+    std::vector<std::vector<std::uint8_t>> chunks = writeClip(path, tap);
+    CHECK(write(done[1], &byte, 1) == 1);
+    std::uint32_t result[2] = {0, 0};
+    CHECK(read(ready[0], result, sizeof(result)) == sizeof(result));
+    int status = 0;
+    waitpid(child, &status, 0);
+    std::uint32_t checksum = 0;
+    for (auto it = chunks.begin(); it != chunks.end(); it++) {
+        checksum = Avi::crc32c(it->data(), it->size(), checksum);
+    }
+    CHECK(result[0] == chunks.size());
+    CHECK(result[1] == checksum);
+    
+    /* The name is gone with the writer */
+    {
+        Avi::ChunkTap other(name + "-gone", 4096, 4);
+    }
+    Avi::ChunkTap gone(name + "-gone");
+    CHECK(!gone.isOpen());
+}
+
+int main()
+{
+    const char *path = "taptest.avi";
+    testInProcess(path);
+    testSharedMemory(path);
+    std::remove(path);
+    return report("taptest");
+}
@@ -0,0 +1,78 @@
+/*
+testutil.hpp
+Checks shared by the tests, each of which is a program that exits non-zero on failure
+*/
+
+#ifndef _AVIUTIL_TESTUTIL_HPP
+#define _AVIUTIL_TESTUTIL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "aviutil.hpp"
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+static inline bool readLayout(const std::string& path, Avi::AviLayout& layout)
+{
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool read = Avi::readLayout(file, layout);
+    std::fclose(file);
+    return read;
+}
+
+static inline std::uint32_t readLE32(const std::uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (std::uint32_t)data[3] << 24;
+}
+
+/*
+avih dwTotalFrames
+*/
+static inline std::uint32_t totalFrames(const Avi::AviLayout& layout)
+{
+    return readLE32(layout.hdrl.data() + layout.avihOffset + Riff::FOURCC_SIZE + Riff::LENGTH_SIZE +
+        offsetof(Avi::Raw::AviMainHeader, totalFrames));
+}
+
+static inline std::vector<std::uint8_t> readFile(const std::string& path)
+{
+    std::vector<std::uint8_t> data;
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return data;
+    }
+    std::uint8_t buffer[4096];
+    size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) != 0) {
+        data.insert(data.end(), buffer, buffer + read);
+    }
+    std::fclose(file);
+    return data;
+}
+
+static inline int report(const char *name)
+{
+    if (failures != 0) {
+        std::cerr << name << ": " << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << name << ": passed" << std::endl;
+    return 0;
+}
+
+#endif
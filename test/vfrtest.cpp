@@ -0,0 +1,77 @@
+/*
+vfrtest.cpp
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include "aviutil.hpp"
+#include "testutil.hpp"
+
+static void testRebasedSlots(const char *path)
+{
+    int width = 16, height = 16;
+    Avi::FlacMjpegAvi avi(width, height, 10);
+    avi.setMaxGap(5);
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary);
+    avi.prepare(out);
+    std::vector<std::uint8_t> rgb(width * height * 3, 90);
+    /* Capture clock about 58 days after boot */
+    std::uint64_t uptime = 5000000000000;
+    CHECK(avi.writeVideoFrame(out, rgb.data(), uptime));
+    CHECK(avi.writeVideoFrame(out, rgb.data(), uptime + 100000));
+    /* Slot 2 is skipped */
+    CHECK(avi.writeVideoFrame(out, rgb.data(), uptime + 300000));
+    /* Earlier than the first frame, goes in the next free slot */
+    CHECK(avi.writeVideoFrame(out, rgb.data(), uptime - 500000));
+    /* Slot 20 is further than 5 drop chunks away */
+    CHECK(!avi.writeVideoFrame(out, rgb.data(), uptime + 2000000));
+    avi.finish(out);
+    out.close();
+    
+    Avi::AviLayout layout;
+    CHECK(readLayout(path, layout));
+    size_t video = 0, dropped = 0;
+    for (auto it = layout.index.begin(); it != layout.index.end(); it++) {
+        if (it->streamNo == 0) {
+            video++;
+            dropped += it->size == 0;
+        }
+    }
+    CHECK(video == 5);
+    CHECK(dropped == 1);
+    CHECK(totalFrames(layout) == 5);
+}
+
+static void testZeroRate()
+{
+    int width = 16, height = 16;
+    std::vector<std::uint8_t> frame(width * height * 3);
+    Avi::FlacMjpegAvi avi(width, height, Avi::FrameRate(0, 1));
+    std::ostream discard(nullptr);
+    CHECK(!avi.writeVideoFrame(discard, frame.data(), 0));
+    
+    Avi::MuxAvi mux(width, height, 10);
+    size_t raw = mux.addRawVideoStream(width, height, Avi::FrameRate(30, 0));
+    mux.prepare(discard);
+    mux.writeVideoFrame(raw, frame.data(), 0);
+    bool threw = false;
+    try {
+        mux.finish();
+    }
+    catch (const std::out_of_range&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+int main()
+{
+    const char *path = "vfrtest.avi";
+    testRebasedSlots(path);
+    testZeroRate();
+    std::remove(path);
+    return report("vfrtest");
+}